@@ -20,20 +20,32 @@
 #include <string.h>
 
 extern int gpio_main(int argc, char *argv[]);
+extern int gpio_group_main(int argc, char *argv[]);
 extern int i2c_main(int argc, char *argv[]);
 extern int spi_main(int argc, char *argv[]);
+extern int pwm_main(int argc, char *argv[]);
+extern int encoder_main(int argc, char *argv[]);
+extern int keypad_main(int argc, char *argv[]);
 
 int main(int argc, char *argv[])
 {
     if (argc < 2)
-        errx(EXIT_FAILURE, "Must pass mode (e.g. gpio, i2c, spi)");
+        errx(EXIT_FAILURE, "Must pass mode (e.g. gpio, i2c, spi, pwm)");
 
     if (strcmp(argv[1], "gpio") == 0)
         return gpio_main(argc, argv);
+    else if (strcmp(argv[1], "gpio_group") == 0)
+        return gpio_group_main(argc, argv);
     else if (strcmp(argv[1], "i2c") == 0)
         return i2c_main(argc, argv);
     else if (strcmp(argv[1], "spi") == 0)
         return spi_main(argc, argv);
+    else if (strcmp(argv[1], "pwm") == 0)
+        return pwm_main(argc, argv);
+    else if (strcmp(argv[1], "encoder") == 0)
+        return encoder_main(argc, argv);
+    else if (strcmp(argv[1], "keypad") == 0)
+        return keypad_main(argc, argv);
     else
         errx(EXIT_FAILURE, "Unknown mode '%s'", argv[1]);
 
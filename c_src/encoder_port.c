@@ -0,0 +1,262 @@
+/*
+ * Copyright (C) 2015 Frank Hunleth
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * Quadrature encoder decoding on two GPIOs
+ */
+
+#include <err.h>
+#include <errno.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "erlcmd.h"
+#include "gpio_port.h"
+
+//#define DEBUG
+#ifdef DEBUG
+#define debug(...) do { fprintf(stderr, __VA_ARGS__); fprintf(stderr, "\r\n"); } while(0)
+#else
+#define debug(...)
+#endif
+
+// Velocity is measured over at least this long
+#define ENCODER_VELOCITY_WINDOW_NS 100000000ULL
+
+struct encoder {
+    struct gpio a;
+    struct gpio b;
+
+    // Last (A << 1) | B
+    int state;
+
+    int64_t position;
+    uint64_t errors;
+
+    // Position at the start of the velocity window
+    uint64_t window_start_ns;
+    int64_t window_start_position;
+    int64_t velocity;   // Counts per second
+
+    // Position change notifications. 0 for off.
+    uint64_t notify_interval_ns;
+    uint64_t last_notify_ns;
+    int64_t last_notify_position;
+};
+
+/*
+ * Change in position for each transition from the previous state
+ * (row) to the new one (column). States are Gray coded as 00, 01, 11, 10
+ * going forward. Transitions where both inputs changed mean that an
+ * edge was missed and count as 0.
+ */
+static const int8_t encoder_transitions[4][4] = {
+    // to 00  01  10  11
+    {  0,  1, -1,  0 },  // from 00
+    { -1,  0,  0,  1 },  // from 01
+    {  1,  0,  0, -1 },  // from 10
+    {  0, -1,  1,  0 }   // from 11
+};
+
+static uint64_t encoder_now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void encoder_update_velocity(struct encoder *encoder, uint64_t now_ns)
+{
+    uint64_t elapsed_ns = now_ns - encoder->window_start_ns;
+    if (elapsed_ns < ENCODER_VELOCITY_WINDOW_NS)
+        return;
+
+    encoder->velocity = (encoder->position - encoder->window_start_position) * 1000000000LL / (int64_t) elapsed_ns;
+    encoder->window_start_ns = now_ns;
+    encoder->window_start_position = encoder->position;
+}
+
+/**
+ * @brief	Decode the inputs after an edge on either of them
+ */
+static void encoder_process(struct encoder *encoder)
+{
+    int state = (gpio_read(&encoder->a) << 1) | gpio_read(&encoder->b);
+    int from = encoder->state;
+    encoder->state = state;
+
+    if (state == from)
+        return;
+
+    if ((state ^ from) == 3)
+        encoder->errors++;
+    else
+        encoder->position += encoder_transitions[from][state];
+
+    encoder_update_velocity(encoder, encoder_now_ns());
+}
+
+static void encoder_notify(struct encoder *encoder, uint64_t now_ns)
+{
+    char resp[64];
+    int resp_index = sizeof(uint32_t) + 1; // Space for payload size and type
+    resp[4] = 1; // Notification
+    ei_encode_version(resp, &resp_index);
+    ei_encode_tuple_header(resp, &resp_index, 3);
+    ei_encode_atom(resp, &resp_index, "encoder_position");
+    ei_encode_longlong(resp, &resp_index, encoder->position);
+    ei_encode_longlong(resp, &resp_index, encoder->velocity);
+    erlcmd_send(resp, resp_index);
+
+    encoder->last_notify_ns = now_ns;
+    encoder->last_notify_position = encoder->position;
+}
+
+/**
+ * @brief	Send a notification if the position changed and it's been
+ *          long enough since the last one
+ *
+ * @return	How many ms until one could be sent, or -1 if none are pending
+ */
+static int encoder_check_notify(struct encoder *encoder)
+{
+    if (encoder->notify_interval_ns == 0 ||
+            encoder->position == encoder->last_notify_position)
+        return -1;
+
+    uint64_t now_ns = encoder_now_ns();
+    uint64_t next_ns = encoder->last_notify_ns + encoder->notify_interval_ns;
+    if (now_ns >= next_ns) {
+        encoder_update_velocity(encoder, now_ns);
+        encoder_notify(encoder, now_ns);
+        return -1;
+    }
+    return (next_ns - now_ns + 999999) / 1000000;
+}
+
+static void encoder_handle_request(const char *req, void *cookie)
+{
+    struct encoder *encoder = (struct encoder *) cookie;
+
+    // Commands are of the form {Command, Arguments}:
+    // { atom(), term() }
+    int req_index = sizeof(uint32_t);
+    if (ei_decode_version(req, &req_index, NULL) < 0)
+        errx(EXIT_FAILURE, "Message version issue?");
+
+    int arity;
+    if (ei_decode_tuple_header(req, &req_index, &arity) < 0 ||
+            arity != 2)
+        errx(EXIT_FAILURE, "expecting {cmd, args} tuple");
+
+    char cmd[MAXATOMLEN];
+    if (ei_decode_atom(req, &req_index, cmd) < 0)
+        errx(EXIT_FAILURE, "expecting command atom");
+
+    char resp[256];
+    int resp_index = sizeof(uint32_t) + 1; // Space for payload size and type
+    resp[4] = 0; // Reply
+    ei_encode_version(resp, &resp_index);
+    if (strcmp(cmd, "read") == 0) {
+        debug("read");
+        encoder_update_velocity(encoder, encoder_now_ns());
+        ei_encode_tuple_header(resp, &resp_index, 3);
+        ei_encode_longlong(resp, &resp_index, encoder->position);
+        ei_encode_longlong(resp, &resp_index, encoder->velocity);
+        ei_encode_ulonglong(resp, &resp_index, encoder->errors);
+    } else if (strcmp(cmd, "set_position") == 0) {
+        long long position;
+        if (ei_decode_longlong(req, &req_index, &position) < 0)
+            errx(EXIT_FAILURE, "set_position: expecting position");
+        debug("set_position %lld", position);
+        encoder->position = position;
+        encoder->window_start_position = position;
+        encoder->last_notify_position = position;
+        ei_encode_atom(resp, &resp_index, "ok");
+    } else if (strcmp(cmd, "notify") == 0) {
+        unsigned long interval_ms;
+        if (ei_decode_ulong(req, &req_index, &interval_ms) < 0)
+            errx(EXIT_FAILURE, "notify: expecting interval_ms");
+        debug("notify %lu", interval_ms);
+        encoder->notify_interval_ns = interval_ms * 1000000ULL;
+        encoder->last_notify_ns = 0;
+        encoder->last_notify_position = encoder->position;
+        ei_encode_atom(resp, &resp_index, "ok");
+    } else
+        errx(EXIT_FAILURE, "unknown command: %s", cmd);
+
+    debug("sending response: %d bytes", resp_index);
+    erlcmd_send(resp, resp_index);
+}
+
+int encoder_main(int argc, char *argv[])
+{
+    if (argc != 4)
+        errx(EXIT_FAILURE, "%s encoder <pin a#> <pin b#>", argv[0]);
+
+    struct encoder encoder;
+    memset(&encoder, 0, sizeof(encoder));
+    int pin_a = strtol(argv[2], NULL, 0);
+    int pin_b = strtol(argv[3], NULL, 0);
+    if (gpio_init(&encoder.a, pin_a, GPIO_INPUT) < 0)
+        errx(EXIT_FAILURE, "Couldn't initialize gpio %d", pin_a);
+    if (gpio_init(&encoder.b, pin_b, GPIO_INPUT) < 0)
+        errx(EXIT_FAILURE, "Couldn't initialize gpio %d", pin_b);
+    if (gpio_set_int(&encoder.a, "both") < 0 ||
+            gpio_set_int(&encoder.b, "both") < 0)
+        errx(EXIT_FAILURE, "Couldn't enable edges on gpios %d and %d", pin_a, pin_b);
+
+    encoder.state = (gpio_read(&encoder.a) << 1) | gpio_read(&encoder.b);
+    encoder.window_start_ns = encoder_now_ns();
+
+    struct erlcmd handler;
+    erlcmd_init(&handler, encoder_handle_request, &encoder);
+
+    for (;;) {
+        struct pollfd fdset[3];
+
+        fdset[0].fd = STDIN_FILENO;
+        fdset[0].events = POLLIN;
+        fdset[0].revents = 0;
+
+        fdset[1].fd = encoder.a.fd;
+        fdset[1].events = POLLPRI;
+        fdset[1].revents = 0;
+
+        fdset[2].fd = encoder.b.fd;
+        fdset[2].events = POLLPRI;
+        fdset[2].revents = 0;
+
+        int rc = poll(fdset, 3, encoder_check_notify(&encoder));
+        if (rc < 0) {
+            // Retry if EINTR
+            if (errno == EINTR)
+                continue;
+
+            err(EXIT_FAILURE, "poll");
+        }
+
+        if (fdset[0].revents & (POLLIN | POLLHUP))
+            erlcmd_process(&handler);
+
+        if (fdset[1].revents & POLLPRI || fdset[2].revents & POLLPRI)
+            encoder_process(&encoder);
+    }
+
+    return 0;
+}
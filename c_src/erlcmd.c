@@ -34,10 +34,54 @@ void erlcmd_init(struct erlcmd *handler,
 {
     memset(handler, 0, sizeof(*handler));
 
+    handler->buffer = malloc(ERLCMD_BUF_SIZE);
+    if (!handler->buffer)
+	err(EXIT_FAILURE, "malloc");
+    handler->size = ERLCMD_BUF_SIZE;
+
     handler->request_handler = request_handler;
     handler->cookie = cookie;
 }
 
+/**
+ * @brief Decode a binary without copying it
+ *
+ * @param buf the request
+ * @param index the offset of the binary, updated to point past it
+ * @param data set to the start of the binary's data in buf
+ * @param len set to the length of the binary
+ * @return 0 for success, -1 if not a binary like the ei_decode functions
+ */
+int erlcmd_decode_binary_view(const char *buf, int *index, const char **data, int *len)
+{
+    int type;
+    if (ei_get_type(buf, index, &type, len) < 0 ||
+	    type != ERL_BINARY_EXT)
+	return -1;
+
+    *data = &buf[*index + ERLCMD_BINARY_HEADER_SIZE];
+    *index += ERLCMD_BINARY_HEADER_SIZE + *len;
+    return 0;
+}
+
+/**
+ * @brief Encode the header for a binary whose data will be written in place
+ *
+ * The data goes at buf + *index once this returns. The caller must
+ * advance index by len after filling it in.
+ *
+ * @param buf the response
+ * @param index where to put the header, updated to point to the data
+ * @param len the length of the binary
+ */
+void erlcmd_encode_binary_header(char *buf, int *index, int len)
+{
+    uint32_t be_len = htonl(len);
+    buf[*index] = ERL_BINARY_EXT;
+    memcpy(&buf[*index + 1], &be_len, sizeof(be_len));
+    *index += ERLCMD_BINARY_HEADER_SIZE;
+}
+
 /**
  * @brief Synchronously send a response back to Erlang
  *
@@ -45,7 +89,7 @@ void erlcmd_init(struct erlcmd *handler,
  */
 void erlcmd_send(char *response, size_t len)
 {
-    uint16_t be_len = htons(len - sizeof(uint16_t));
+    uint32_t be_len = htonl(len - sizeof(uint32_t));
     memcpy(response, &be_len, sizeof(be_len));
 
     size_t wrote = 0;
@@ -69,22 +113,31 @@ void erlcmd_send(char *response, size_t len)
 static size_t erlcmd_try_dispatch(struct erlcmd *handler)
 {
     /* Check for length field */
-    if (handler->index < sizeof(uint16_t))
+    if (handler->index < sizeof(uint32_t))
 	return 0;
 
-    uint16_t be_len;
-    memcpy(&be_len, handler->buffer, sizeof(uint16_t));
-    size_t msglen = ntohs(be_len);
-    if (msglen + sizeof(uint16_t) > sizeof(handler->buffer))
+    uint32_t be_len;
+    memcpy(&be_len, handler->buffer, sizeof(uint32_t));
+    size_t msglen = ntohl(be_len);
+    if (msglen + sizeof(uint32_t) > ERLCMD_MAX_MSG_SIZE)
 	errx(EXIT_FAILURE, "Message too long");
 
+    /* Make room for the whole message */
+    if (msglen + sizeof(uint32_t) > handler->size) {
+	char *buffer = realloc(handler->buffer, msglen + sizeof(uint32_t));
+	if (!buffer)
+	    err(EXIT_FAILURE, "realloc");
+	handler->buffer = buffer;
+	handler->size = msglen + sizeof(uint32_t);
+    }
+
     /* Check whether we've received the entire message */
-    if (msglen + sizeof(uint16_t) > handler->index)
+    if (msglen + sizeof(uint32_t) > handler->index)
 	return 0;
 
     handler->request_handler(handler->buffer, handler->cookie);
 
-    return msglen + sizeof(uint16_t);
+    return msglen + sizeof(uint32_t);
 }
 
 /**
@@ -92,7 +145,7 @@ static size_t erlcmd_try_dispatch(struct erlcmd *handler)
  */
 void erlcmd_process(struct erlcmd *handler)
 {
-    ssize_t amount_read = read(STDIN_FILENO, handler->buffer + handler->index, sizeof(handler->buffer) - handler->index);
+    ssize_t amount_read = read(STDIN_FILENO, handler->buffer + handler->index, handler->size - handler->index);
     if (amount_read < 0) {
 	/* EINTR is ok to get, since we were interrupted by a signal. */
 	if (errno == EINTR)
@@ -23,17 +23,33 @@
 
 /*
  * Erlang request/response processing
+ *
+ * Messages are framed with a 4 byte big endian length ({packet, 4}).
+ * The receive buffer starts small and grows as needed up to
+ * ERLCMD_MAX_MSG_SIZE so that large transfers fit in one message.
  */
 #define ERLCMD_BUF_SIZE 1024
+#define ERLCMD_MAX_MSG_SIZE (1024 * 1024)
 struct erlcmd
 {
-    char buffer[ERLCMD_BUF_SIZE];
+    char *buffer;
+    size_t size;
     size_t index;
 
     void (*request_handler)(const char *emsg, void *cookie);
     void *cookie;
 };
 
+/*
+ * Binaries are encoded as a tag byte and a 4 byte length followed by the
+ * data. These helpers let handlers use binaries in place instead of
+ * copying them through ei_decode_binary and ei_encode_binary.
+ */
+#define ERLCMD_BINARY_HEADER_SIZE 5
+
+int erlcmd_decode_binary_view(const char *buf, int *index, const char **data, int *len);
+void erlcmd_encode_binary_header(char *buf, int *index, int len);
+
 void erlcmd_init(struct erlcmd *handler,
 		 void (*request_handler)(const char *req, void *cookie),
 		 void *cookie);
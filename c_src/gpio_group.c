@@ -0,0 +1,273 @@
+/*
+ * Copyright (C) 2015 Frank Hunleth
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * GPIO groups on the gpiochip character device
+ */
+
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <linux/gpio.h>
+
+#include "erlcmd.h"
+#include "gpio_port.h"
+#include "waveform.h"
+
+//#define DEBUG
+#ifdef DEBUG
+#define debug(...) do { fprintf(stderr, __VA_ARGS__); fprintf(stderr, "\r\n"); } while(0)
+#else
+#define debug(...)
+#endif
+
+/**
+ * @brief	Request lines from a gpiochip as one group
+ *
+ * All of the lines are requested in one gpio_v2_line_request so that
+ * the kernel reads and sets them with one call. Outputs start low.
+ *
+ * @param	group       The group structure
+ * @param	chip        Path to the gpiochip like /dev/gpiochip0
+ * @param	offsets     The line offsets on the chip
+ * @param	num_lines   How many lines (up to GPIO_GROUP_MAX)
+ * @param	dir         Direction of all of the lines
+ *
+ * @return 	1 for success, -1 for failure
+ */
+int gpio_group_init(struct gpio_group *group, const char *chip,
+                    const unsigned int *offsets, unsigned int num_lines,
+                    enum gpio_state dir)
+{
+    group->fd = -1;
+    group->num_lines = num_lines;
+    group->state = dir;
+
+    int chip_fd = open(chip, O_RDWR | O_CLOEXEC);
+    if (chip_fd < 0)
+        return -1;
+
+    struct gpio_v2_line_request req;
+    memset(&req, 0, sizeof(req));
+    for (unsigned int i = 0; i < num_lines; i++)
+        req.offsets[i] = offsets[i];
+    strncpy(req.consumer, "erlang_ale", sizeof(req.consumer) - 1);
+    req.config.flags = (dir == GPIO_OUTPUT ? GPIO_V2_LINE_FLAG_OUTPUT : GPIO_V2_LINE_FLAG_INPUT);
+    req.num_lines = num_lines;
+
+    int rc = ioctl(chip_fd, GPIO_V2_GET_LINE_IOCTL, &req);
+    close(chip_fd);
+    if (rc < 0)
+        return -1;
+
+    group->fd = req.fd;
+    return 1;
+}
+
+static uint64_t gpio_group_all_lines(const struct gpio_group *group)
+{
+    return group->num_lines == 64 ? ~0ULL : (1ULL << group->num_lines) - 1;
+}
+
+/**
+ * @brief	Read all of the lines in a group
+ *
+ * @param	group       The group structure
+ * @param	values      Bit i is set to the value of line i
+ *
+ * @return 	1 for success, -1 for failure
+ */
+int gpio_group_read(struct gpio_group *group, uint64_t *values)
+{
+    struct gpio_v2_line_values lv;
+    lv.bits = 0;
+    lv.mask = gpio_group_all_lines(group);
+    if (ioctl(group->fd, GPIO_V2_LINE_GET_VALUES_IOCTL, &lv) < 0)
+        return -1;
+
+    *values = lv.bits;
+    return 1;
+}
+
+/**
+ * @brief	Set the lines in a group that are in a mask
+ *
+ * The lines change together since it's one call to the kernel. Lines
+ * not in the mask keep their values.
+ *
+ * @param	group       The group structure
+ * @param	mask        Bit i is set to change line i
+ * @param	values      Bit i is the new value of line i
+ *
+ * @return 	1 for success, -1 for failure
+ */
+int gpio_group_write(struct gpio_group *group, uint64_t mask, uint64_t values)
+{
+    if (group->state != GPIO_OUTPUT)
+        return -1;
+
+    struct gpio_v2_line_values lv;
+    lv.mask = mask & gpio_group_all_lines(group);
+    lv.bits = values & lv.mask;
+    if (lv.mask == 0)
+        return 1;
+
+    if (ioctl(group->fd, GPIO_V2_LINE_SET_VALUES_IOCTL, &lv) < 0)
+        return -1;
+
+    return 1;
+}
+
+struct gpio_group_port {
+    struct gpio_group group;
+    struct waveform_player player;
+};
+
+static int gpio_group_waveform_write(void *cookie, uint64_t value)
+{
+    struct gpio_group *group = (struct gpio_group *) cookie;
+    return gpio_group_write(group, gpio_group_all_lines(group), value);
+}
+
+static void gpio_group_handle_request(const char *req, void *cookie)
+{
+    struct gpio_group_port *port = (struct gpio_group_port *) cookie;
+    struct gpio_group *group = &port->group;
+
+    // Commands are of the form {Command, Arguments}:
+    // { atom(), term() }
+    int req_index = sizeof(uint32_t);
+    if (ei_decode_version(req, &req_index, NULL) < 0)
+        errx(EXIT_FAILURE, "Message version issue?");
+
+    int arity;
+    if (ei_decode_tuple_header(req, &req_index, &arity) < 0 ||
+            arity != 2)
+        errx(EXIT_FAILURE, "expecting {cmd, args} tuple");
+
+    char cmd[MAXATOMLEN];
+    if (ei_decode_atom(req, &req_index, cmd) < 0)
+        errx(EXIT_FAILURE, "expecting command atom");
+
+    char resp[256];
+    int resp_index = sizeof(uint32_t) + 1; // Space for payload size and type
+    resp[4] = 0; // Reply
+    ei_encode_version(resp, &resp_index);
+    if (strcmp(cmd, "read_all") == 0) {
+        debug("read_all");
+        uint64_t values;
+        if (gpio_group_read(group, &values) > 0)
+            ei_encode_ulonglong(resp, &resp_index, values);
+        else {
+            ei_encode_tuple_header(resp, &resp_index, 2);
+            ei_encode_atom(resp, &resp_index, "error");
+            ei_encode_atom(resp, &resp_index, "gpio_read_failed");
+        }
+    } else if (strcmp(cmd, "write_mask") == 0) {
+        unsigned long long mask;
+        unsigned long long values;
+        if (ei_decode_tuple_header(req, &req_index, &arity) < 0 ||
+                arity != 2 ||
+                ei_decode_ulonglong(req, &req_index, &mask) < 0 ||
+                ei_decode_ulonglong(req, &req_index, &values) < 0)
+            errx(EXIT_FAILURE, "write_mask: expecting {mask, values}");
+        debug("write_mask %llx %llx", mask, values);
+        waveform_stop(&port->player);
+        if (gpio_group_write(group, mask, values) > 0)
+            ei_encode_atom(resp, &resp_index, "ok");
+        else {
+            ei_encode_tuple_header(resp, &resp_index, 2);
+            ei_encode_atom(resp, &resp_index, "error");
+            ei_encode_atom(resp, &resp_index, "gpio_write_failed");
+        }
+    } else if (strcmp(cmd, "play") == 0) {
+        debug("play");
+        if (group->state != GPIO_OUTPUT) {
+            ei_encode_tuple_header(resp, &resp_index, 2);
+            ei_encode_atom(resp, &resp_index, "error");
+            ei_encode_atom(resp, &resp_index, "gpio_play_failed");
+        } else
+            waveform_play_request(&port->player, req, &req_index, resp, &resp_index);
+    } else if (strcmp(cmd, "stop_play") == 0) {
+        debug("stop_play");
+        waveform_stop(&port->player);
+        ei_encode_atom(resp, &resp_index, "ok");
+    } else
+        errx(EXIT_FAILURE, "unknown command: %s", cmd);
+
+    debug("sending response: %d bytes", resp_index);
+    erlcmd_send(resp, resp_index);
+}
+
+int gpio_group_main(int argc, char *argv[])
+{
+    if (argc < 5 || argc - 4 > GPIO_GROUP_MAX)
+        errx(EXIT_FAILURE, "%s gpio_group <chip> <input|output> <line#>...", argv[0]);
+
+    enum gpio_state dir;
+    if (strcmp(argv[3], "input") == 0)
+        dir = GPIO_INPUT;
+    else if (strcmp(argv[3], "output") == 0)
+        dir = GPIO_OUTPUT;
+    else
+        errx(EXIT_FAILURE, "Specify 'input' or 'output'");
+
+    unsigned int num_lines = argc - 4;
+    unsigned int offsets[GPIO_GROUP_MAX];
+    for (unsigned int i = 0; i < num_lines; i++)
+        offsets[i] = strtoul(argv[4 + i], NULL, 0);
+
+    struct gpio_group_port port;
+    if (gpio_group_init(&port.group, argv[2], offsets, num_lines, dir) < 0)
+        err(EXIT_FAILURE, "Couldn't request lines from %s", argv[2]);
+    waveform_init(&port.player, gpio_group_waveform_write, &port.group, 1);
+
+    struct erlcmd handler;
+    erlcmd_init(&handler, gpio_group_handle_request, &port);
+
+    for (;;) {
+        struct pollfd fdset[2];
+
+        fdset[0].fd = STDIN_FILENO;
+        fdset[0].events = POLLIN;
+        fdset[0].revents = 0;
+
+        fdset[1].fd = port.player.timer_fd;
+        fdset[1].events = POLLIN;
+        fdset[1].revents = 0;
+
+        int rc = poll(fdset, 2, -1);
+        if (rc < 0) {
+            // Retry if EINTR
+            if (errno == EINTR)
+                continue;
+
+            err(EXIT_FAILURE, "poll");
+        }
+
+        if (fdset[0].revents & (POLLIN | POLLHUP))
+            erlcmd_process(&handler);
+
+        if (fdset[1].revents & POLLIN)
+            waveform_process(&port.player);
+    }
+
+    return 0;
+}
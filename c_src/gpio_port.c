@@ -16,16 +16,24 @@
  */
 
 #include <err.h>
+#include <errno.h>
 #include <poll.h>
+#include <sched.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
+#include <sys/file.h>
+#include <sys/mman.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/timerfd.h>
 #include <fcntl.h>
 
 #include "erlcmd.h"
+#include "gpio_port.h"
+#include "waveform.h"
 
 //#define DEBUG
 #ifdef DEBUG
@@ -34,30 +42,6 @@
 #define debug(...)
 #endif
 
-/*
- * GPIO handling definitions and prototypes
- */
-enum gpio_state {
-    GPIO_OUTPUT,
-    GPIO_INPUT
-};
-
-enum interrupt_mode {
-    GPIO_INT_NONE,
-    GPIO_INT_BOTH,
-    GPIO_INT_RISING,
-    GPIO_INT_FALLING,
-    GPIO_INT_SUMMARIZE
-};
-
-struct gpio {
-    enum gpio_state state;
-    int fd;
-    int pin_number;
-    enum interrupt_mode int_mode;
-    int last_value;
-};
-
 /**
  * @brief write a string to a sysfs file
  * @return returns 0 on failure, >0 on success
@@ -84,6 +68,21 @@ int sysfs_write_file(const char *pathname, const char *value)
 
 // GPIO functions
 
+static void gpio_init_fields(struct gpio *pin, unsigned int pin_number, enum gpio_state dir)
+{
+    pin->state = dir;
+    pin->fd = -1;
+    pin->pin_number = pin_number;
+    pin->int_mode = GPIO_INT_NONE;
+    pin->last_value = -1;
+    pin->regs = NULL;
+    pin->layout = NULL;
+    pin->cache = 0;
+    pin->cached_value = -1;
+    pin->writes = 0;
+    pin->suppressed_writes = 0;
+}
+
 /**
  * @brief	Open and configure a GPIO
  *
@@ -96,11 +95,7 @@ int sysfs_write_file(const char *pathname, const char *value)
 int gpio_init(struct gpio *pin, unsigned int pin_number, enum gpio_state dir)
 {
     /* Initialize the pin structure. */
-    pin->state = dir;
-    pin->fd = -1;
-    pin->pin_number = pin_number;
-    pin->int_mode = GPIO_INT_NONE;
-    pin->last_value = -1;
+    gpio_init_fields(pin, pin_number, dir);
 
     /* Construct the gpio control file paths */
     char direction_path[64];
@@ -145,9 +140,103 @@ int gpio_init(struct gpio *pin, unsigned int pin_number, enum gpio_state dir)
     return 1;
 }
 
+// Memory mapped GPIO registers
+
+/*
+ * Where a SoC's GPIO registers are relative to the start of the block
+ * that's mapped. Offsets are in bytes. Set, clear and level registers
+ * have one bit per pin and function select registers have
+ * function_bits per pin, both starting with pin 0 in the lowest bits
+ * of the first register.
+ */
+struct gpio_mmio_layout {
+    const char *name;
+    size_t size;                // Bytes to map
+    unsigned int max_pins;
+    uint32_t function_offset;
+    unsigned int function_bits;
+    uint32_t function_input;
+    uint32_t function_output;
+    uint32_t set_offset;        // Write 1s to drive pins high
+    uint32_t clear_offset;      // Write 1s to drive pins low
+    uint32_t level_offset;      // Read pin levels
+};
+
+static const struct gpio_mmio_layout gpio_mmio_layouts[] = {
+    // Raspberry Pi 1-4. /dev/gpiomem maps just this block.
+    { "bcm2835", 0xb4, 54, 0x00, 3, 0, 1, 0x1c, 0x28, 0x34 },
+    { NULL, 0, 0, 0, 0, 0, 0, 0, 0, 0 }
+};
+
+static volatile uint32_t *gpio_mmio_reg(struct gpio *pin, uint32_t offset, unsigned int bits_per_pin)
+{
+    unsigned int pins_per_reg = 32 / bits_per_pin;
+    return &pin->regs[offset / 4 + pin->pin_number / pins_per_reg];
+}
+
+/**
+ * @brief	Open a GPIO through its SoC's memory mapped registers
+ *
+ * This skips sysfs and the kernel altogether on reads and writes, but
+ * edge interrupts aren't available. The path is normally /dev/gpiomem,
+ * but a regular file can stand in for the register block for testing.
+ *
+ * @param	pin           The pin structure
+ * @param	pin_number    The GPIO pin
+ * @param	dir           Direction of pin (input or output)
+ * @param	path          What to map
+ * @param	layout_name   Which register layout it has
+ *
+ * @return 	1 for success, -1 for failure
+ */
+int gpio_init_mmio(struct gpio *pin, unsigned int pin_number, enum gpio_state dir,
+                   const char *path, const char *layout_name)
+{
+    gpio_init_fields(pin, pin_number, dir);
+
+    const struct gpio_mmio_layout *layout;
+    for (layout = gpio_mmio_layouts; layout->name; layout++) {
+        if (strcmp(layout->name, layout_name) == 0)
+            break;
+    }
+    if (!layout->name || pin_number >= layout->max_pins)
+        return -1;
+
+    int fd = open(path, O_RDWR | O_SYNC | O_CLOEXEC);
+    if (fd < 0)
+        return -1;
+
+    // Accessing past the end of a stand-in file would be a SIGBUS
+    struct stat st;
+    if (fstat(fd, &st) < 0 ||
+            (S_ISREG(st.st_mode) && (size_t) st.st_size < layout->size)) {
+        close(fd);
+        return -1;
+    }
+
+    void *regs = mmap(NULL, layout->size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (regs == MAP_FAILED)
+        return -1;
+
+    pin->regs = (volatile uint32_t *) regs;
+    pin->layout = layout;
+
+    volatile uint32_t *fsel = gpio_mmio_reg(pin, layout->function_offset, layout->function_bits);
+    unsigned int shift = (pin_number % (32 / layout->function_bits)) * layout->function_bits;
+    uint32_t mask = ((1U << layout->function_bits) - 1) << shift;
+    uint32_t function = dir == GPIO_OUTPUT ? layout->function_output : layout->function_input;
+    *fsel = (*fsel & ~mask) | (function << shift);
+
+    return 1;
+}
+
 /**
  * @brief	Set pin with the value "0" or "1"
  *
+ * Writing the value that the pin already has is skipped if caching is
+ * on for the pin.
+ *
  * @param	pin           The pin structure
  * @param       value         Value to set (0 or 1)
  *
@@ -158,6 +247,20 @@ int gpio_write(struct gpio *pin, unsigned int val)
     if (pin->state != GPIO_OUTPUT)
         return -1;
 
+    val = !!val;
+    if (pin->cache && pin->cached_value == (int) val) {
+        pin->suppressed_writes++;
+        return 1;
+    }
+    pin->writes++;
+    pin->cached_value = val;
+
+    if (pin->regs) {
+        uint32_t offset = val ? pin->layout->set_offset : pin->layout->clear_offset;
+        *gpio_mmio_reg(pin, offset, 1) = 1U << (pin->pin_number % 32);
+        return 1;
+    }
+
     char buf = val ? '1' : '0';
     ssize_t amount_written = pwrite(pin->fd, &buf, sizeof(buf), 0);
     if (amount_written < (ssize_t) sizeof(buf))
@@ -169,12 +272,21 @@ int gpio_write(struct gpio *pin, unsigned int val)
 /**
 * @brief	Read the value of the pin
 *
+* Outputs return what was last written without reading it back if
+* caching is on for the pin.
+*
 * @param	pin            The GPIO pin
 *
 * @return 	The pin value if success, -1 for failure
 */
 int gpio_read(struct gpio *pin)
 {
+    if (pin->state == GPIO_OUTPUT && pin->cache && pin->cached_value >= 0)
+        return pin->cached_value;
+
+    if (pin->regs)
+        return (*gpio_mmio_reg(pin, pin->layout->level_offset, 1) >> (pin->pin_number % 32)) & 1;
+
     char buf;
     ssize_t amount_read = pread(pin->fd, &buf, sizeof(buf), 0);
     if (amount_read < (ssize_t) sizeof(buf))
@@ -183,6 +295,36 @@ int gpio_read(struct gpio *pin)
     return buf == '1' ? 1 : 0;
 }
 
+static int gpio_write_edge(struct gpio *pin, enum interrupt_mode mode)
+{
+    // Memory mapped GPIOs don't get interrupts
+    if (pin->regs)
+        return -1;
+
+    const char *edge_mode;
+    switch (mode) {
+    case GPIO_INT_NONE:
+        edge_mode = "none";
+        break;
+    case GPIO_INT_RISING:
+        edge_mode = "rising";
+        break;
+    case GPIO_INT_FALLING:
+        edge_mode = "falling";
+        break;
+    default:
+        edge_mode = "both";
+        break;
+    }
+
+    char path[64];
+    sprintf(path, "/sys/class/gpio/gpio%d/edge", pin->pin_number);
+    if (!sysfs_write_file(path, edge_mode))
+        return -1;
+
+    return 1;
+}
+
 /**
  * Set isr as the interrupt service routine (ISR) for the pin.
  *
@@ -229,35 +371,60 @@ int gpio_set_int(struct gpio *pin, const char *mode)
      */
     pin->last_value = -1;
 
-    const char *edge_mode;
-    switch (pin->int_mode) {
-    case GPIO_INT_NONE:
-        edge_mode = "none";
-        break;
-    case GPIO_INT_RISING:
-        edge_mode = "rising";
-        break;
-    case GPIO_INT_FALLING:
-        edge_mode = "falling";
-        break;
-    default:
-        edge_mode = "both";
-        break;
-    }
-
-    char path[64];
-    sprintf(path, "/sys/class/gpio/gpio%d/edge", pin->pin_number);
-    if (!sysfs_write_file(path, edge_mode))
+    if (gpio_write_edge(pin, pin->int_mode) < 0)
         return -1;
 
     return 1;
 }
 
+/**
+ * @brief	Claim a list of GPIOs for another port to use
+ *
+ * The list is of {pin_number, initial_value} where an initial value
+ * of -1 makes the GPIO an input. GPIOs from an earlier call are
+ * released first.
+ *
+ * @return 	1 for success, 0 for failure
+ */
+int gpio_init_list(struct gpio *gpios, unsigned int *gpio_count, unsigned int max_count,
+                   const char *req, int *req_index)
+{
+    int count;
+    if (ei_decode_list_header(req, req_index, &count) < 0 ||
+            count > (int) max_count)
+        errx(EXIT_FAILURE, "init_gpios: need a list of up to %d {pin_number, initial_value}", max_count);
+
+    for (unsigned int i = 0; i < *gpio_count; i++)
+        close(gpios[i].fd);
+    *gpio_count = 0;
+
+    int ok = 1;
+    for (int i = 0; i < count; i++) {
+        int arity;
+        unsigned long pin_number;
+        long value;
+        if (ei_decode_tuple_header(req, req_index, &arity) < 0 ||
+                arity != 2 ||
+                ei_decode_ulong(req, req_index, &pin_number) < 0 ||
+                ei_decode_long(req, req_index, &value) < 0)
+            errx(EXIT_FAILURE, "init_gpios: expecting {pin_number, initial_value}");
+
+        struct gpio *pin = &gpios[*gpio_count];
+        if (ok && gpio_init(pin, pin_number, value < 0 ? GPIO_INPUT : GPIO_OUTPUT) > 0) {
+            if (value >= 0)
+                gpio_write(pin, value);
+            (*gpio_count)++;
+        } else
+            ok = 0;
+    }
+    return ok;
+}
+
 static void gpio_report_interrupt(int pin_number, int is_rising)
 {
     char resp[256];
-    int resp_index = sizeof(uint16_t) + 1; // Space for payload size and type
-    resp[2] = 1; // Notification
+    int resp_index = sizeof(uint32_t) + 1; // Space for payload size and type
+    resp[4] = 1; // Notification
     ei_encode_version(resp, &resp_index);
     ei_encode_tuple_header(resp, &resp_index, 3);
     ei_encode_atom(resp, &resp_index, "gpio_interrupt");
@@ -267,15 +434,16 @@ static void gpio_report_interrupt(int pin_number, int is_rising)
 }
 
 /**
- * Called after poll() returns when the GPIO sysfs file indicates
- * a status change.
+ * Report an edge according to the pin's interrupt mode
  *
- * @param pin which pin to check
+ * @param pin which pin changed
+ * @param value the value read after the change
+ * @param both_edges 1 if the sysfs edge file was set to "both" for
+ *                   another reason so that rising and falling edges
+ *                   need to be told apart by value
  */
-void gpio_process(struct gpio *pin)
+static void gpio_report_value(struct gpio *pin, int value, int both_edges)
 {
-    int value = gpio_read(pin);
-
     switch (pin->int_mode) {
     case GPIO_INT_RISING:
         /* We don't need to check the value, since we know that
@@ -283,11 +451,13 @@ void gpio_process(struct gpio *pin)
            at one time. It could be that the value is 0 if it
            was a transient, so it would be a race condition if
            we did use it. */
-        gpio_report_interrupt(pin->pin_number, 1);
+        if (!both_edges || value)
+            gpio_report_interrupt(pin->pin_number, 1);
         break;
 
     case GPIO_INT_FALLING:
-        gpio_report_interrupt(pin->pin_number, 0);
+        if (!both_edges || !value)
+            gpio_report_interrupt(pin->pin_number, 0);
         break;
 
     case GPIO_INT_SUMMARIZE:
@@ -331,13 +501,543 @@ void gpio_process(struct gpio *pin)
     pin->last_value = value;
 }
 
+/**
+ * Called after poll() returns when the GPIO sysfs file indicates
+ * a status change.
+ *
+ * @param pin which pin to check
+ */
+void gpio_process(struct gpio *pin)
+{
+    gpio_report_value(pin, gpio_read(pin), 0);
+}
+
+// Software PWM
+
+/*
+ * The port toggles the pin from its poll loop with an absolute timerfd
+ * so that a late edge doesn't push the later ones back. Each rising
+ * edge's time is recorded to report how close the periods come to
+ * what was asked for.
+ */
+struct gpio_pwm {
+    int timer_fd;             // -1 when not running
+    uint64_t period_ns;
+    uint64_t high_ns;
+    uint64_t next_edge_ns;    // When the timer is set for
+    uint64_t rise_ns;         // When the current period started
+    int falling_next;         // 1 if the timer is for the falling edge
+    long priority;            // SCHED_FIFO priority or 0 for SCHED_OTHER
+
+    // Statistics since the period was set
+    uint64_t last_rise_ns;    // Time the last rising edge was actually written
+    uint64_t periods;
+    uint64_t skipped;
+    uint64_t min_period_ns;
+    uint64_t max_period_ns;
+    uint64_t total_period_ns;
+    uint64_t max_late_ns;
+};
+
+// Reflexes
+
+#define GPIO_REFLEX_MAX 8
+
+/*
+ * A reflex drives another GPIO as soon as this one, an input, reads a
+ * given level. The other GPIO is normally an output that some other
+ * port owns, so its value file is opened without touching the
+ * direction. Unless it latches, the output goes back when the input
+ * does.
+ */
+struct gpio_reflex {
+    struct gpio output;
+    int when;                 // Input level that trips the reflex
+    int drive;                // What to drive the output to when tripped
+    int latch;                // 1 to stay tripped until reset
+    int notify;               // 1 to tell Erlang after driving the output
+    int tripped;
+};
+
+struct gpio_port {
+    struct gpio pin;
+    struct gpio_pwm pwm;
+    struct waveform_player player;
+    struct gpio_reflex reflexes[GPIO_REFLEX_MAX];
+    unsigned int reflex_count;
+};
+
+static uint64_t gpio_now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void gpio_pwm_arm(struct gpio_pwm *pwm, uint64_t when_ns)
+{
+    struct itimerspec its;
+    memset(&its, 0, sizeof(its));
+    its.it_value.tv_sec = when_ns / 1000000000ULL;
+    its.it_value.tv_nsec = when_ns % 1000000000ULL;
+    if (timerfd_settime(pwm->timer_fd, TFD_TIMER_ABSTIME, &its, NULL) < 0)
+        err(EXIT_FAILURE, "timerfd_settime");
+
+    pwm->next_edge_ns = when_ns;
+}
+
+/**
+ * @brief	Run the port with a SCHED_FIFO priority or back with
+ *          SCHED_OTHER for a priority of 0
+ *
+ * @return 	1 for success, -1 for failure
+ */
+static int gpio_pwm_set_priority(struct gpio_pwm *pwm, long priority)
+{
+    if (priority == pwm->priority)
+        return 1;
+
+    struct sched_param param;
+    param.sched_priority = priority;
+    if (sched_setscheduler(0, priority > 0 ? SCHED_FIFO : SCHED_OTHER, &param) < 0)
+        return -1;
+
+    pwm->priority = priority;
+    return 1;
+}
+
+static void gpio_pwm_stop(struct gpio *pin, struct gpio_pwm *pwm)
+{
+    if (pwm->timer_fd >= 0) {
+        close(pwm->timer_fd);
+        pwm->timer_fd = -1;
+        gpio_write(pin, 0);
+    }
+    gpio_pwm_set_priority(pwm, 0);
+}
+
+/**
+ * @brief	Start PWM or change its duty cycle
+ *
+ * If the period is the same as what's running, the new high time is
+ * used from the next period on without restarting.
+ *
+ * @return 	1 for success, -1 for failure
+ */
+static int gpio_pwm_start(struct gpio *pin, struct gpio_pwm *pwm, uint64_t period_ns, uint64_t high_ns)
+{
+    if (pin->state != GPIO_OUTPUT)
+        return -1;
+
+    if (high_ns > period_ns)
+        high_ns = period_ns;
+    pwm->high_ns = high_ns;
+    if (pwm->timer_fd >= 0 && pwm->period_ns == period_ns)
+        return 1;
+
+    gpio_pwm_stop(pin, pwm);
+    pwm->timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (pwm->timer_fd < 0)
+        return -1;
+
+    pwm->period_ns = period_ns;
+    pwm->falling_next = 0;
+    pwm->last_rise_ns = 0;
+    pwm->periods = 0;
+    pwm->skipped = 0;
+    pwm->min_period_ns = UINT64_MAX;
+    pwm->max_period_ns = 0;
+    pwm->total_period_ns = 0;
+    pwm->max_late_ns = 0;
+    gpio_pwm_arm(pwm, gpio_now_ns());
+    return 1;
+}
+
+static void gpio_pwm_process(struct gpio *pin, struct gpio_pwm *pwm)
+{
+    uint64_t expirations;
+    if (read(pwm->timer_fd, &expirations, sizeof(expirations)) < 0)
+        return;
+
+    uint64_t now = gpio_now_ns();
+    uint64_t late = now - pwm->next_edge_ns;
+    if (late > pwm->max_late_ns)
+        pwm->max_late_ns = late;
+
+    if (pwm->falling_next) {
+        gpio_write(pin, 0);
+        pwm->falling_next = 0;
+        gpio_pwm_arm(pwm, pwm->rise_ns + pwm->period_ns);
+        return;
+    }
+
+    // Rising edge. If whole periods were missed, skip them rather than
+    // trying to catch up with a burst of short ones.
+    pwm->rise_ns = pwm->next_edge_ns;
+    if (late >= pwm->period_ns) {
+        uint64_t missed = late / pwm->period_ns;
+        pwm->rise_ns += missed * pwm->period_ns;
+        pwm->skipped += missed;
+        pwm->last_rise_ns = 0;
+    }
+
+    gpio_write(pin, pwm->high_ns > 0);
+    if (pwm->last_rise_ns) {
+        uint64_t period = now - pwm->last_rise_ns;
+        if (period < pwm->min_period_ns)
+            pwm->min_period_ns = period;
+        if (period > pwm->max_period_ns)
+            pwm->max_period_ns = period;
+        pwm->total_period_ns += period;
+        pwm->periods++;
+    }
+    pwm->last_rise_ns = now;
+
+    if (pwm->high_ns > 0 && pwm->high_ns < pwm->period_ns) {
+        pwm->falling_next = 1;
+        gpio_pwm_arm(pwm, pwm->rise_ns + pwm->high_ns);
+    } else
+        gpio_pwm_arm(pwm, pwm->rise_ns + pwm->period_ns);
+}
+
+static void gpio_pwm_encode_stats(const struct gpio_pwm *pwm, char *resp, int *resp_index)
+{
+    uint64_t min = pwm->periods ? pwm->min_period_ns : 0;
+    uint64_t max = pwm->max_period_ns;
+    uint64_t mean = pwm->periods ? pwm->total_period_ns / pwm->periods : 0;
+    uint64_t jitter = 0;
+    if (pwm->periods) {
+        jitter = max - pwm->period_ns;
+        if (max < pwm->period_ns || pwm->period_ns - min > jitter)
+            jitter = pwm->period_ns - min;
+    }
+
+    ei_encode_list_header(resp, resp_index, 7);
+    ei_encode_tuple_header(resp, resp_index, 2);
+    ei_encode_atom(resp, resp_index, "periods");
+    ei_encode_ulonglong(resp, resp_index, pwm->periods);
+    ei_encode_tuple_header(resp, resp_index, 2);
+    ei_encode_atom(resp, resp_index, "skipped");
+    ei_encode_ulonglong(resp, resp_index, pwm->skipped);
+    ei_encode_tuple_header(resp, resp_index, 2);
+    ei_encode_atom(resp, resp_index, "min_period_ns");
+    ei_encode_ulonglong(resp, resp_index, min);
+    ei_encode_tuple_header(resp, resp_index, 2);
+    ei_encode_atom(resp, resp_index, "max_period_ns");
+    ei_encode_ulonglong(resp, resp_index, max);
+    ei_encode_tuple_header(resp, resp_index, 2);
+    ei_encode_atom(resp, resp_index, "mean_period_ns");
+    ei_encode_ulonglong(resp, resp_index, mean);
+    ei_encode_tuple_header(resp, resp_index, 2);
+    ei_encode_atom(resp, resp_index, "max_jitter_ns");
+    ei_encode_ulonglong(resp, resp_index, jitter);
+    ei_encode_tuple_header(resp, resp_index, 2);
+    ei_encode_atom(resp, resp_index, "max_late_ns");
+    ei_encode_ulonglong(resp, resp_index, pwm->max_late_ns);
+    ei_encode_empty_list(resp, resp_index);
+}
+
+// Waveforms
+
+static int gpio_waveform_write(void *cookie, uint64_t value)
+{
+    return gpio_write((struct gpio *) cookie, value);
+}
+
+/**
+ * @brief	Set the sysfs edge file for interrupts and reflexes
+ *
+ * Reflexes need both edges no matter what set_int asked for.
+ */
+static int gpio_port_update_edge(struct gpio_port *port)
+{
+    struct gpio *pin = &port->pin;
+    if (pin->state != GPIO_INPUT)
+        return 1;
+
+    pin->last_value = -1;
+    return gpio_write_edge(pin, port->reflex_count > 0 ? GPIO_INT_BOTH : pin->int_mode);
+}
+
+static void gpio_report_reflex(int pin_number, const struct gpio_reflex *reflex, int value)
+{
+    char resp[64];
+    int resp_index = sizeof(uint32_t) + 1; // Space for payload size and type
+    resp[4] = 1; // Notification
+    ei_encode_version(resp, &resp_index);
+    ei_encode_tuple_header(resp, &resp_index, 4);
+    ei_encode_atom(resp, &resp_index, "gpio_reflex");
+    ei_encode_long(resp, &resp_index, pin_number);
+    ei_encode_long(resp, &resp_index, reflex->output.pin_number);
+    ei_encode_long(resp, &resp_index, value);
+    erlcmd_send(resp, resp_index);
+}
+
+/**
+ * @brief	Write a reflex's output
+ *
+ * The output belongs to another port, so it may have been unexported or
+ * made an input since. That's only a warning here since exiting would
+ * take the input's port down with it.
+ *
+ * @return 	1 for success, -1 for failure
+ */
+static int gpio_reflex_write(struct gpio_reflex *reflex, int value)
+{
+    char buf = value ? '1' : '0';
+    if (pwrite(reflex->output.fd, &buf, sizeof(buf), 0) < (ssize_t) sizeof(buf)) {
+        warn("Error driving reflex output gpio %d", reflex->output.pin_number);
+        return -1;
+    }
+
+    reflex->output.writes++;
+    return 1;
+}
+
+/**
+ * @brief	Drive the outputs of the reflexes that the input's value
+ *          trips or releases
+ *
+ * All outputs are written before any notifications go out. A reflex
+ * whose output couldn't be written stays as it was so that the next
+ * edge tries again.
+ */
+static void gpio_reflex_evaluate(struct gpio_port *port, int value)
+{
+    int changed[GPIO_REFLEX_MAX];
+    for (unsigned int i = 0; i < port->reflex_count; i++) {
+        struct gpio_reflex *reflex = &port->reflexes[i];
+        changed[i] = 0;
+        if (value == reflex->when && !reflex->tripped) {
+            if (gpio_reflex_write(reflex, reflex->drive) > 0) {
+                reflex->tripped = 1;
+                changed[i] = 1;
+            }
+        } else if (value != reflex->when && reflex->tripped && !reflex->latch) {
+            if (gpio_reflex_write(reflex, !reflex->drive) > 0) {
+                reflex->tripped = 0;
+                changed[i] = 1;
+            }
+        }
+    }
+
+    for (unsigned int i = 0; i < port->reflex_count; i++) {
+        struct gpio_reflex *reflex = &port->reflexes[i];
+        if (changed[i] && reflex->notify)
+            gpio_report_reflex(port->pin.pin_number, reflex,
+                               reflex->tripped ? reflex->drive : !reflex->drive);
+    }
+}
+
+/**
+ * @brief	Check that a pin is exported as an output
+ *
+ * @return 	1 if it's an output, 0 if not
+ */
+static int gpio_reflex_is_output(unsigned long pin_number)
+{
+    char direction_path[64];
+    sprintf(direction_path, "/sys/class/gpio/gpio%lu/direction", pin_number);
+    int fd = open(direction_path, O_RDONLY);
+    if (fd < 0)
+        return 0;
+
+    char direction[4];
+    ssize_t amount_read = read(fd, direction, sizeof(direction));
+    close(fd);
+    return amount_read >= 3 && memcmp(direction, "out", 3) == 0;
+}
+
+static void gpio_reflex_clear(struct gpio_port *port)
+{
+    for (unsigned int i = 0; i < port->reflex_count; i++)
+        close(port->reflexes[i].output.fd);
+    port->reflex_count = 0;
+}
+
+/**
+ * @brief	Replace the reflexes with a list of
+ *          {when, output_pin, drive, latch, notify}
+ *
+ * The rules are checked against the input's current value right away.
+ *
+ * @return 	1 for success, -1 for failure
+ */
+static int gpio_reflex_set(struct gpio_port *port, const char *req, int *req_index)
+{
+    int count;
+    if (ei_decode_list_header(req, req_index, &count) < 0 ||
+            count > GPIO_REFLEX_MAX)
+        errx(EXIT_FAILURE, "reflex: need a list of up to %d rules", GPIO_REFLEX_MAX);
+
+    gpio_reflex_clear(port);
+
+    int ok = port->pin.state == GPIO_INPUT;
+    for (int i = 0; i < count; i++) {
+        int arity;
+        long when;
+        unsigned long output_pin;
+        long drive;
+        int latch;
+        int notify;
+        if (ei_decode_tuple_header(req, req_index, &arity) < 0 ||
+                arity != 5 ||
+                ei_decode_long(req, req_index, &when) < 0 ||
+                ei_decode_ulong(req, req_index, &output_pin) < 0 ||
+                ei_decode_long(req, req_index, &drive) < 0 ||
+                ei_decode_boolean(req, req_index, &latch) < 0 ||
+                ei_decode_boolean(req, req_index, &notify) < 0)
+            errx(EXIT_FAILURE, "reflex: expecting {when, output_pin, drive, latch, notify}");
+
+        if (!ok)
+            continue;
+
+        if (!gpio_reflex_is_output(output_pin)) {
+            ok = 0;
+            continue;
+        }
+
+        struct gpio_reflex *reflex = &port->reflexes[port->reflex_count];
+        char value_path[64];
+        sprintf(value_path, "/sys/class/gpio/gpio%lu/value", output_pin);
+        gpio_init_fields(&reflex->output, output_pin, GPIO_OUTPUT);
+        reflex->output.fd = open(value_path, O_WRONLY);
+        if (reflex->output.fd < 0) {
+            ok = 0;
+            continue;
+        }
+
+        // The output's port can't cache a pin that changes behind its back
+        if (flock(reflex->output.fd, LOCK_SH | LOCK_NB) < 0) {
+            close(reflex->output.fd);
+            ok = 0;
+            continue;
+        }
+        reflex->when = !!when;
+        reflex->drive = !!drive;
+        reflex->latch = latch;
+        reflex->notify = notify;
+        reflex->tripped = 0;
+        port->reflex_count++;
+    }
+
+    if (!ok) {
+        gpio_reflex_clear(port);
+        gpio_port_update_edge(port);
+        return -1;
+    }
+
+    if (gpio_port_update_edge(port) < 0)
+        return -1;
+
+    gpio_reflex_evaluate(port, gpio_read(&port->pin));
+    return 1;
+}
+
+/**
+ * @brief	Handle an edge on the input
+ *
+ * The reflexes go first so that their outputs change before anything
+ * is sent to Erlang.
+ */
+static void gpio_port_process(struct gpio_port *port)
+{
+    if (port->reflex_count == 0) {
+        gpio_process(&port->pin);
+        return;
+    }
+
+    int value = gpio_read(&port->pin);
+    gpio_reflex_evaluate(port, value);
+    gpio_report_value(&port->pin, value, 1);
+}
+
+// Edge capture
+
+#define GPIO_CAPTURE_MAX 65536
+#define GPIO_CAPTURE_DELTA_MAX 0x7fffffff
+
+/**
+ * @brief	Record the times of an input's edges
+ *
+ * This waits on the pin until max_edges edges have been seen or the
+ * timeout passes and doesn't handle requests in between. The reflexes
+ * still run on each edge and once more at the end in case the input
+ * changed after the last one. The sysfs interface doesn't timestamp
+ * edges, so they're timestamped as soon as poll() returns.
+ *
+ * Each edge is a 32-bit big endian word with the level after the edge
+ * in the top bit and the microseconds since the previous edge (or the
+ * start for the first one) in the rest.
+ *
+ * @param	port        The port of the GPIO pin
+ * @param	edges       Where to put the edges
+ * @param	max_edges   How many edges to record at most
+ * @param	timeout_us  How long to wait for them
+ *
+ * @return 	The number of edges recorded or -1 on failure
+ */
+static int gpio_capture(struct gpio_port *port, uint8_t *edges, unsigned int max_edges, uint64_t timeout_us)
+{
+    struct gpio *pin = &port->pin;
+    if (pin->state != GPIO_INPUT ||
+            gpio_write_edge(pin, GPIO_INT_BOTH) < 0)
+        return -1;
+
+    // Clear the notification from changing the edge
+    gpio_read(pin);
+
+    uint64_t last_ns = gpio_now_ns();
+    uint64_t deadline_ns = last_ns + timeout_us * 1000;
+    unsigned int count = 0;
+    while (count < max_edges) {
+        uint64_t now_ns = gpio_now_ns();
+        if (now_ns >= deadline_ns)
+            break;
+
+        struct pollfd fdset;
+        fdset.fd = pin->fd;
+        fdset.events = POLLPRI;
+        fdset.revents = 0;
+        int timeout_ms = (deadline_ns - now_ns + 999999) / 1000000;
+        int rc = poll(&fdset, 1, timeout_ms);
+        if (rc < 0) {
+            if (errno == EINTR)
+                continue;
+            err(EXIT_FAILURE, "poll");
+        }
+        if (!(fdset.revents & POLLPRI))
+            continue;
+
+        uint64_t edge_ns = gpio_now_ns();
+        uint32_t value = gpio_read(pin);
+        gpio_reflex_evaluate(port, value);
+        uint64_t delta_us = (edge_ns - last_ns) / 1000;
+        if (delta_us > GPIO_CAPTURE_DELTA_MAX)
+            delta_us = GPIO_CAPTURE_DELTA_MAX;
+        uint32_t word = (value << 31) | (uint32_t) delta_us;
+
+        edges[0] = word >> 24;
+        edges[1] = word >> 16;
+        edges[2] = word >> 8;
+        edges[3] = word;
+        edges += 4;
+        count++;
+        last_ns = edge_ns;
+    }
+
+    gpio_reflex_evaluate(port, gpio_read(pin));
+    return count;
+}
+
 void gpio_handle_request(const char *req, void *cookie)
 {
-    struct gpio *pin = (struct gpio *) cookie;
+    struct gpio_port *port = (struct gpio_port *) cookie;
+    struct gpio *pin = &port->pin;
 
     // Commands are of the form {Command, Arguments}:
     // { atom(), term() }
-    int req_index = sizeof(uint16_t);
+    int req_index = sizeof(uint32_t);
     if (ei_decode_version(req, &req_index, NULL) < 0)
         errx(EXIT_FAILURE, "Message version issue?");
 
@@ -351,8 +1051,8 @@ void gpio_handle_request(const char *req, void *cookie)
         errx(EXIT_FAILURE, "expecting command atom");
 
     char resp[256];
-    int resp_index = sizeof(uint16_t) + 1; // Space for payload size and type
-    resp[2] = 0; // Reply
+    int resp_index = sizeof(uint32_t) + 1; // Space for payload size and type
+    resp[4] = 0; // Reply
     ei_encode_version(resp, &resp_index);
     if (strcmp(cmd, "read") == 0) {
         debug("read");
@@ -369,6 +1069,8 @@ void gpio_handle_request(const char *req, void *cookie)
         if (ei_decode_long(req, &req_index, &value) < 0)
             errx(EXIT_FAILURE, "write: didn't get value to write");
         debug("write %d", value);
+        gpio_pwm_stop(pin, &port->pwm);
+        waveform_stop(&port->player);
         if (gpio_write(pin, value))
             ei_encode_atom(resp, &resp_index, "ok");
         else {
@@ -382,13 +1084,141 @@ void gpio_handle_request(const char *req, void *cookie)
             errx(EXIT_FAILURE, "set_int: didn't get value");
         debug("set_int %s", mode);
 
-        if (gpio_set_int(pin, mode))
+        if (gpio_set_int(pin, mode) && gpio_port_update_edge(port) > 0)
             ei_encode_atom(resp, &resp_index, "ok");
         else {
             ei_encode_tuple_header(resp, &resp_index, 2);
             ei_encode_atom(resp, &resp_index, "error");
             ei_encode_atom(resp, &resp_index, "gpio_set_int_failed");
         }
+    } else if (strcmp(cmd, "pwm") == 0) {
+        unsigned long long period_ns;
+        unsigned long long high_ns;
+        long priority;
+        if (ei_decode_tuple_header(req, &req_index, &arity) < 0 ||
+                arity != 3 ||
+                ei_decode_ulonglong(req, &req_index, &period_ns) < 0 ||
+                ei_decode_ulonglong(req, &req_index, &high_ns) < 0 ||
+                ei_decode_long(req, &req_index, &priority) < 0)
+            errx(EXIT_FAILURE, "pwm: expecting {period_ns, high_ns, priority}");
+        debug("pwm %llu %llu %ld", period_ns, high_ns, priority);
+
+        // Starting PWM may restart it at normal priority, so the
+        // priority is set after
+        if (period_ns == 0) {
+            gpio_pwm_stop(pin, &port->pwm);
+            ei_encode_atom(resp, &resp_index, "ok");
+        } else if (gpio_pwm_start(pin, &port->pwm, period_ns, high_ns) > 0) {
+            waveform_stop(&port->player);
+            if (gpio_pwm_set_priority(&port->pwm, priority > 0 ? priority : 0) > 0)
+                ei_encode_atom(resp, &resp_index, "ok");
+            else {
+                gpio_pwm_stop(pin, &port->pwm);
+                ei_encode_tuple_header(resp, &resp_index, 2);
+                ei_encode_atom(resp, &resp_index, "error");
+                ei_encode_atom(resp, &resp_index, "gpio_pwm_priority_failed");
+            }
+        } else {
+            ei_encode_tuple_header(resp, &resp_index, 2);
+            ei_encode_atom(resp, &resp_index, "error");
+            ei_encode_atom(resp, &resp_index, "gpio_pwm_failed");
+        }
+    } else if (strcmp(cmd, "pwm_stats") == 0) {
+        gpio_pwm_encode_stats(&port->pwm, resp, &resp_index);
+    } else if (strcmp(cmd, "play") == 0) {
+        debug("play");
+        if (pin->state != GPIO_OUTPUT) {
+            ei_encode_tuple_header(resp, &resp_index, 2);
+            ei_encode_atom(resp, &resp_index, "error");
+            ei_encode_atom(resp, &resp_index, "gpio_play_failed");
+        } else {
+            gpio_pwm_stop(pin, &port->pwm);
+            waveform_play_request(&port->player, req, &req_index, resp, &resp_index);
+        }
+    } else if (strcmp(cmd, "stop_play") == 0) {
+        debug("stop_play");
+        waveform_stop(&port->player);
+        ei_encode_atom(resp, &resp_index, "ok");
+    } else if (strcmp(cmd, "cache") == 0) {
+        int enable;
+        if (ei_decode_boolean(req, &req_index, &enable) < 0)
+            errx(EXIT_FAILURE, "cache: expecting true or false");
+        debug("cache %d", enable);
+
+        /* The value file is locked while caching so that reflexes can't
+         * drive the pin without this port knowing and the other way
+         * around. Memory mapped pins don't have one to lock.
+         */
+        if (pin->fd >= 0 && flock(pin->fd, (enable ? LOCK_EX : LOCK_UN) | LOCK_NB) < 0) {
+            ei_encode_tuple_header(resp, &resp_index, 2);
+            ei_encode_atom(resp, &resp_index, "error");
+            ei_encode_atom(resp, &resp_index, "gpio_cache_failed");
+        } else {
+            pin->cache = enable;
+            pin->cached_value = -1;
+            ei_encode_atom(resp, &resp_index, "ok");
+        }
+    } else if (strcmp(cmd, "write_stats") == 0) {
+        ei_encode_list_header(resp, &resp_index, 2);
+        ei_encode_tuple_header(resp, &resp_index, 2);
+        ei_encode_atom(resp, &resp_index, "writes");
+        ei_encode_ulonglong(resp, &resp_index, pin->writes);
+        ei_encode_tuple_header(resp, &resp_index, 2);
+        ei_encode_atom(resp, &resp_index, "suppressed_writes");
+        ei_encode_ulonglong(resp, &resp_index, pin->suppressed_writes);
+        ei_encode_empty_list(resp, &resp_index);
+    } else if (strcmp(cmd, "reflex") == 0) {
+        debug("reflex");
+        if (gpio_reflex_set(port, req, &req_index) > 0)
+            ei_encode_atom(resp, &resp_index, "ok");
+        else {
+            ei_encode_tuple_header(resp, &resp_index, 2);
+            ei_encode_atom(resp, &resp_index, "error");
+            ei_encode_atom(resp, &resp_index, "gpio_reflex_failed");
+        }
+    } else if (strcmp(cmd, "reset_reflex") == 0) {
+        debug("reset_reflex");
+        for (unsigned int i = 0; i < port->reflex_count; i++)
+            port->reflexes[i].tripped = 0;
+        if (port->reflex_count > 0)
+            gpio_reflex_evaluate(port, gpio_read(pin));
+        ei_encode_atom(resp, &resp_index, "ok");
+    } else if (strcmp(cmd, "capture") == 0) {
+        unsigned long max_edges;
+        unsigned long long timeout_us;
+        if (ei_decode_tuple_header(req, &req_index, &arity) < 0 ||
+                arity != 2 ||
+                ei_decode_ulong(req, &req_index, &max_edges) < 0 ||
+                ei_decode_ulonglong(req, &req_index, &timeout_us) < 0 ||
+                max_edges > GPIO_CAPTURE_MAX)
+            errx(EXIT_FAILURE, "capture: expecting {max_edges, timeout_us}");
+        debug("capture %lu %llu", max_edges, timeout_us);
+
+        // The edges are written into the reply's binary as they come in
+        size_t capture_resp_size = resp_index + ERLCMD_BINARY_HEADER_SIZE + max_edges * 4;
+        if (capture_resp_size < sizeof(resp))
+            capture_resp_size = sizeof(resp);
+        char *capture_resp = malloc(capture_resp_size);
+        if (!capture_resp)
+            err(EXIT_FAILURE, "malloc");
+        memcpy(capture_resp, resp, resp_index);
+
+        int count = gpio_capture(port, (uint8_t *) &capture_resp[resp_index + ERLCMD_BINARY_HEADER_SIZE],
+                                 max_edges, timeout_us);
+
+        // Put back what set_int and the reflexes need
+        gpio_port_update_edge(port);
+        if (count >= 0) {
+            erlcmd_encode_binary_header(capture_resp, &resp_index, count * 4);
+            resp_index += count * 4;
+        } else {
+            ei_encode_tuple_header(capture_resp, &resp_index, 2);
+            ei_encode_atom(capture_resp, &resp_index, "error");
+            ei_encode_atom(capture_resp, &resp_index, "gpio_capture_failed");
+        }
+        erlcmd_send(capture_resp, resp_index);
+        free(capture_resp);
+        return;
     } else
         errx(EXIT_FAILURE, "unknown command: %s", cmd);
 
@@ -398,8 +1228,8 @@ void gpio_handle_request(const char *req, void *cookie)
 
 int gpio_main(int argc, char *argv[])
 {
-    if (argc != 4)
-        errx(EXIT_FAILURE, "%s gpio <pin#> <input|output>", argv[0]);
+    if (argc != 4 && argc != 6)
+        errx(EXIT_FAILURE, "%s gpio <pin#> <input|output> [<mmio path> <layout>]", argv[0]);
 
     int pin_number = strtol(argv[2], NULL, 0);
     enum gpio_state initial_state;
@@ -410,28 +1240,45 @@ int gpio_main(int argc, char *argv[])
     else
         errx(EXIT_FAILURE, "Specify 'input' or 'output'");
 
-    struct gpio pin;
-    if (gpio_init(&pin, pin_number, initial_state) < 0)
+    struct gpio_port port;
+    struct gpio *pin = &port.pin;
+    if (argc == 6) {
+        if (gpio_init_mmio(pin, pin_number, initial_state, argv[4], argv[5]) < 0)
+            errx(EXIT_FAILURE, "Couldn't map gpio %d through %s as %s", pin_number, argv[4], argv[5]);
+    } else if (gpio_init(pin, pin_number, initial_state) < 0)
 	errx(EXIT_FAILURE, "Couldn't initialize gpio %d\n", pin_number);
+    memset(&port.pwm, 0, sizeof(port.pwm));
+    port.pwm.timer_fd = -1;
+    waveform_init(&port.player, gpio_waveform_write, pin, 0);
+    port.reflex_count = 0;
 
     struct erlcmd handler;
-    erlcmd_init(&handler, gpio_handle_request, &pin);
+    erlcmd_init(&handler, gpio_handle_request, &port);
 
     for (;;) {
-        struct pollfd fdset[2];
+        struct pollfd fdset[4];
 
         fdset[0].fd = STDIN_FILENO;
         fdset[0].events = POLLIN;
         fdset[0].revents = 0;
 
-        fdset[1].fd = pin.fd;
+        /* Only have poll() monitor the sysfs file if interrupts or
+         * reflexes are enabled and the timers if PWM or a waveform is
+         * running.
+         */
+        fdset[1].fd = pin->int_mode != GPIO_INT_NONE || port.reflex_count > 0 ? pin->fd : -1;
         fdset[1].events = POLLPRI;
         fdset[1].revents = 0;
 
-        /* Always fill out the fdset structure, but only have poll() monitor
-     * the sysfs file if interrupts are enabled.
-     */
-        int rc = poll(fdset, pin.int_mode != GPIO_INT_NONE ? 2 : 1, -1);
+        fdset[2].fd = port.pwm.timer_fd;
+        fdset[2].events = POLLIN;
+        fdset[2].revents = 0;
+
+        fdset[3].fd = port.player.timer_fd;
+        fdset[3].events = POLLIN;
+        fdset[3].revents = 0;
+
+        int rc = poll(fdset, 4, -1);
         if (rc < 0) {
             // Retry if EINTR
             if (errno == EINTR)
@@ -440,11 +1287,18 @@ int gpio_main(int argc, char *argv[])
             err(EXIT_FAILURE, "poll");
         }
 
+        // Edges go first so that reflexes don't wait on anything else
+        if (fdset[1].revents & POLLPRI)
+            gpio_port_process(&port);
+
         if (fdset[0].revents & (POLLIN | POLLHUP))
             erlcmd_process(&handler);
 
-        if (fdset[1].revents & POLLPRI)
-            gpio_process(&pin);
+        if (fdset[2].revents & POLLIN)
+            gpio_pwm_process(pin, &port.pwm);
+
+        if (fdset[3].revents & POLLIN)
+            waveform_process(&port.player);
     }
 
     return 0;
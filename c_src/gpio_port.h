@@ -0,0 +1,90 @@
+/*
+ * Copyright (C) 2015 Frank Hunleth
+ * Copyright (C) 2013 Erlang Solutions Ltd.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * GPIO declarations shared with the other ports
+ */
+
+#ifndef GPIO_PORT_H
+#define GPIO_PORT_H
+
+#include <stdint.h>
+
+/*
+ * GPIO handling definitions and prototypes
+ */
+enum gpio_state {
+    GPIO_OUTPUT,
+    GPIO_INPUT
+};
+
+enum interrupt_mode {
+    GPIO_INT_NONE,
+    GPIO_INT_BOTH,
+    GPIO_INT_RISING,
+    GPIO_INT_FALLING,
+    GPIO_INT_SUMMARIZE
+};
+
+struct gpio_mmio_layout;
+
+struct gpio {
+    enum gpio_state state;
+    int fd;
+    int pin_number;
+    enum interrupt_mode int_mode;
+    int last_value;
+
+    // Memory mapped GPIO registers or NULL to use sysfs
+    volatile uint32_t *regs;
+    const struct gpio_mmio_layout *layout;
+
+    // Outputs remember what was written last to skip writing it again
+    int cache;                  // 1 to skip writing the same value
+    int cached_value;           // -1 if unknown
+    uint64_t writes;
+    uint64_t suppressed_writes;
+};
+
+int sysfs_write_file(const char *pathname, const char *value);
+int gpio_init(struct gpio *pin, unsigned int pin_number, enum gpio_state dir);
+int gpio_init_mmio(struct gpio *pin, unsigned int pin_number, enum gpio_state dir,
+                   const char *path, const char *layout_name);
+int gpio_write(struct gpio *pin, unsigned int val);
+int gpio_read(struct gpio *pin);
+int gpio_set_int(struct gpio *pin, const char *mode);
+void gpio_process(struct gpio *pin);
+int gpio_init_list(struct gpio *gpios, unsigned int *gpio_count, unsigned int max_count,
+                   const char *req, int *req_index);
+
+/*
+ * GPIO groups are lines on one gpiochip that are read and written
+ * together with one call to the kernel.
+ */
+#define GPIO_GROUP_MAX 64
+
+struct gpio_group {
+    int fd;
+    unsigned int num_lines;
+    enum gpio_state state;
+};
+
+int gpio_group_init(struct gpio_group *group, const char *chip,
+                    const unsigned int *offsets, unsigned int num_lines,
+                    enum gpio_state dir);
+int gpio_group_read(struct gpio_group *group, uint64_t *values);
+int gpio_group_write(struct gpio_group *group, uint64_t mask, uint64_t values);
+
+#endif
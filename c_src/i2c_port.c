@@ -17,18 +17,22 @@
 
 #include <err.h>
 #include <fcntl.h>
+#include <poll.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/ioctl.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <time.h>
 #include <unistd.h>
 
 #include <linux/i2c.h>
 #include <linux/i2c-dev.h>
 
 #include "erlcmd.h"
+#include "gpio_port.h"
+#include "script.h"
 
 //#define DEBUG
 #ifdef DEBUG
@@ -37,10 +41,50 @@
 #define debug(...)
 #endif
 
+// Register map cache (8-bit register addresses, 8-bit values)
+#define I2C_REGMAP_SIZE 256
+
+#define REG_VALID    0x01
+#define REG_DIRTY    0x02
+#define REG_VOLATILE 0x04
+
+struct i2c_regmap
+{
+    int enabled;
+    int cache_only;
+
+    uint8_t values[I2C_REGMAP_SIZE];
+    uint8_t flags[I2C_REGMAP_SIZE];
+
+    unsigned long hits;
+    unsigned long misses;
+};
+
+// A write/read that runs each time a GPIO like a data ready line has an edge
+struct i2c_trigger
+{
+    int active;
+    struct gpio pin;
+
+    char write_data[I2C_SMBUS_BLOCK_MAX];
+    size_t write_len;
+    size_t read_len;
+};
+
+// Max number of GPIOs that programs can use
+#define I2C_GPIO_MAX 8
+
 struct i2c_info
 {
     int fd;
     unsigned int addr;
+
+    struct i2c_regmap regmap;
+    struct i2c_trigger trigger;
+
+    struct gpio gpios[I2C_GPIO_MAX];
+    unsigned int gpio_count;
+    struct script_engine scripts;
 };
 
 static void i2c_init(struct i2c_info *i2c, const char *devpath, unsigned int addr)
@@ -69,6 +113,7 @@ static void i2c_init(struct i2c_info *i2c, const char *devpath, unsigned int add
  * support setting the current register via the first one or
  * two bytes written.
  *
+ * @param	addr	        Device address
  * @param	to_write	Optional write buffer
  * @param	to_write_len	Write buffer length
  * @param	to_read	        Optional read buffer
@@ -76,19 +121,20 @@ static void i2c_init(struct i2c_info *i2c, const char *devpath, unsigned int add
  *
  * @return 	1 for success, 0 for failure
  */
-static int i2c_transfer(const struct i2c_info *i2c,
-                        const char *to_write, size_t to_write_len,
-                        char *to_read, size_t to_read_len)
+static int i2c_transfer_to(const struct i2c_info *i2c,
+                           unsigned int addr,
+                           const char *to_write, size_t to_write_len,
+                           char *to_read, size_t to_read_len)
 {
     struct i2c_rdwr_ioctl_data data;
     struct i2c_msg msgs[2];
 
-    msgs[0].addr = i2c->addr;
+    msgs[0].addr = addr;
     msgs[0].flags = 0;
     msgs[0].len = to_write_len;
     msgs[0].buf = (uint8_t *) to_write;
 
-    msgs[1].addr = i2c->addr;
+    msgs[1].addr = addr;
     msgs[1].flags = I2C_M_RD;
     msgs[1].len = to_read_len;
     msgs[1].buf = (uint8_t *) to_read;
@@ -107,13 +153,599 @@ static int i2c_transfer(const struct i2c_info *i2c,
         return 1;
 }
 
+/**
+ * @brief	I2C combined write/read operation with the device
+ *
+ * See i2c_transfer_to().
+ */
+static int i2c_transfer(const struct i2c_info *i2c,
+                        const char *to_write, size_t to_write_len,
+                        char *to_read, size_t to_read_len)
+{
+    return i2c_transfer_to(i2c, i2c->addr, to_write, to_write_len, to_read, to_read_len);
+}
+
+static int i2c_script_xfer(void *cookie,
+                           const uint8_t *tx, size_t tx_len,
+                           uint8_t *rx, size_t rx_len)
+{
+    return i2c_transfer((const struct i2c_info *) cookie,
+                        (const char *) tx, tx_len,
+                        (char *) rx, rx_len);
+}
+
+static void i2c_report_progress(unsigned long done, unsigned long total)
+{
+    char resp[64];
+    int resp_index = sizeof(uint32_t) + 1; // Space for payload size and type
+    resp[4] = 1; // Notification
+    ei_encode_version(resp, &resp_index);
+    ei_encode_tuple_header(resp, &resp_index, 3);
+    ei_encode_atom(resp, &resp_index, "eeprom_progress");
+    ei_encode_ulong(resp, &resp_index, done);
+    ei_encode_ulong(resp, &resp_index, total);
+    erlcmd_send(resp, resp_index);
+}
+
+// Probe range used by i2cdetect. Addresses outside of it are reserved.
+#define I2C_SCAN_FIRST 0x03
+#define I2C_SCAN_LAST  0x77
+
+enum i2c_probe_result {
+    I2C_PROBE_ABSENT = 0,
+    I2C_PROBE_PRESENT,
+    I2C_PROBE_BUSY       // A kernel driver owns the address
+};
+
+/**
+ * @brief	Check whether a device acknowledges its address
+ *
+ * This follows i2cdetect's defaults: a quick write is used unless it
+ * could corrupt an EEPROM (0x50-0x5f) or write-protect some EEPROMs
+ * (0x30-0x37), in which case a byte is read instead. Like i2cdetect's
+ * "UU", an address that a kernel driver owns isn't probed, but there's
+ * a device there, so it's reported as busy.
+ *
+ * @return 	what was found at the address
+ */
+static enum i2c_probe_result i2c_probe(int fd, unsigned int addr, unsigned long funcs)
+{
+    if (ioctl(fd, I2C_SLAVE, addr) < 0)
+        return errno == EBUSY ? I2C_PROBE_BUSY : I2C_PROBE_ABSENT;
+
+    struct i2c_smbus_ioctl_data args;
+    union i2c_smbus_data data;
+
+    int use_read = ((addr >= 0x30 && addr <= 0x37) ||
+                    (addr >= 0x50 && addr <= 0x5f) ||
+                    !(funcs & I2C_FUNC_SMBUS_QUICK));
+    if (use_read) {
+        args.read_write = I2C_SMBUS_READ;
+        args.size = I2C_SMBUS_BYTE;
+        args.data = &data;
+    } else {
+        args.read_write = I2C_SMBUS_WRITE;
+        args.size = I2C_SMBUS_QUICK;
+        args.data = NULL;
+    }
+    args.command = 0;
+
+    return ioctl(fd, I2C_SMBUS, &args) >= 0 ? I2C_PROBE_PRESENT : I2C_PROBE_ABSENT;
+}
+
+/**
+ * @brief	Scan a bus for devices and report them
+ *
+ * This runs in place of the normal request loop so that one short
+ * lived port process can probe every address.
+ */
+static int i2c_scan_main(const char *devpath)
+{
+    char resp[2048];
+    int resp_index = sizeof(uint32_t) + 1; // Space for payload size and type
+    resp[4] = 0; // Reply
+    ei_encode_version(resp, &resp_index);
+
+    int fd = open(devpath, O_RDWR);
+    if (fd < 0)
+        err(EXIT_FAILURE, "open %s", devpath);
+
+    unsigned long funcs;
+    if (ioctl(fd, I2C_FUNCS, &funcs) < 0)
+        err(EXIT_FAILURE, "ioctl(I2C_FUNCS)");
+
+    if (!(funcs & (I2C_FUNC_SMBUS_QUICK | I2C_FUNC_SMBUS_READ_BYTE))) {
+        ei_encode_tuple_header(resp, &resp_index, 2);
+        ei_encode_atom(resp, &resp_index, "error");
+        ei_encode_atom(resp, &resp_index, "i2c_scan_unsupported");
+    } else {
+        uint8_t found[I2C_SCAN_LAST + 1];
+        uint8_t busy[I2C_SCAN_LAST + 1];
+        int count = 0;
+        for (unsigned int addr = I2C_SCAN_FIRST; addr <= I2C_SCAN_LAST; addr++) {
+            enum i2c_probe_result result = i2c_probe(fd, addr, funcs);
+            if (result != I2C_PROBE_ABSENT) {
+                busy[count] = (result == I2C_PROBE_BUSY);
+                found[count++] = addr;
+            }
+        }
+
+        if (count > 0) {
+            ei_encode_list_header(resp, &resp_index, count);
+            for (int i = 0; i < count; i++) {
+                if (busy[i]) {
+                    ei_encode_tuple_header(resp, &resp_index, 2);
+                    ei_encode_atom(resp, &resp_index, "busy");
+                }
+                ei_encode_long(resp, &resp_index, found[i]);
+            }
+        }
+        ei_encode_empty_list(resp, &resp_index);
+    }
+    close(fd);
+
+    debug("sending response: %d bytes", resp_index);
+    erlcmd_send(resp, resp_index);
+    return 0;
+}
+
+/**
+ * @brief	Reset the register cache and enable it
+ *
+ * @param	volatile_regs	Registers that must always be read from the device
+ * @param	count	        Number of entries in volatile_regs
+ */
+static void regmap_init(struct i2c_info *i2c, const uint8_t *volatile_regs, size_t count)
+{
+    struct i2c_regmap *map = &i2c->regmap;
+
+    memset(map, 0, sizeof(*map));
+    map->enabled = 1;
+
+    for (size_t i = 0; i < count; i++)
+        map->flags[volatile_regs[i]] = REG_VOLATILE;
+}
+
+/**
+ * @brief	Check whether a range of registers can be served from the cache
+ */
+static int regmap_cached(const struct i2c_regmap *map, unsigned int reg, size_t count)
+{
+    for (size_t i = reg; i < reg + count; i++) {
+        if ((map->flags[i] & (REG_VALID | REG_VOLATILE)) != REG_VALID)
+            return 0;
+    }
+    return 1;
+}
+
+/**
+ * @brief	Read consecutive registers through the cache
+ *
+ * Non-volatile registers that have been read or written before are
+ * returned without any bus traffic. Otherwise, the whole range is read
+ * in one combined transaction and the cache is refreshed. Registers
+ * with pending (dirty) writes keep their cached value.
+ *
+ * @return 	1 for success, 0 for a bus failure, -1 if the registers
+ *              aren't cached and the map is in cache-only mode
+ */
+static int regmap_read(struct i2c_info *i2c, unsigned int reg, uint8_t *to_read, size_t count)
+{
+    struct i2c_regmap *map = &i2c->regmap;
+
+    if (regmap_cached(map, reg, count)) {
+        memcpy(to_read, &map->values[reg], count);
+        map->hits++;
+        return 1;
+    }
+
+    map->misses++;
+    if (map->cache_only)
+        return -1;
+
+    uint8_t reg_byte = reg;
+    if (!i2c_transfer(i2c, (const char *) &reg_byte, 1, (char *) to_read, count))
+        return 0;
+
+    for (size_t i = 0; i < count; i++) {
+        uint8_t *flags = &map->flags[reg + i];
+        if (*flags & REG_VOLATILE)
+            continue;
+
+        if (*flags & REG_DIRTY)
+            to_read[i] = map->values[reg + i];
+        else {
+            map->values[reg + i] = to_read[i];
+            *flags |= REG_VALID;
+        }
+    }
+    return 1;
+}
+
+/**
+ * @brief	Write consecutive registers through the cache
+ *
+ * In cache-only mode, non-volatile registers are only updated in the
+ * cache and marked dirty so that regmap_flush() can write them later.
+ *
+ * @return 	1 for success, 0 for a bus failure, -1 if a volatile
+ *              register is written in cache-only mode
+ */
+static int regmap_write(struct i2c_info *i2c, unsigned int reg, const uint8_t *to_write, size_t count)
+{
+    struct i2c_regmap *map = &i2c->regmap;
+
+    if (map->cache_only) {
+        for (size_t i = reg; i < reg + count; i++) {
+            if (map->flags[i] & REG_VOLATILE)
+                return -1;
+        }
+
+        memcpy(&map->values[reg], to_write, count);
+        for (size_t i = reg; i < reg + count; i++)
+            map->flags[i] |= REG_VALID | REG_DIRTY;
+        return 1;
+    }
+
+    uint8_t data[I2C_SMBUS_BLOCK_MAX];
+    data[0] = reg;
+    memcpy(&data[1], to_write, count);
+    if (!i2c_transfer(i2c, (const char *) data, count + 1, 0, 0))
+        return 0;
+
+    for (size_t i = 0; i < count; i++) {
+        uint8_t *flags = &map->flags[reg + i];
+        if (*flags & REG_VOLATILE)
+            continue;
+
+        map->values[reg + i] = to_write[i];
+        *flags = (*flags | REG_VALID) & ~REG_DIRTY;
+    }
+    return 1;
+}
+
+/**
+ * @brief	Read-modify-write one register
+ *
+ * The read is usually served by the cache and the write is skipped
+ * if the register already holds the requested bits.
+ *
+ * @return 	see regmap_read() and regmap_write()
+ */
+static int regmap_update_bits(struct i2c_info *i2c, unsigned int reg, uint8_t mask, uint8_t value)
+{
+    uint8_t old_value;
+    int rc = regmap_read(i2c, reg, &old_value, 1);
+    if (rc <= 0)
+        return rc;
+
+    uint8_t new_value = (old_value & ~mask) | (value & mask);
+    if (new_value == old_value && !(i2c->regmap.flags[reg] & REG_VOLATILE))
+        return 1;
+
+    return regmap_write(i2c, reg, &new_value, 1);
+}
+
+/**
+ * @brief	Write all dirty registers to the device
+ *
+ * Runs of consecutive dirty registers are combined into one
+ * auto-incrementing write each.
+ *
+ * @return 	1 for success, 0 for a bus failure
+ */
+static int regmap_flush(struct i2c_info *i2c)
+{
+    struct i2c_regmap *map = &i2c->regmap;
+    unsigned int reg = 0;
+
+    while (reg < I2C_REGMAP_SIZE) {
+        if (!(map->flags[reg] & REG_DIRTY)) {
+            reg++;
+            continue;
+        }
+
+        uint8_t data[I2C_SMBUS_BLOCK_MAX];
+        size_t len = 0;
+        data[len++] = reg;
+        while (reg + len - 1 < I2C_REGMAP_SIZE &&
+               len < sizeof(data) &&
+               (map->flags[reg + len - 1] & REG_DIRTY)) {
+            data[len] = map->values[reg + len - 1];
+            len++;
+        }
+
+        if (!i2c_transfer(i2c, (const char *) data, len, 0, 0))
+            return 0;
+
+        for (size_t i = 0; i < len - 1; i++)
+            map->flags[reg + i] &= ~REG_DIRTY;
+        reg += len - 1;
+    }
+    return 1;
+}
+
+// Largest message that i2c-dev accepts in an I2C_RDWR transfer
+#define I2C_RDWR_MSG_MAX 8192
+
+// Largest EEPROM read or write that fits in one port message
+#define I2C_EEPROM_MAX (ERLCMD_MAX_MSG_SIZE - 64)
+
+// Most device address bits that parts use to select a memory block
+#define I2C_EEPROM_BLOCK_BITS 3
+
+struct eeprom_params
+{
+    unsigned int page_size;
+    unsigned int addr_width;
+    unsigned long size;
+    unsigned int write_timeout_ms;
+    unsigned long progress_interval;
+};
+
+/**
+ * @brief	Encode a memory address for the device
+ *
+ * Address bits that don't fit in addr_width bytes go into the low
+ * bits of the device address like on 24C16 and 24C1024 parts.
+ *
+ * @return 	the device address to use
+ */
+static unsigned int eeprom_encode_addr(const struct i2c_info *i2c,
+                                       const struct eeprom_params *params,
+                                       unsigned long mem_addr,
+                                       uint8_t *addr_bytes)
+{
+    for (unsigned int i = 0; i < params->addr_width; i++)
+        addr_bytes[i] = mem_addr >> (8 * (params->addr_width - i - 1));
+
+    return i2c->addr | (mem_addr >> (8 * params->addr_width));
+}
+
+/**
+ * @brief	Check a device size and that a read or write fits in it
+ *
+ * Parts bigger than addr_width bytes can address take the extra
+ * address bits from the low bits of the device address, so those bits
+ * have to be 0 in the address that the port was opened with. Without
+ * this check, an address past the end would go to another device.
+ *
+ * @return 	NULL if ok or the reason for the error reply
+ */
+static const char *eeprom_check_range(const struct i2c_info *i2c,
+                                      const struct eeprom_params *params,
+                                      unsigned long mem_addr,
+                                      unsigned long len)
+{
+    unsigned long block_size = 1UL << (8 * params->addr_width);
+    unsigned long blocks = (params->size + block_size - 1) / block_size;
+    unsigned int block_mask = 0;
+    while (block_mask + 1 < blocks)
+        block_mask = (block_mask << 1) | 1;
+
+    if (params->size == 0 ||
+            blocks > (1UL << I2C_EEPROM_BLOCK_BITS) ||
+            (i2c->addr & block_mask) != 0)
+        return "i2c_eeprom_bad_size";
+
+    if (mem_addr > params->size || len > params->size - mem_addr)
+        return "i2c_eeprom_out_of_range";
+
+    return NULL;
+}
+
+static unsigned long elapsed_ms(const struct timespec *start)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) * 1000 + (now.tv_nsec - start->tv_nsec) / 1000000;
+}
+
+/**
+ * @brief	Wait for an EEPROM to finish its internal write cycle
+ *
+ * The EEPROM doesn't acknowledge its address while it's busy, so keep
+ * sending it the memory address until it does. This is usually much
+ * quicker than sleeping for the worst case write time.
+ *
+ * @return 	1 when ready, 0 on timeout
+ */
+static int eeprom_wait_ready(const struct i2c_info *i2c,
+                             unsigned int dev_addr,
+                             const uint8_t *addr_bytes,
+                             const struct eeprom_params *params)
+{
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    while (!i2c_transfer_to(i2c, dev_addr, (const char *) addr_bytes, params->addr_width, 0, 0)) {
+        if (elapsed_ms(&start) > params->write_timeout_ms)
+            return 0;
+    }
+    return 1;
+}
+
+/**
+ * @brief	Write data to an EEPROM or FRAM a page at a time
+ *
+ * @return 	1 for success, 0 for failure
+ */
+static int eeprom_write(const struct i2c_info *i2c,
+                        const struct eeprom_params *params,
+                        unsigned long mem_addr,
+                        const uint8_t *data,
+                        size_t len)
+{
+    uint8_t *buffer = malloc(params->addr_width + params->page_size);
+    if (!buffer)
+        err(EXIT_FAILURE, "malloc");
+
+    unsigned long next_progress = params->progress_interval;
+    size_t done = 0;
+    int rc = 1;
+    while (done < len) {
+        unsigned long addr = mem_addr + done;
+        size_t chunk = params->page_size - addr % params->page_size;
+        if (chunk > len - done)
+            chunk = len - done;
+
+        unsigned int dev_addr = eeprom_encode_addr(i2c, params, addr, buffer);
+        memcpy(&buffer[params->addr_width], &data[done], chunk);
+        if (!i2c_transfer_to(i2c, dev_addr, (const char *) buffer, params->addr_width + chunk, 0, 0) ||
+                !eeprom_wait_ready(i2c, dev_addr, buffer, params)) {
+            rc = 0;
+            break;
+        }
+
+        done += chunk;
+        if (next_progress && done >= next_progress && done < len) {
+            i2c_report_progress(done, len);
+            next_progress = done + params->progress_interval;
+        }
+    }
+
+    free(buffer);
+    return rc;
+}
+
+/**
+ * @brief	Sequentially read from an EEPROM or FRAM
+ *
+ * @return 	1 for success, 0 for failure
+ */
+static int eeprom_read(const struct i2c_info *i2c,
+                       const struct eeprom_params *params,
+                       unsigned long mem_addr,
+                       uint8_t *to_read,
+                       size_t len)
+{
+    unsigned long block_size = 1UL << (8 * params->addr_width);
+    unsigned long next_progress = params->progress_interval;
+    size_t done = 0;
+    while (done < len) {
+        unsigned long addr = mem_addr + done;
+
+        // Reads can't wrap into the next device address
+        size_t chunk = block_size - addr % block_size;
+        if (chunk > I2C_RDWR_MSG_MAX)
+            chunk = I2C_RDWR_MSG_MAX;
+        if (chunk > len - done)
+            chunk = len - done;
+
+        uint8_t addr_bytes[sizeof(uint32_t)];
+        unsigned int dev_addr = eeprom_encode_addr(i2c, params, addr, addr_bytes);
+        if (!i2c_transfer_to(i2c, dev_addr,
+                             (const char *) addr_bytes, params->addr_width,
+                             (char *) &to_read[done], chunk))
+            return 0;
+
+        done += chunk;
+        if (next_progress && done >= next_progress && done < len) {
+            i2c_report_progress(done, len);
+            next_progress = done + params->progress_interval;
+        }
+    }
+    return 1;
+}
+
+/**
+ * @brief	Stop running the trigger's transaction on GPIO edges
+ */
+static void i2c_trigger_stop(struct i2c_trigger *trigger)
+{
+    if (!trigger->active)
+        return;
+
+    gpio_set_int(&trigger->pin, "none");
+    close(trigger->pin.fd);
+    trigger->active = 0;
+}
+
+/**
+ * @brief	Run a write/read each time a GPIO has an edge
+ *
+ * @param	pin_number   The GPIO
+ * @param	edge         "rising", "falling" or "both"
+ *
+ * @return 	1 for success, 0 for failure
+ */
+static int i2c_trigger_start(struct i2c_trigger *trigger,
+                             unsigned int pin_number,
+                             const char *edge,
+                             const char *write_data, size_t write_len,
+                             size_t read_len)
+{
+    i2c_trigger_stop(trigger);
+
+    if (gpio_init(&trigger->pin, pin_number, GPIO_INPUT) < 0)
+        return 0;
+
+    if (gpio_set_int(&trigger->pin, edge) < 0) {
+        close(trigger->pin.fd);
+        return 0;
+    }
+
+    // Clear the edge that Linux reports on registration
+    gpio_read(&trigger->pin);
+
+    memcpy(trigger->write_data, write_data, write_len);
+    trigger->write_len = write_len;
+    trigger->read_len = read_len;
+    trigger->active = 1;
+    return 1;
+}
+
+/**
+ * @brief	Run the trigger's transaction and send the result to Erlang
+ *
+ * @param	timestamp    CLOCK_MONOTONIC time of the edge in nanoseconds
+ */
+static void i2c_trigger_run(struct i2c_info *i2c, uint64_t timestamp)
+{
+    struct i2c_trigger *trigger = &i2c->trigger;
+
+    // Reading the value clears the edge
+    gpio_read(&trigger->pin);
+
+    char resp[64 + I2C_SMBUS_BLOCK_MAX];
+    int resp_index = sizeof(uint32_t) + 1; // Space for payload size and type
+    resp[4] = 1; // Notification
+    ei_encode_version(resp, &resp_index);
+    ei_encode_tuple_header(resp, &resp_index, 3);
+    ei_encode_atom(resp, &resp_index, "i2c_trigger");
+    ei_encode_ulonglong(resp, &resp_index, timestamp);
+
+    char *data = &resp[resp_index + ERLCMD_BINARY_HEADER_SIZE];
+    if (i2c_transfer(i2c, trigger->write_len ? trigger->write_data : 0, trigger->write_len,
+                     data, trigger->read_len)) {
+        erlcmd_encode_binary_header(resp, &resp_index, trigger->read_len);
+        resp_index += trigger->read_len;
+    } else {
+        ei_encode_tuple_header(resp, &resp_index, 2);
+        ei_encode_atom(resp, &resp_index, "error");
+        ei_encode_atom(resp, &resp_index, "i2c_wrrd_failed");
+    }
+    erlcmd_send(resp, resp_index);
+}
+
+static void encode_regmap_result(char *resp, int *resp_index, int rc, const char *failure)
+{
+    if (rc > 0)
+        ei_encode_atom(resp, resp_index, "ok");
+    else {
+        ei_encode_tuple_header(resp, resp_index, 2);
+        ei_encode_atom(resp, resp_index, "error");
+        ei_encode_atom(resp, resp_index, rc < 0 ? "regmap_cache_only" : failure);
+    }
+}
+
 static void i2c_handle_request(const char *req, void *cookie)
 {
     struct i2c_info *i2c = (struct i2c_info *) cookie;
 
     // Commands are of the form {Command, Arguments}:
     // { atom(), term() }
-    int req_index = sizeof(uint16_t);
+    int req_index = sizeof(uint32_t);
     if (ei_decode_version(req, &req_index, NULL) < 0)
         errx(EXIT_FAILURE, "Message version issue?");
 
@@ -126,8 +758,10 @@ static void i2c_handle_request(const char *req, void *cookie)
     if (ei_decode_atom(req, &req_index, cmd) < 0)
         errx(EXIT_FAILURE, "expecting command atom");
 
-    char resp[256];
-    int resp_index = sizeof(uint16_t); // Space for payload size
+    // Big enough for program results
+    char resp[SCRIPT_RESULT_MAX + 64];
+    int resp_index = sizeof(uint32_t) + 1; // Space for payload size and type
+    resp[4] = 0; // Reply
     ei_encode_version(resp, &resp_index);
     if (strcmp(cmd, "read") == 0) {
         long int len;
@@ -136,25 +770,22 @@ static void i2c_handle_request(const char *req, void *cookie)
                 len > I2C_SMBUS_BLOCK_MAX)
             errx(EXIT_FAILURE, "read amount: min=1, max=%d", I2C_SMBUS_BLOCK_MAX);
 
-        char data[I2C_SMBUS_BLOCK_MAX];
-
-        if (i2c_transfer(i2c, 0, 0, data, len))
-            ei_encode_binary(resp, &resp_index, data,len);
-        else {
+        // Read straight into the response
+        char *data = &resp[resp_index + ERLCMD_BINARY_HEADER_SIZE];
+        if (i2c_transfer(i2c, 0, 0, data, len)) {
+            erlcmd_encode_binary_header(resp, &resp_index, len);
+            resp_index += len;
+        } else {
             ei_encode_tuple_header(resp, &resp_index, 2);
             ei_encode_atom(resp, &resp_index, "error");
             ei_encode_atom(resp, &resp_index, "i2c_read_failed");
         }
     } else if (strcmp(cmd, "write") == 0) {
-        char data[I2C_SMBUS_BLOCK_MAX];
+        const char *data;
         int len;
-        int type;
-        long llen;
-        if (ei_get_type(req, &req_index, &type, &len) < 0 ||
-                type != ERL_BINARY_EXT ||
+        if (erlcmd_decode_binary_view(req, &req_index, &data, &len) < 0 ||
                 len < 1 ||
-                len > I2C_SMBUS_BLOCK_MAX ||
-                ei_decode_binary(req, &req_index, &data, &llen) < 0)
+                len > I2C_SMBUS_BLOCK_MAX)
             errx(EXIT_FAILURE, "write: need a binary between 1 and %d bytes", I2C_SMBUS_BLOCK_MAX);
 
         if (i2c_transfer(i2c, data, len, 0, 0))
@@ -165,35 +796,252 @@ static void i2c_handle_request(const char *req, void *cookie)
             ei_encode_atom(resp, &resp_index, "i2c_write_failed");
         }
     } else if (strcmp(cmd, "wrrd") == 0) {
-        char write_data[I2C_SMBUS_BLOCK_MAX];
-        char read_data[I2C_SMBUS_BLOCK_MAX];
+        const char *write_data;
         int write_len;
         long int read_len;
-        int type;
-        long llen;
 
         if (ei_decode_tuple_header(req, &req_index, &arity) < 0 ||
             arity != 2)
             errx(EXIT_FAILURE, "wrrd: expecting {write_data, read_count} tuple");
 
-        if (ei_get_type(req, &req_index, &type, &write_len) < 0 ||
-                type != ERL_BINARY_EXT ||
+        if (erlcmd_decode_binary_view(req, &req_index, &write_data, &write_len) < 0 ||
                 write_len < 1 ||
-                write_len > I2C_SMBUS_BLOCK_MAX ||
-                ei_decode_binary(req, &req_index, &write_data, &llen) < 0)
+                write_len > I2C_SMBUS_BLOCK_MAX)
             errx(EXIT_FAILURE, "wrrd: need a binary between 1 and %d bytes", I2C_SMBUS_BLOCK_MAX);
         if (ei_decode_long(req, &req_index, &read_len) < 0 ||
                 read_len < 1 ||
                 read_len > I2C_SMBUS_BLOCK_MAX)
             errx(EXIT_FAILURE, "wrrd: read amount: min=1, max=%d", I2C_SMBUS_BLOCK_MAX);
 
-        if (i2c_transfer(i2c, write_data, write_len, read_data, read_len))
-            ei_encode_binary(resp, &resp_index, read_data, read_len);
-        else {
+        char *read_data = &resp[resp_index + ERLCMD_BINARY_HEADER_SIZE];
+        if (i2c_transfer(i2c, write_data, write_len, read_data, read_len)) {
+            erlcmd_encode_binary_header(resp, &resp_index, read_len);
+            resp_index += read_len;
+        } else {
             ei_encode_tuple_header(resp, &resp_index, 2);
             ei_encode_atom(resp, &resp_index, "error");
             ei_encode_atom(resp, &resp_index, "i2c_wrrd_failed");
         }
+    } else if (strcmp(cmd, "eeprom_write") == 0) {
+        struct eeprom_params params;
+        unsigned long mem_addr;
+        unsigned long page_size;
+        unsigned long addr_width;
+        unsigned long write_timeout;
+        const char *data;
+        int len;
+        if (ei_decode_tuple_header(req, &req_index, &arity) < 0 ||
+                arity != 7 ||
+                ei_decode_ulong(req, &req_index, &mem_addr) < 0 ||
+                erlcmd_decode_binary_view(req, &req_index, &data, &len) < 0 ||
+                len < 1 ||
+                len > I2C_EEPROM_MAX)
+            errx(EXIT_FAILURE, "eeprom_write: need a binary between 1 and %d bytes", I2C_EEPROM_MAX);
+
+        if (ei_decode_ulong(req, &req_index, &page_size) < 0 ||
+                ei_decode_ulong(req, &req_index, &addr_width) < 0 ||
+                ei_decode_ulong(req, &req_index, &params.size) < 0 ||
+                ei_decode_ulong(req, &req_index, &write_timeout) < 0 ||
+                ei_decode_ulong(req, &req_index, &params.progress_interval) < 0 ||
+                addr_width < 1 ||
+                addr_width > 2 ||
+                page_size < 1 ||
+                page_size > I2C_RDWR_MSG_MAX - addr_width)
+            errx(EXIT_FAILURE, "eeprom_write: expecting {mem_addr, data, page_size, addr_width (1-2), size, write_timeout, progress}");
+
+        params.page_size = page_size;
+        params.addr_width = addr_width;
+        params.write_timeout_ms = write_timeout;
+
+        const char *range_error = eeprom_check_range(i2c, &params, mem_addr, len);
+        if (range_error) {
+            ei_encode_tuple_header(resp, &resp_index, 2);
+            ei_encode_atom(resp, &resp_index, "error");
+            ei_encode_atom(resp, &resp_index, range_error);
+        } else if (eeprom_write(i2c, &params, mem_addr, (const uint8_t *) data, len))
+            ei_encode_atom(resp, &resp_index, "ok");
+        else {
+            ei_encode_tuple_header(resp, &resp_index, 2);
+            ei_encode_atom(resp, &resp_index, "error");
+            ei_encode_atom(resp, &resp_index, "i2c_eeprom_write_failed");
+        }
+    } else if (strcmp(cmd, "eeprom_read") == 0) {
+        struct eeprom_params params;
+        unsigned long mem_addr;
+        unsigned long len;
+        unsigned long addr_width;
+        if (ei_decode_tuple_header(req, &req_index, &arity) < 0 ||
+                arity != 5 ||
+                ei_decode_ulong(req, &req_index, &mem_addr) < 0 ||
+                ei_decode_ulong(req, &req_index, &len) < 0 ||
+                ei_decode_ulong(req, &req_index, &addr_width) < 0 ||
+                ei_decode_ulong(req, &req_index, &params.size) < 0 ||
+                ei_decode_ulong(req, &req_index, &params.progress_interval) < 0 ||
+                len < 1 ||
+                len > I2C_EEPROM_MAX ||
+                addr_width < 1 ||
+                addr_width > 2)
+            errx(EXIT_FAILURE, "eeprom_read: expecting {mem_addr, len (1-%d), addr_width (1-2), size, progress}", I2C_EEPROM_MAX);
+
+        params.addr_width = addr_width;
+
+        const char *range_error = eeprom_check_range(i2c, &params, mem_addr, len);
+        if (range_error) {
+            ei_encode_tuple_header(resp, &resp_index, 2);
+            ei_encode_atom(resp, &resp_index, "error");
+            ei_encode_atom(resp, &resp_index, range_error);
+            erlcmd_send(resp, resp_index);
+            return;
+        }
+
+        // The data is too big for the normal response buffer, so this
+        // builds and sends its own.
+        char *big_resp = malloc(len + 64);
+        if (!big_resp)
+            err(EXIT_FAILURE, "malloc");
+
+        memcpy(big_resp, resp, resp_index);
+        uint8_t *data = (uint8_t *) &big_resp[resp_index + ERLCMD_BINARY_HEADER_SIZE];
+        if (eeprom_read(i2c, &params, mem_addr, data, len)) {
+            erlcmd_encode_binary_header(big_resp, &resp_index, len);
+            resp_index += len;
+        } else {
+            ei_encode_tuple_header(big_resp, &resp_index, 2);
+            ei_encode_atom(big_resp, &resp_index, "error");
+            ei_encode_atom(big_resp, &resp_index, "i2c_eeprom_read_failed");
+        }
+
+        debug("sending response: %d bytes", resp_index);
+        erlcmd_send(big_resp, resp_index);
+        free(big_resp);
+        return;
+    } else if (strcmp(cmd, "start_trigger") == 0) {
+        unsigned long pin_number;
+        char edge[MAXATOMLEN];
+        const char *write_data;
+        int write_len;
+        unsigned long read_len;
+        if (ei_decode_tuple_header(req, &req_index, &arity) < 0 ||
+                arity != 4 ||
+                ei_decode_ulong(req, &req_index, &pin_number) < 0 ||
+                ei_decode_atom(req, &req_index, edge) < 0 ||
+                erlcmd_decode_binary_view(req, &req_index, &write_data, &write_len) < 0 ||
+                write_len > I2C_SMBUS_BLOCK_MAX ||
+                ei_decode_ulong(req, &req_index, &read_len) < 0 ||
+                read_len < 1 ||
+                read_len > I2C_SMBUS_BLOCK_MAX ||
+                (strcmp(edge, "rising") != 0 && strcmp(edge, "falling") != 0 && strcmp(edge, "both") != 0))
+            errx(EXIT_FAILURE, "start_trigger: expecting {pin, rising | falling | both, write_data, read_len (1-%d)}", I2C_SMBUS_BLOCK_MAX);
+
+        if (i2c_trigger_start(&i2c->trigger, pin_number, edge, write_data, write_len, read_len))
+            ei_encode_atom(resp, &resp_index, "ok");
+        else {
+            ei_encode_tuple_header(resp, &resp_index, 2);
+            ei_encode_atom(resp, &resp_index, "error");
+            ei_encode_atom(resp, &resp_index, "i2c_trigger_failed");
+        }
+    } else if (strcmp(cmd, "stop_trigger") == 0) {
+        i2c_trigger_stop(&i2c->trigger);
+        ei_encode_atom(resp, &resp_index, "ok");
+    } else if (strcmp(cmd, "init_gpios") == 0) {
+        if (gpio_init_list(i2c->gpios, &i2c->gpio_count, I2C_GPIO_MAX, req, &req_index))
+            ei_encode_atom(resp, &resp_index, "ok");
+        else {
+            ei_encode_tuple_header(resp, &resp_index, 2);
+            ei_encode_atom(resp, &resp_index, "error");
+            ei_encode_atom(resp, &resp_index, "i2c_gpio_init_failed");
+        }
+    } else if (strcmp(cmd, "script_load") == 0) {
+        script_load_request(&i2c->scripts, req, &req_index, resp, &resp_index);
+    } else if (strcmp(cmd, "script_run") == 0) {
+        script_run_request(&i2c->scripts, req, &req_index, resp, &resp_index);
+    } else if (strcmp(cmd, "script_delete") == 0) {
+        script_delete_request(&i2c->scripts, req, &req_index, resp, &resp_index);
+    } else if (strcmp(cmd, "regmap_init") == 0) {
+        uint8_t volatile_regs[I2C_REGMAP_SIZE];
+        int len;
+        int type;
+        long llen;
+        if (ei_get_type(req, &req_index, &type, &len) < 0 ||
+                type != ERL_BINARY_EXT ||
+                len > I2C_REGMAP_SIZE ||
+                ei_decode_binary(req, &req_index, volatile_regs, &llen) < 0)
+            errx(EXIT_FAILURE, "regmap_init: need a binary of up to %d volatile registers", I2C_REGMAP_SIZE);
+
+        regmap_init(i2c, volatile_regs, len);
+        ei_encode_atom(resp, &resp_index, "ok");
+    } else if (!i2c->regmap.enabled &&
+               (strncmp(cmd, "reg_", 4) == 0 || strncmp(cmd, "regmap_", 7) == 0)) {
+        ei_encode_tuple_header(resp, &resp_index, 2);
+        ei_encode_atom(resp, &resp_index, "error");
+        ei_encode_atom(resp, &resp_index, "regmap_not_initialized");
+    } else if (strcmp(cmd, "regmap_cache_only") == 0) {
+        char enable[MAXATOMLEN];
+        if (ei_decode_atom(req, &req_index, enable) < 0)
+            errx(EXIT_FAILURE, "regmap_cache_only: expecting true or false");
+
+        i2c->regmap.cache_only = (strcmp(enable, "true") == 0);
+        ei_encode_atom(resp, &resp_index, "ok");
+    } else if (strcmp(cmd, "reg_read") == 0) {
+        long int reg;
+        long int count;
+        if (ei_decode_tuple_header(req, &req_index, &arity) < 0 ||
+                arity != 2 ||
+                ei_decode_long(req, &req_index, &reg) < 0 ||
+                ei_decode_long(req, &req_index, &count) < 0 ||
+                reg < 0 ||
+                count < 1 ||
+                count > I2C_SMBUS_BLOCK_MAX ||
+                reg + count > I2C_REGMAP_SIZE)
+            errx(EXIT_FAILURE, "reg_read: expecting {reg, count} with count between 1 and %d", I2C_SMBUS_BLOCK_MAX);
+
+        uint8_t data[I2C_SMBUS_BLOCK_MAX];
+        int rc = regmap_read(i2c, reg, data, count);
+        if (rc > 0)
+            ei_encode_binary(resp, &resp_index, data, count);
+        else
+            encode_regmap_result(resp, &resp_index, rc, "i2c_reg_read_failed");
+    } else if (strcmp(cmd, "reg_write") == 0) {
+        long int reg;
+        const char *data;
+        int len;
+        if (ei_decode_tuple_header(req, &req_index, &arity) < 0 ||
+                arity != 2 ||
+                ei_decode_long(req, &req_index, &reg) < 0 ||
+                erlcmd_decode_binary_view(req, &req_index, &data, &len) < 0 ||
+                len < 1 ||
+                len > I2C_SMBUS_BLOCK_MAX - 1 ||
+                reg < 0 ||
+                reg + len > I2C_REGMAP_SIZE)
+            errx(EXIT_FAILURE, "reg_write: expecting {reg, binary} with a binary between 1 and %d bytes", I2C_SMBUS_BLOCK_MAX - 1);
+
+        encode_regmap_result(resp, &resp_index,
+                             regmap_write(i2c, reg, (const uint8_t *) data, len),
+                             "i2c_reg_write_failed");
+    } else if (strcmp(cmd, "reg_update_bits") == 0) {
+        long int reg;
+        long int mask;
+        long int value;
+        if (ei_decode_tuple_header(req, &req_index, &arity) < 0 ||
+                arity != 3 ||
+                ei_decode_long(req, &req_index, &reg) < 0 ||
+                ei_decode_long(req, &req_index, &mask) < 0 ||
+                ei_decode_long(req, &req_index, &value) < 0 ||
+                reg < 0 ||
+                reg >= I2C_REGMAP_SIZE)
+            errx(EXIT_FAILURE, "reg_update_bits: expecting {reg, mask, value}");
+
+        encode_regmap_result(resp, &resp_index,
+                             regmap_update_bits(i2c, reg, mask, value),
+                             "i2c_reg_update_failed");
+    } else if (strcmp(cmd, "reg_flush") == 0) {
+        encode_regmap_result(resp, &resp_index,
+                             regmap_flush(i2c),
+                             "i2c_reg_flush_failed");
+    } else if (strcmp(cmd, "regmap_stats") == 0) {
+        ei_encode_tuple_header(resp, &resp_index, 2);
+        ei_encode_ulong(resp, &resp_index, i2c->regmap.hits);
+        ei_encode_ulong(resp, &resp_index, i2c->regmap.misses);
     } else
         errx(EXIT_FAILURE, "unknown command: %s", cmd);
 
@@ -208,17 +1056,47 @@ static void i2c_handle_request(const char *req, void *cookie)
 int i2c_main(int argc, char *argv[])
 {
     if (argc != 4)
-        errx(EXIT_FAILURE, "Must pass device path and device address as arguments");
+        errx(EXIT_FAILURE, "Must pass device path and device address (or 'scan') as arguments");
+
+    if (strcmp(argv[3], "scan") == 0)
+        return i2c_scan_main(argv[2]);
 
     struct i2c_info i2c;
     i2c_init(&i2c, argv[2], strtoul(argv[3], 0, 0));
+    script_init(&i2c.scripts, i2c_script_xfer, &i2c, i2c.gpios, &i2c.gpio_count);
 
     struct erlcmd handler;
     erlcmd_init(&handler, i2c_handle_request, &i2c);
 
     for (;;) {
-        // Loop forever and process requests from Erlang.
-        erlcmd_process(&handler);
+        struct pollfd fdset[2];
+
+        fdset[0].fd = STDIN_FILENO;
+        fdset[0].events = POLLIN;
+        fdset[0].revents = 0;
+
+        fdset[1].fd = i2c.trigger.pin.fd;
+        fdset[1].events = POLLPRI;
+        fdset[1].revents = 0;
+
+        int rc = poll(fdset, i2c.trigger.active ? 2 : 1, -1);
+        if (rc < 0) {
+            // Retry if EINTR
+            if (errno == EINTR)
+                continue;
+
+            err(EXIT_FAILURE, "poll");
+        }
+
+        // Handle the trigger first to keep its latency down
+        if (i2c.trigger.active && (fdset[1].revents & POLLPRI)) {
+            struct timespec now;
+            clock_gettime(CLOCK_MONOTONIC, &now);
+            i2c_trigger_run(&i2c, (uint64_t) now.tv_sec * 1000000000ULL + now.tv_nsec);
+        }
+
+        if (fdset[0].revents & (POLLIN | POLLHUP))
+            erlcmd_process(&handler);
     }
 
     return 1;
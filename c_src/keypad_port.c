@@ -0,0 +1,230 @@
+/*
+ * Copyright (C) 2015 Frank Hunleth
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * Matrix keypad scanning
+ */
+
+#include <err.h>
+#include <errno.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/timerfd.h>
+
+#include "erlcmd.h"
+#include "gpio_port.h"
+
+//#define DEBUG
+#ifdef DEBUG
+#define debug(...) do { fprintf(stderr, __VA_ARGS__); fprintf(stderr, "\r\n"); } while(0)
+#else
+#define debug(...)
+#endif
+
+#define KEYPAD_LINES_MAX 8
+
+/*
+ * Rows are left as inputs (high impedance) and driven low one at a
+ * time so that pressing two keys in a column never shorts a high row
+ * to a low one. Columns are inputs with pull-ups, so a pressed key
+ * reads low on its column while its row is driven.
+ */
+struct keypad {
+    struct gpio rows[KEYPAD_LINES_MAX];
+    char row_directions[KEYPAD_LINES_MAX][64];
+    struct gpio cols[KEYPAD_LINES_MAX];
+    unsigned int row_count;
+    unsigned int col_count;
+
+    int timer_fd;
+
+    // A key changes state after reading the new state this many scans in a row
+    unsigned int debounce_scans;
+
+    // Bit row * col_count + col is set for each key that's down
+    uint64_t pressed;
+    uint8_t counts[KEYPAD_LINES_MAX * KEYPAD_LINES_MAX];
+};
+
+static unsigned int keypad_parse_pins(const char *list, struct gpio *pins)
+{
+    char *copy = strdup(list);
+    unsigned int count = 0;
+    for (char *tok = strtok(copy, ","); tok; tok = strtok(NULL, ",")) {
+        if (count == KEYPAD_LINES_MAX)
+            errx(EXIT_FAILURE, "Too many keypad lines in %s", list);
+
+        int pin_number = strtol(tok, NULL, 0);
+        if (gpio_init(&pins[count], pin_number, GPIO_INPUT) < 0)
+            errx(EXIT_FAILURE, "Couldn't initialize gpio %d", pin_number);
+        count++;
+    }
+    free(copy);
+    return count;
+}
+
+static void keypad_report(unsigned int row, unsigned int col, int down)
+{
+    char resp[64];
+    int resp_index = sizeof(uint32_t) + 1; // Space for payload size and type
+    resp[4] = 1; // Notification
+    ei_encode_version(resp, &resp_index);
+    ei_encode_tuple_header(resp, &resp_index, 4);
+    ei_encode_atom(resp, &resp_index, "keypad");
+    ei_encode_ulong(resp, &resp_index, row);
+    ei_encode_ulong(resp, &resp_index, col);
+    ei_encode_atom(resp, &resp_index, down ? "down" : "up");
+    erlcmd_send(resp, resp_index);
+}
+
+/**
+ * @brief	Scan all keys and report the ones that changed
+ */
+static void keypad_scan(struct keypad *keypad)
+{
+    uint64_t expirations;
+    if (read(keypad->timer_fd, &expirations, sizeof(expirations)) < 0)
+        return;
+
+    for (unsigned int row = 0; row < keypad->row_count; row++) {
+        // "low" switches to an output that starts low without a glitch
+        if (!sysfs_write_file(keypad->row_directions[row], "low"))
+            errx(EXIT_FAILURE, "Couldn't drive keypad row %d", row);
+        for (unsigned int col = 0; col < keypad->col_count; col++) {
+            unsigned int key = row * keypad->col_count + col;
+            uint64_t bit = 1ULL << key;
+            int down = !gpio_read(&keypad->cols[col]);
+            if (down == !!(keypad->pressed & bit)) {
+                keypad->counts[key] = 0;
+                continue;
+            }
+
+            if (++keypad->counts[key] >= keypad->debounce_scans) {
+                keypad->counts[key] = 0;
+                keypad->pressed ^= bit;
+                keypad_report(row, col, down);
+            }
+        }
+        if (!sysfs_write_file(keypad->row_directions[row], "in"))
+            errx(EXIT_FAILURE, "Couldn't release keypad row %d", row);
+    }
+}
+
+static void keypad_handle_request(const char *req, void *cookie)
+{
+    struct keypad *keypad = (struct keypad *) cookie;
+
+    // Commands are of the form {Command, Arguments}:
+    // { atom(), term() }
+    int req_index = sizeof(uint32_t);
+    if (ei_decode_version(req, &req_index, NULL) < 0)
+        errx(EXIT_FAILURE, "Message version issue?");
+
+    int arity;
+    if (ei_decode_tuple_header(req, &req_index, &arity) < 0 ||
+            arity != 2)
+        errx(EXIT_FAILURE, "expecting {cmd, args} tuple");
+
+    char cmd[MAXATOMLEN];
+    if (ei_decode_atom(req, &req_index, cmd) < 0)
+        errx(EXIT_FAILURE, "expecting command atom");
+
+    char resp[512];
+    int resp_index = sizeof(uint32_t) + 1; // Space for payload size and type
+    resp[4] = 0; // Reply
+    ei_encode_version(resp, &resp_index);
+    if (strcmp(cmd, "pressed") == 0) {
+        debug("pressed");
+        int count = __builtin_popcountll(keypad->pressed);
+        if (count > 0)
+            ei_encode_list_header(resp, &resp_index, count);
+        for (unsigned int key = 0; key < keypad->row_count * keypad->col_count; key++) {
+            if (keypad->pressed & (1ULL << key)) {
+                ei_encode_tuple_header(resp, &resp_index, 2);
+                ei_encode_ulong(resp, &resp_index, key / keypad->col_count);
+                ei_encode_ulong(resp, &resp_index, key % keypad->col_count);
+            }
+        }
+        ei_encode_empty_list(resp, &resp_index);
+    } else
+        errx(EXIT_FAILURE, "unknown command: %s", cmd);
+
+    debug("sending response: %d bytes", resp_index);
+    erlcmd_send(resp, resp_index);
+}
+
+int keypad_main(int argc, char *argv[])
+{
+    if (argc != 6)
+        errx(EXIT_FAILURE, "%s keypad <row pins> <column pins> <scan interval us> <debounce scans>", argv[0]);
+
+    struct keypad keypad;
+    memset(&keypad, 0, sizeof(keypad));
+    keypad.row_count = keypad_parse_pins(argv[2], keypad.rows);
+    keypad.col_count = keypad_parse_pins(argv[3], keypad.cols);
+    for (unsigned int row = 0; row < keypad.row_count; row++)
+        sprintf(keypad.row_directions[row], "/sys/class/gpio/gpio%d/direction", keypad.rows[row].pin_number);
+    unsigned long interval_us = strtoul(argv[4], NULL, 0);
+    keypad.debounce_scans = strtoul(argv[5], NULL, 0);
+    if (interval_us == 0)
+        errx(EXIT_FAILURE, "Scan interval can't be 0");
+    if (keypad.debounce_scans > UINT8_MAX)
+        keypad.debounce_scans = UINT8_MAX;
+
+    keypad.timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (keypad.timer_fd < 0)
+        err(EXIT_FAILURE, "timerfd_create");
+
+    struct itimerspec period;
+    period.it_interval.tv_sec = interval_us / 1000000;
+    period.it_interval.tv_nsec = (interval_us % 1000000) * 1000;
+    period.it_value = period.it_interval;
+    if (timerfd_settime(keypad.timer_fd, 0, &period, NULL) < 0)
+        err(EXIT_FAILURE, "timerfd_settime");
+
+    struct erlcmd handler;
+    erlcmd_init(&handler, keypad_handle_request, &keypad);
+
+    for (;;) {
+        struct pollfd fdset[2];
+
+        fdset[0].fd = STDIN_FILENO;
+        fdset[0].events = POLLIN;
+        fdset[0].revents = 0;
+
+        fdset[1].fd = keypad.timer_fd;
+        fdset[1].events = POLLIN;
+        fdset[1].revents = 0;
+
+        int rc = poll(fdset, 2, -1);
+        if (rc < 0) {
+            // Retry if EINTR
+            if (errno == EINTR)
+                continue;
+
+            err(EXIT_FAILURE, "poll");
+        }
+
+        if (fdset[0].revents & (POLLIN | POLLHUP))
+            erlcmd_process(&handler);
+
+        if (fdset[1].revents & POLLIN)
+            keypad_scan(&keypad);
+    }
+
+    return 0;
+}
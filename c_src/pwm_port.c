@@ -0,0 +1,324 @@
+/*
+ * Copyright (C) 2015 Frank Hunleth
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * Hardware PWM through /sys/class/pwm
+ */
+
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "erlcmd.h"
+#include "gpio_port.h"
+
+//#define DEBUG
+#ifdef DEBUG
+#define debug(...) do { fprintf(stderr, __VA_ARGS__); fprintf(stderr, "\r\n"); } while(0)
+#else
+#define debug(...)
+#endif
+
+#define PWM_CHANNEL_MAX 16
+
+/*
+ * The attribute files are kept open so that each update is one pwrite.
+ * The period and duty cycle are remembered so that they can be written
+ * in the order that the kernel accepts (duty cycle <= period).
+ */
+struct pwm_channel {
+    unsigned int number;
+    int period_fd;
+    int duty_fd;
+    int enable_fd;
+    uint64_t period_ns;
+    uint64_t duty_ns;
+};
+
+struct pwm {
+    struct pwm_channel channels[PWM_CHANNEL_MAX];
+    unsigned int count;
+
+    // Set when the attributes are regular files like in a test fixture
+    // rather than sysfs. Those need to be truncated after writes.
+    int truncate;
+};
+
+static int pwm_open_attr(const char *chip, unsigned int number, const char *attr)
+{
+    char path[256];
+    snprintf(path, sizeof(path), "%s/pwm%u/%s", chip, number, attr);
+    int fd = open(path, O_RDWR | O_CLOEXEC);
+    if (fd < 0)
+        err(EXIT_FAILURE, "open %s", path);
+    return fd;
+}
+
+static uint64_t pwm_read_attr(int fd)
+{
+    char buf[32];
+    ssize_t amount_read = pread(fd, buf, sizeof(buf) - 1, 0);
+    if (amount_read <= 0)
+        return 0;
+
+    buf[amount_read] = '\0';
+    return strtoull(buf, NULL, 10);
+}
+
+static int pwm_write_attr(struct pwm *pwm, int fd, uint64_t value)
+{
+    char buf[32];
+    int len = sprintf(buf, "%" PRIu64, value);
+    if (pwrite(fd, buf, len, 0) != len)
+        return -1;
+
+    if (pwm->truncate && ftruncate(fd, len) < 0)
+        return -1;
+
+    return 1;
+}
+
+/**
+ * @brief	Export a channel and open its attributes
+ *
+ * @param	pwm     The PWM structure
+ * @param	chip    Path to the chip like /sys/class/pwm/pwmchip0
+ * @param	number  The channel number on the chip
+ */
+static void pwm_init_channel(struct pwm *pwm, const char *chip, unsigned int number)
+{
+    struct pwm_channel *channel = &pwm->channels[pwm->count];
+    channel->number = number;
+
+    char path[256];
+    snprintf(path, sizeof(path), "%s/pwm%u/period", chip, number);
+    if (access(path, F_OK) == -1) {
+        char export_path[256];
+        char numstr[16];
+        snprintf(export_path, sizeof(export_path), "%s/export", chip);
+        sprintf(numstr, "%u", number);
+        if (!sysfs_write_file(export_path, numstr))
+            errx(EXIT_FAILURE, "Couldn't export PWM %u on %s", number, chip);
+
+        /* Like GPIOs, the attributes may not be usable for a moment
+           after the export while udev fixes their permissions. */
+        if (access(path, W_OK) == -1)
+            sleep(1);
+    }
+
+    channel->period_fd = pwm_open_attr(chip, number, "period");
+    channel->duty_fd = pwm_open_attr(chip, number, "duty_cycle");
+    channel->enable_fd = pwm_open_attr(chip, number, "enable");
+    channel->period_ns = pwm_read_attr(channel->period_fd);
+    channel->duty_ns = pwm_read_attr(channel->duty_fd);
+
+    struct stat st;
+    if (fstat(channel->period_fd, &st) == 0 && S_ISREG(st.st_mode))
+        pwm->truncate = 1;
+
+    pwm->count++;
+}
+
+static struct pwm_channel *pwm_find_channel(struct pwm *pwm, unsigned long number)
+{
+    for (unsigned int i = 0; i < pwm->count; i++) {
+        if (pwm->channels[i].number == number)
+            return &pwm->channels[i];
+    }
+    return NULL;
+}
+
+/**
+ * @brief	Set the period and duty cycle of a channel
+ *
+ * @return 	1 for success, -1 for failure
+ */
+static int pwm_configure(struct pwm *pwm, struct pwm_channel *channel, uint64_t period_ns, uint64_t duty_ns)
+{
+    // Shrink the duty cycle first if it won't fit in the new period
+    if (channel->duty_ns > period_ns) {
+        if (pwm_write_attr(pwm, channel->duty_fd, duty_ns) < 0)
+            return -1;
+        channel->duty_ns = duty_ns;
+    }
+    if (channel->period_ns != period_ns) {
+        if (pwm_write_attr(pwm, channel->period_fd, period_ns) < 0)
+            return -1;
+        channel->period_ns = period_ns;
+    }
+    if (channel->duty_ns != duty_ns) {
+        if (pwm_write_attr(pwm, channel->duty_fd, duty_ns) < 0)
+            return -1;
+        channel->duty_ns = duty_ns;
+    }
+    return 1;
+}
+
+static int pwm_set_duty(struct pwm *pwm, struct pwm_channel *channel, uint64_t duty_ns)
+{
+    if (pwm_write_attr(pwm, channel->duty_fd, duty_ns) < 0)
+        return -1;
+
+    channel->duty_ns = duty_ns;
+    return 1;
+}
+
+static void pwm_encode_error(char *resp, int *resp_index, const char *reason, unsigned long number)
+{
+    ei_encode_tuple_header(resp, resp_index, 2);
+    ei_encode_atom(resp, resp_index, "error");
+    ei_encode_tuple_header(resp, resp_index, 2);
+    ei_encode_atom(resp, resp_index, reason);
+    ei_encode_ulong(resp, resp_index, number);
+}
+
+static void pwm_handle_request(const char *req, void *cookie)
+{
+    struct pwm *pwm = (struct pwm *) cookie;
+
+    // Commands are of the form {Command, Arguments}:
+    // { atom(), term() }
+    int req_index = sizeof(uint32_t);
+    if (ei_decode_version(req, &req_index, NULL) < 0)
+        errx(EXIT_FAILURE, "Message version issue?");
+
+    int arity;
+    if (ei_decode_tuple_header(req, &req_index, &arity) < 0 ||
+            arity != 2)
+        errx(EXIT_FAILURE, "expecting {cmd, args} tuple");
+
+    char cmd[MAXATOMLEN];
+    if (ei_decode_atom(req, &req_index, cmd) < 0)
+        errx(EXIT_FAILURE, "expecting command atom");
+
+    char resp[256];
+    int resp_index = sizeof(uint32_t) + 1; // Space for payload size and type
+    resp[4] = 0; // Reply
+    ei_encode_version(resp, &resp_index);
+    if (strcmp(cmd, "configure") == 0) {
+        unsigned long number;
+        unsigned long long period_ns;
+        unsigned long long duty_ns;
+        if (ei_decode_tuple_header(req, &req_index, &arity) < 0 ||
+                arity != 3 ||
+                ei_decode_ulong(req, &req_index, &number) < 0 ||
+                ei_decode_ulonglong(req, &req_index, &period_ns) < 0 ||
+                ei_decode_ulonglong(req, &req_index, &duty_ns) < 0)
+            errx(EXIT_FAILURE, "configure: expecting {channel, period_ns, duty_ns}");
+        debug("configure %lu %llu %llu", number, period_ns, duty_ns);
+
+        struct pwm_channel *channel = pwm_find_channel(pwm, number);
+        if (!channel)
+            pwm_encode_error(resp, &resp_index, "unknown_channel", number);
+        else if (pwm_configure(pwm, channel, period_ns, duty_ns) < 0)
+            pwm_encode_error(resp, &resp_index, "pwm_write_failed", number);
+        else
+            ei_encode_atom(resp, &resp_index, "ok");
+    } else if (strcmp(cmd, "set_duty") == 0) {
+        // A list of {channel, duty_ns} so that all of a motor
+        // controller's channels can be updated with one request.
+        int count;
+        if (ei_decode_list_header(req, &req_index, &count) < 0)
+            errx(EXIT_FAILURE, "set_duty: expecting [{channel, duty_ns}]");
+
+        int ok = 1;
+        for (int i = 0; i < count; i++) {
+            unsigned long number;
+            unsigned long long duty_ns;
+            if (ei_decode_tuple_header(req, &req_index, &arity) < 0 ||
+                    arity != 2 ||
+                    ei_decode_ulong(req, &req_index, &number) < 0 ||
+                    ei_decode_ulonglong(req, &req_index, &duty_ns) < 0)
+                errx(EXIT_FAILURE, "set_duty: expecting {channel, duty_ns}");
+            debug("set_duty %lu %llu", number, duty_ns);
+            if (!ok)
+                continue;
+
+            struct pwm_channel *channel = pwm_find_channel(pwm, number);
+            if (!channel) {
+                pwm_encode_error(resp, &resp_index, "unknown_channel", number);
+                ok = 0;
+            } else if (pwm_set_duty(pwm, channel, duty_ns) < 0) {
+                pwm_encode_error(resp, &resp_index, "pwm_write_failed", number);
+                ok = 0;
+            }
+        }
+        if (ok)
+            ei_encode_atom(resp, &resp_index, "ok");
+    } else if (strcmp(cmd, "enable") == 0) {
+        unsigned long number;
+        int enable;
+        if (ei_decode_tuple_header(req, &req_index, &arity) < 0 ||
+                arity != 2 ||
+                ei_decode_ulong(req, &req_index, &number) < 0 ||
+                ei_decode_boolean(req, &req_index, &enable) < 0)
+            errx(EXIT_FAILURE, "enable: expecting {channel, boolean}");
+        debug("enable %lu %d", number, enable);
+
+        struct pwm_channel *channel = pwm_find_channel(pwm, number);
+        if (!channel)
+            pwm_encode_error(resp, &resp_index, "unknown_channel", number);
+        else if (pwm_write_attr(pwm, channel->enable_fd, enable ? 1 : 0) < 0)
+            pwm_encode_error(resp, &resp_index, "pwm_write_failed", number);
+        else
+            ei_encode_atom(resp, &resp_index, "ok");
+    } else
+        errx(EXIT_FAILURE, "unknown command: %s", cmd);
+
+    debug("sending response: %d bytes", resp_index);
+    erlcmd_send(resp, resp_index);
+}
+
+int pwm_main(int argc, char *argv[])
+{
+    if (argc < 4 || argc - 3 > PWM_CHANNEL_MAX)
+        errx(EXIT_FAILURE, "%s pwm <chip path> <channel#>...", argv[0]);
+
+    struct pwm pwm;
+    memset(&pwm, 0, sizeof(pwm));
+    for (int i = 3; i < argc; i++)
+        pwm_init_channel(&pwm, argv[2], strtoul(argv[i], NULL, 0));
+
+    struct erlcmd handler;
+    erlcmd_init(&handler, pwm_handle_request, &pwm);
+
+    for (;;) {
+        struct pollfd fdset[1];
+
+        fdset[0].fd = STDIN_FILENO;
+        fdset[0].events = POLLIN;
+        fdset[0].revents = 0;
+
+        int rc = poll(fdset, 1, -1);
+        if (rc < 0) {
+            // Retry if EINTR
+            if (errno == EINTR)
+                continue;
+
+            err(EXIT_FAILURE, "poll");
+        }
+
+        if (fdset[0].revents & (POLLIN | POLLHUP))
+            erlcmd_process(&handler);
+    }
+
+    return 0;
+}
@@ -0,0 +1,414 @@
+/*
+ *  Copyright 2015 Frank Hunleth
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "script.h"
+#include "erlcmd.h"
+
+#include <err.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/*
+ * Programs are uploaded as a list of operations:
+ *
+ *   {xfer, Tx, ParamRefs, RxLen}
+ *   {delay, Us}
+ *   {gpio_write, GpioIndex, Value}
+ *   {gpio_wait, GpioIndex, Value, TimeoutUs}
+ *   {poll, Tx, ParamRefs, RxLen, ByteIndex, Mask, Match, IntervalUs, TimeoutUs}
+ *
+ * ParamRefs is a list of {Offset, Param} that replace bytes in Tx with
+ * parameter bytes when the program runs. Everything that xfer reads
+ * is collected and returned. Programs are checked when they're loaded
+ * so that running them can't go out of bounds.
+ */
+
+static uint64_t script_now_us(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t) now.tv_sec * 1000000ULL + now.tv_nsec / 1000;
+}
+
+static void script_sleep_us(unsigned long us)
+{
+    struct timespec delay;
+    delay.tv_sec = us / 1000000;
+    delay.tv_nsec = (us % 1000000) * 1000;
+    while (nanosleep(&delay, &delay) < 0 && errno == EINTR)
+        ;
+}
+
+static void script_free(struct script *script)
+{
+    if (!script)
+        return;
+
+    for (unsigned int i = 0; i < script->count; i++) {
+        free(script->ops[i].tx);
+        free(script->ops[i].refs);
+    }
+    free(script->ops);
+    free(script);
+}
+
+void script_init(struct script_engine *engine,
+                 script_xfer_fn xfer, void *cookie,
+                 struct gpio *gpios, const unsigned int *gpio_count)
+{
+    memset(engine, 0, sizeof(*engine));
+    engine->xfer = xfer;
+    engine->cookie = cookie;
+    engine->gpios = gpios;
+    engine->gpio_count = gpio_count;
+}
+
+/**
+ * @brief	Decode the tx data and parameter references of an xfer or poll
+ *
+ * @return 	1 for success, 0 if invalid
+ */
+static int script_decode_tx(const char *req, int *req_index, struct script_op *op)
+{
+    const char *tx;
+    int tx_len;
+    if (erlcmd_decode_binary_view(req, req_index, &tx, &tx_len) < 0 ||
+            tx_len > SCRIPT_XFER_MAX)
+        return 0;
+
+    if (tx_len > 0) {
+        op->tx = malloc(tx_len);
+        if (!op->tx)
+            err(EXIT_FAILURE, "malloc");
+        memcpy(op->tx, tx, tx_len);
+    }
+    op->tx_len = tx_len;
+
+    int count;
+    if (ei_decode_list_header(req, req_index, &count) < 0 ||
+            count > tx_len)
+        return 0;
+
+    if (count > 0) {
+        op->refs = malloc(count * sizeof(struct script_param_ref));
+        if (!op->refs)
+            err(EXIT_FAILURE, "malloc");
+
+        for (int i = 0; i < count; i++) {
+            int arity;
+            unsigned long offset;
+            unsigned long param;
+            if (ei_decode_tuple_header(req, req_index, &arity) < 0 ||
+                    arity != 2 ||
+                    ei_decode_ulong(req, req_index, &offset) < 0 ||
+                    ei_decode_ulong(req, req_index, &param) < 0 ||
+                    offset >= (unsigned long) tx_len ||
+                    param >= SCRIPT_PARAMS_MAX)
+                return 0;
+
+            op->refs[i].offset = offset;
+            op->refs[i].param = param;
+        }
+        op->ref_count = count;
+
+        if (ei_decode_list_header(req, req_index, &count) < 0 || count != 0)
+            return 0;
+    }
+    return 1;
+}
+
+/**
+ * @brief	Decode and check one operation
+ *
+ * @return 	1 for success, 0 if invalid
+ */
+static int script_decode_op(const char *req, int *req_index, struct script_op *op)
+{
+    int arity;
+    char name[MAXATOMLEN];
+    unsigned long rx_len;
+    unsigned long gpio;
+    long value;
+    unsigned long byte_index;
+    unsigned long mask;
+    unsigned long match;
+
+    if (ei_decode_tuple_header(req, req_index, &arity) < 0 ||
+            ei_decode_atom(req, req_index, name) < 0)
+        return 0;
+
+    if (strcmp(name, "xfer") == 0 && arity == 4) {
+        op->type = SCRIPT_OP_XFER;
+        if (!script_decode_tx(req, req_index, op) ||
+                ei_decode_ulong(req, req_index, &rx_len) < 0 ||
+                rx_len > SCRIPT_XFER_MAX ||
+                (op->tx_len == 0 && rx_len == 0))
+            return 0;
+        op->rx_len = rx_len;
+    } else if (strcmp(name, "delay") == 0 && arity == 2) {
+        op->type = SCRIPT_OP_DELAY;
+        if (ei_decode_ulong(req, req_index, &op->interval_us) < 0)
+            return 0;
+    } else if (strcmp(name, "gpio_write") == 0 && arity == 3) {
+        op->type = SCRIPT_OP_GPIO_WRITE;
+        if (ei_decode_ulong(req, req_index, &gpio) < 0 ||
+                ei_decode_long(req, req_index, &value) < 0)
+            return 0;
+        op->gpio = gpio;
+        op->value = value ? 1 : 0;
+    } else if (strcmp(name, "gpio_wait") == 0 && arity == 4) {
+        op->type = SCRIPT_OP_GPIO_WAIT;
+        if (ei_decode_ulong(req, req_index, &gpio) < 0 ||
+                ei_decode_long(req, req_index, &value) < 0 ||
+                ei_decode_ulong(req, req_index, &op->timeout_us) < 0)
+            return 0;
+        op->gpio = gpio;
+        op->value = value ? 1 : 0;
+    } else if (strcmp(name, "poll") == 0 && arity == 9) {
+        op->type = SCRIPT_OP_POLL;
+        if (!script_decode_tx(req, req_index, op) ||
+                ei_decode_ulong(req, req_index, &rx_len) < 0 ||
+                ei_decode_ulong(req, req_index, &byte_index) < 0 ||
+                ei_decode_ulong(req, req_index, &mask) < 0 ||
+                ei_decode_ulong(req, req_index, &match) < 0 ||
+                ei_decode_ulong(req, req_index, &op->interval_us) < 0 ||
+                ei_decode_ulong(req, req_index, &op->timeout_us) < 0 ||
+                rx_len > SCRIPT_XFER_MAX ||
+                byte_index >= rx_len ||
+                mask > 0xff ||
+                match > 0xff)
+            return 0;
+        op->rx_len = rx_len;
+        op->byte_index = byte_index;
+        op->mask = mask;
+        op->match = match;
+    } else
+        return 0;
+
+    return 1;
+}
+
+/**
+ * @brief	Load a program. Args are {id, [op]}
+ *
+ * The reply is ok or {error, {invalid_op, N}} where N is the first bad
+ * operation (counting from 1).
+ */
+void script_load_request(struct script_engine *engine,
+                         const char *req, int *req_index,
+                         char *resp, int *resp_index)
+{
+    int arity;
+    unsigned long id;
+    int count;
+    if (ei_decode_tuple_header(req, req_index, &arity) < 0 ||
+            arity != 2 ||
+            ei_decode_ulong(req, req_index, &id) < 0 ||
+            id >= SCRIPT_MAX ||
+            ei_decode_list_header(req, req_index, &count) < 0 ||
+            count < 1 ||
+            count > SCRIPT_OPS_MAX)
+        errx(EXIT_FAILURE, "script_load: expecting {id (0-%d), [op]} with 1 to %d ops", SCRIPT_MAX - 1, SCRIPT_OPS_MAX);
+
+    struct script *script = calloc(1, sizeof(struct script));
+    if (script)
+        script->ops = calloc(count, sizeof(struct script_op));
+    if (!script || !script->ops)
+        err(EXIT_FAILURE, "calloc");
+    script->count = count;
+
+    size_t result_len = 0;
+    for (int i = 0; i < count; i++) {
+        struct script_op *op = &script->ops[i];
+        int valid = script_decode_op(req, req_index, op);
+        if (valid && (op->type == SCRIPT_OP_XFER || op->type == SCRIPT_OP_POLL)) {
+            result_len += op->rx_len;
+            valid = result_len <= SCRIPT_RESULT_MAX;
+        }
+
+        if (!valid) {
+            script_free(script);
+            ei_encode_tuple_header(resp, resp_index, 2);
+            ei_encode_atom(resp, resp_index, "error");
+            ei_encode_tuple_header(resp, resp_index, 2);
+            ei_encode_atom(resp, resp_index, "invalid_op");
+            ei_encode_long(resp, resp_index, i + 1);
+            return;
+        }
+
+        for (unsigned int j = 0; j < op->ref_count; j++) {
+            if (op->refs[j].param >= script->param_count)
+                script->param_count = op->refs[j].param + 1;
+        }
+    }
+
+    script_free(engine->scripts[id]);
+    engine->scripts[id] = script;
+    ei_encode_atom(resp, resp_index, "ok");
+}
+
+static int script_xfer(struct script_engine *engine,
+                       const struct script_op *op,
+                       const uint8_t *params,
+                       uint8_t *rx)
+{
+    const uint8_t *tx = op->tx;
+    if (op->ref_count > 0) {
+        memcpy(engine->tx, op->tx, op->tx_len);
+        for (unsigned int i = 0; i < op->ref_count; i++)
+            engine->tx[op->refs[i].offset] = params[op->refs[i].param];
+        tx = engine->tx;
+    }
+    return engine->xfer(engine->cookie, tx, op->tx_len, rx, op->rx_len);
+}
+
+static struct gpio *script_gpio(struct script_engine *engine, unsigned int index)
+{
+    return index < *engine->gpio_count ? &engine->gpios[index] : NULL;
+}
+
+/**
+ * @brief	Run one operation
+ *
+ * @param	result     Where xfer puts what it reads
+ *
+ * @return 	NULL for success or the reason for failing
+ */
+static const char *script_run_op(struct script_engine *engine,
+                                 const struct script_op *op,
+                                 const uint8_t *params,
+                                 uint8_t *result)
+{
+    struct gpio *pin;
+    uint64_t deadline = script_now_us() + op->timeout_us;
+
+    switch (op->type) {
+    case SCRIPT_OP_XFER:
+        if (!script_xfer(engine, op, params, result))
+            return "transfer_failed";
+        break;
+
+    case SCRIPT_OP_DELAY:
+        script_sleep_us(op->interval_us);
+        break;
+
+    case SCRIPT_OP_GPIO_WRITE:
+        pin = script_gpio(engine, op->gpio);
+        if (!pin || gpio_write(pin, op->value) < 0)
+            return "gpio_failed";
+        break;
+
+    case SCRIPT_OP_GPIO_WAIT:
+        pin = script_gpio(engine, op->gpio);
+        if (!pin)
+            return "gpio_failed";
+
+        while (gpio_read(pin) != op->value) {
+            if (script_now_us() > deadline)
+                return "timeout";
+            script_sleep_us(10);
+        }
+        break;
+
+    case SCRIPT_OP_POLL:
+        // Each read replaces the last one so that the result has the final one
+        for (;;) {
+            if (!script_xfer(engine, op, params, result))
+                return "transfer_failed";
+
+            if ((result[op->byte_index] & op->mask) == op->match)
+                break;
+
+            if (script_now_us() > deadline)
+                return "timeout";
+            script_sleep_us(op->interval_us);
+        }
+        break;
+    }
+    return NULL;
+}
+
+/**
+ * @brief	Run a program. Args are {id, params}
+ *
+ * The reply is a binary with everything that the program read or
+ * {error, {Reason, N}} where N is the operation that failed (counting
+ * from 1). resp needs room for SCRIPT_RESULT_MAX bytes.
+ */
+void script_run_request(struct script_engine *engine,
+                        const char *req, int *req_index,
+                        char *resp, int *resp_index)
+{
+    int arity;
+    unsigned long id;
+    const char *params;
+    int param_count;
+    if (ei_decode_tuple_header(req, req_index, &arity) < 0 ||
+            arity != 2 ||
+            ei_decode_ulong(req, req_index, &id) < 0 ||
+            id >= SCRIPT_MAX ||
+            erlcmd_decode_binary_view(req, req_index, &params, &param_count) < 0)
+        errx(EXIT_FAILURE, "script_run: expecting {id (0-%d), params}", SCRIPT_MAX - 1);
+
+    const struct script *script = engine->scripts[id];
+    if (!script || (unsigned int) param_count < script->param_count) {
+        ei_encode_tuple_header(resp, resp_index, 2);
+        ei_encode_atom(resp, resp_index, "error");
+        ei_encode_atom(resp, resp_index, script ? "missing_params" : "no_program");
+        return;
+    }
+
+    // Collect what's read straight into the response
+    uint8_t *result = (uint8_t *) &resp[*resp_index + ERLCMD_BINARY_HEADER_SIZE];
+    size_t result_len = 0;
+    for (unsigned int i = 0; i < script->count; i++) {
+        const struct script_op *op = &script->ops[i];
+        const char *reason = script_run_op(engine, op, (const uint8_t *) params, &result[result_len]);
+        if (reason) {
+            ei_encode_tuple_header(resp, resp_index, 2);
+            ei_encode_atom(resp, resp_index, "error");
+            ei_encode_tuple_header(resp, resp_index, 2);
+            ei_encode_atom(resp, resp_index, reason);
+            ei_encode_long(resp, resp_index, i + 1);
+            return;
+        }
+
+        if (op->type == SCRIPT_OP_XFER || op->type == SCRIPT_OP_POLL)
+            result_len += op->rx_len;
+    }
+
+    erlcmd_encode_binary_header(resp, resp_index, result_len);
+    *resp_index += result_len;
+}
+
+/**
+ * @brief	Unload a program. Args are the id.
+ */
+void script_delete_request(struct script_engine *engine,
+                           const char *req, int *req_index,
+                           char *resp, int *resp_index)
+{
+    unsigned long id;
+    if (ei_decode_ulong(req, req_index, &id) < 0 ||
+            id >= SCRIPT_MAX)
+        errx(EXIT_FAILURE, "script_delete: expecting an id (0-%d)", SCRIPT_MAX - 1);
+
+    script_free(engine->scripts[id]);
+    engine->scripts[id] = NULL;
+    ei_encode_atom(resp, resp_index, "ok");
+}
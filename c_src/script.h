@@ -0,0 +1,116 @@
+/*
+ *  Copyright 2015 Frank Hunleth
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * Programs of bus and GPIO operations that run inside a port
+ */
+
+#ifndef SCRIPT_H
+#define SCRIPT_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "gpio_port.h"
+
+// Number of programs that can be loaded at a time (ids 0 to SCRIPT_MAX-1)
+#define SCRIPT_MAX 32
+
+#define SCRIPT_OPS_MAX 256
+#define SCRIPT_XFER_MAX 4096
+#define SCRIPT_PARAMS_MAX 256
+
+// Max bytes that a program can collect. Responses need room for this.
+#define SCRIPT_RESULT_MAX 4096
+
+enum script_op_type {
+    SCRIPT_OP_XFER,
+    SCRIPT_OP_DELAY,
+    SCRIPT_OP_GPIO_WRITE,
+    SCRIPT_OP_GPIO_WAIT,
+    SCRIPT_OP_POLL
+};
+
+// A byte of tx data that comes from a parameter when the program runs
+struct script_param_ref {
+    uint16_t offset;
+    uint16_t param;
+};
+
+struct script_op {
+    enum script_op_type type;
+
+    // Transfers and polls
+    uint8_t *tx;
+    size_t tx_len;
+    struct script_param_ref *refs;
+    unsigned int ref_count;
+    size_t rx_len;
+
+    // GPIO writes and waits
+    unsigned int gpio;
+    int value;
+
+    // Polls finish when (rx[byte_index] & mask) == match
+    unsigned int byte_index;
+    uint8_t mask;
+    uint8_t match;
+
+    unsigned long interval_us;
+    unsigned long timeout_us;
+};
+
+struct script {
+    struct script_op *ops;
+    unsigned int count;
+
+    // Number of parameter bytes that the program uses
+    unsigned int param_count;
+};
+
+/*
+ * Transfers are a write followed by a read in one transaction. Either
+ * part may be empty. Return 1 for success, 0 for failure.
+ */
+typedef int (*script_xfer_fn)(void *cookie,
+                              const uint8_t *tx, size_t tx_len,
+                              uint8_t *rx, size_t rx_len);
+
+struct script_engine {
+    script_xfer_fn xfer;
+    void *cookie;
+
+    // The port's GPIOs. The count is a pointer since GPIOs can change.
+    struct gpio *gpios;
+    const unsigned int *gpio_count;
+
+    struct script *scripts[SCRIPT_MAX];
+    uint8_t tx[SCRIPT_XFER_MAX];
+};
+
+void script_init(struct script_engine *engine,
+                 script_xfer_fn xfer, void *cookie,
+                 struct gpio *gpios, const unsigned int *gpio_count);
+
+void script_load_request(struct script_engine *engine,
+                         const char *req, int *req_index,
+                         char *resp, int *resp_index);
+void script_run_request(struct script_engine *engine,
+                        const char *req, int *req_index,
+                        char *resp, int *resp_index);
+void script_delete_request(struct script_engine *engine,
+                           const char *req, int *req_index,
+                           char *resp, int *resp_index);
+
+#endif
@@ -0,0 +1,285 @@
+/*
+ *  Copyright 2015 Frank Hunleth
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "spi_flash_sim.h"
+
+#include <err.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+/*
+ * The simulated part looks like a Winbond W25Q series chip whose size is
+ * the size of the backing file. Writes go straight to the file, so it can
+ * be inspected or preloaded with an image.
+ */
+#define SIM_MANUFACTURER_ID 0xef
+#define SIM_MEMORY_TYPE     0x40
+#define SIM_PAGE_SIZE       256
+
+// Status reads that report busy after each program or erase
+#define SIM_BUSY_POLLS      2
+
+/**
+ * @brief	Open a file as a simulated flash chip
+ *
+ * @return 	1 for success, 0 for failure
+ */
+int flash_sim_open(struct flash_sim *sim, const char *path)
+{
+    memset(sim, 0, sizeof(*sim));
+
+    int fd = open(path, O_RDWR);
+    if (fd < 0)
+        return 0;
+
+    struct stat st;
+    if (fstat(fd, &st) < 0 || st.st_size == 0) {
+        close(fd);
+        return 0;
+    }
+
+    sim->image = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (sim->image == MAP_FAILED)
+        return 0;
+
+    sim->size = st.st_size;
+    return 1;
+}
+
+static unsigned int capacity_code(size_t size)
+{
+    unsigned int code = 0;
+    while (((size_t) 1 << code) < size)
+        code++;
+    return code;
+}
+
+/*
+ * A minimal SFDP table with the header, one parameter header and the
+ * first two dwords of the basic flash parameter table (4K erase and
+ * density).
+ */
+#define SIM_SFDP_SIZE 0x38
+static void sim_sfdp(const struct flash_sim *sim, uint8_t *sfdp)
+{
+    static const uint8_t header[16] = {
+        'S', 'F', 'D', 'P', 0x06, 0x01, 0x00, 0xff,
+        0x00, 0x06, 0x01, 0x02, 0x30, 0x00, 0x00, 0xff
+    };
+    uint32_t density = sim->size * 8 - 1;
+
+    memset(sfdp, 0xff, SIM_SFDP_SIZE);
+    memcpy(sfdp, header, sizeof(header));
+    sfdp[0x30] = 0xe5;
+    sfdp[0x31] = 0x20;
+    sfdp[0x32] = 0xf1;
+    sfdp[0x33] = 0xff;
+    sfdp[0x34] = density;
+    sfdp[0x35] = density >> 8;
+    sfdp[0x36] = density >> 16;
+    sfdp[0x37] = density >> 24;
+}
+
+static void sim_program(struct flash_sim *sim, uint32_t addr, const uint8_t *data, size_t len)
+{
+    // Programming wraps within the page and can only clear bits.
+    uint32_t page = addr & ~(SIM_PAGE_SIZE - 1);
+    for (size_t i = 0; i < len; i++) {
+        uint32_t offset = page + ((addr - page + i) % SIM_PAGE_SIZE);
+        if (offset < sim->size)
+            sim->image[offset] &= data[i];
+    }
+}
+
+static void sim_erase(struct flash_sim *sim, uint32_t addr, size_t block_size)
+{
+    addr &= ~(block_size - 1);
+    if (addr < sim->size)
+        memset(&sim->image[addr], 0xff, addr + block_size > sim->size ? sim->size - addr : block_size);
+}
+
+static uint32_t sim_addr(const uint8_t *tx, int addr_width)
+{
+    uint32_t addr = 0;
+    for (int i = 0; i < addr_width; i++)
+        addr = (addr << 8) | tx[1 + i];
+    return addr;
+}
+
+/**
+ * @brief	Run one chip select's worth of bytes through the flash
+ */
+static void sim_command(struct flash_sim *sim, const uint8_t *tx, uint8_t *rx, size_t len)
+{
+    memset(rx, 0xff, len);
+
+    int addr_width = 3;
+    int dummy = 0;
+    int is_read = 0;
+    switch (tx[0]) {
+    case 0x9f: // Read JEDEC ID
+        if (len > 1) rx[1] = SIM_MANUFACTURER_ID;
+        if (len > 2) rx[2] = SIM_MEMORY_TYPE;
+        if (len > 3) rx[3] = capacity_code(sim->size);
+        return;
+
+    case 0x5a: // Read SFDP
+        if (len > 5) {
+            uint8_t sfdp[SIM_SFDP_SIZE];
+            uint32_t addr = sim_addr(tx, 3);
+            sim_sfdp(sim, sfdp);
+            for (size_t i = 5; i < len; i++) {
+                if (addr + i - 5 < SIM_SFDP_SIZE)
+                    rx[i] = sfdp[addr + i - 5];
+            }
+        }
+        return;
+
+    case 0x05: // Read status register 1
+        for (size_t i = 1; i < len; i++) {
+            rx[i] = sim->write_enabled ? 0x02 : 0;
+            if (sim->busy_polls > 0) {
+                rx[i] |= 0x01;
+                sim->busy_polls--;
+            }
+        }
+        return;
+
+    case 0x06: // Write enable
+        sim->write_enabled = 1;
+        return;
+
+    case 0x04: // Write disable
+        sim->write_enabled = 0;
+        return;
+
+    case 0xc7: case 0x60: // Chip erase
+        if (sim->write_enabled) {
+            memset(sim->image, 0xff, sim->size);
+            sim->write_enabled = 0;
+            sim->busy_polls = SIM_BUSY_POLLS;
+        }
+        return;
+
+    case 0x13: case 0x0c: case 0x3c: case 0x6c: // 4-byte address reads
+        addr_width = 4;
+        dummy = tx[0] == 0x13 ? 0 : 1;
+        is_read = 1;
+        break;
+
+    case 0x03: case 0x0b: case 0x3b: case 0x6b: // Reads
+        dummy = tx[0] == 0x03 ? 0 : 1;
+        is_read = 1;
+        break;
+
+    case 0x12: case 0x21: case 0x5c: case 0xdc: // 4-byte address program and erase
+        addr_width = 4;
+        break;
+
+    default:
+        break;
+    }
+
+    if (len < (size_t) (1 + addr_width + dummy))
+        return;
+
+    uint32_t addr = sim_addr(tx, addr_width);
+    size_t header_len = 1 + addr_width + dummy;
+    if (is_read) {
+        for (size_t i = header_len; i < len; i++)
+            rx[i] = sim->image[(addr + i - header_len) % sim->size];
+        return;
+    }
+
+    // Everything else needs the write enable latch
+    if (!sim->write_enabled)
+        return;
+
+    switch (tx[0]) {
+    case 0x02: case 0x12: // Page program
+        sim_program(sim, addr, &tx[header_len], len - header_len);
+        break;
+    case 0x20: case 0x21: // 4K sector erase
+        sim_erase(sim, addr, 4096);
+        break;
+    case 0x52: case 0x5c: // 32K block erase
+        sim_erase(sim, addr, 32768);
+        break;
+    case 0xd8: case 0xdc: // 64K block erase
+        sim_erase(sim, addr, 65536);
+        break;
+    default:
+        return;
+    }
+    sim->write_enabled = 0;
+    sim->busy_polls = SIM_BUSY_POLLS;
+}
+
+/**
+ * @brief	Handle an SPI_IOC_MESSAGE for the simulated flash
+ *
+ * Segments are joined until one has cs_change set or the message ends
+ * since that's when the real chip would see chip select go away.
+ *
+ * @return 	the number of bytes transferred like the ioctl
+ */
+int flash_sim_message(struct flash_sim *sim, struct spi_ioc_transfer *tfers, unsigned int count)
+{
+    int total = 0;
+    unsigned int first = 0;
+    for (unsigned int i = 0; i < count; i++) {
+        if (!tfers[i].cs_change && i != count - 1)
+            continue;
+
+        size_t len = 0;
+        for (unsigned int j = first; j <= i; j++)
+            len += tfers[j].len;
+
+        uint8_t *tx = calloc(1, len);
+        uint8_t *rx = malloc(len);
+        if (!tx || !rx)
+            err(EXIT_FAILURE, "malloc");
+
+        size_t offset = 0;
+        for (unsigned int j = first; j <= i; j++) {
+            if (tfers[j].tx_buf)
+                memcpy(&tx[offset], (const void *) (uintptr_t) tfers[j].tx_buf, tfers[j].len);
+            offset += tfers[j].len;
+        }
+
+        if (len > 0)
+            sim_command(sim, tx, rx, len);
+
+        offset = 0;
+        for (unsigned int j = first; j <= i; j++) {
+            if (tfers[j].rx_buf)
+                memcpy((void *) (uintptr_t) tfers[j].rx_buf, &rx[offset], tfers[j].len);
+            offset += tfers[j].len;
+        }
+
+        free(tx);
+        free(rx);
+        total += len;
+        first = i + 1;
+    }
+    return total;
+}
@@ -0,0 +1,41 @@
+/*
+ *  Copyright 2015 Frank Hunleth
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * Simulated SPI NOR flash for running the SPI port without hardware
+ */
+
+#ifndef SPI_FLASH_SIM_H
+#define SPI_FLASH_SIM_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <linux/spi/spidev.h>
+
+struct flash_sim
+{
+    uint8_t *image;
+    size_t size;
+
+    int write_enabled;
+
+    // Number of status register reads left that report busy
+    int busy_polls;
+};
+
+int flash_sim_open(struct flash_sim *sim, const char *path);
+int flash_sim_message(struct flash_sim *sim, struct spi_ioc_transfer *tfers, unsigned int count);
+
+#endif
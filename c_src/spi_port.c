@@ -17,17 +17,23 @@
 
 #include <err.h>
 #include <fcntl.h>
+#include <poll.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/ioctl.h>
+#include <sys/timerfd.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <time.h>
 #include <unistd.h>
 
 #include <linux/spi/spidev.h>
 
 #include "erlcmd.h"
+#include "gpio_port.h"
+#include "script.h"
+#include "spi_flash_sim.h"
 
 //#define DEBUG
 #ifdef DEBUG
@@ -36,22 +42,172 @@
 #define debug(...)
 #endif
 
-// Max SPI transfer size that we support
-#define SPI_TRANSFER_MAX 256
+// Max SPI transfer size that we support. Transfers longer than
+// what spidev allows in one ioctl are split into chunks.
+#define SPI_TRANSFER_MAX (ERLCMD_MAX_MSG_SIZE - 64)
+
+// spidev's bufsiz module parameter and its default
+#define SPIDEV_BUFSIZ_PATH "/sys/module/spidev/parameters/bufsiz"
+#define SPIDEV_DEFAULT_BUFSIZ 4096
+
+// Max number of segments in one SPI message
+#define SPI_SEGMENTS_MAX 256
+
+// The clock polarity and phase bits (SPI_CPOL | SPI_CPHA) of the mode
+#define SPI_CLOCK_MODE_MASK 0x03
+
+// Max number of GPIOs that a handle can own for chip selects, D/C lines, etc.
+#define SPI_GPIO_MAX 8
+
+// A GPIO write that happens before segment number "before" in a message
+struct spi_gpio_write
+{
+    unsigned int before;
+    unsigned int gpio;
+    int value;
+};
+
+struct spi_stream
+{
+    int active;
+
+    // timerfd for paced sampling or -1 to sample back to back
+    int timer_fd;
+
+    char *tx;
+    size_t sample_len;
+    unsigned int chunk_size;
+
+    // Samples for the current chunk and when the first one was taken
+    char *samples;
+    unsigned int sample_count;
+    uint64_t chunk_timestamp;
+
+    // Timer expirations that didn't get a sample
+    unsigned long overruns;
+};
+
+// A transfer that runs each time a GPIO like a data ready line has an edge
+struct spi_trigger
+{
+    int active;
+    struct gpio pin;
+
+    char *tx;
+    size_t len;
+};
 
 struct spi_info
 {
     int fd;
 
     struct spi_ioc_transfer transfer;
+
+    // Mode from the start arguments and what the device is set to now
+    uint32_t mode;
+    uint32_t current_mode;
+
+    // Max bytes that spidev accepts per ioctl
+    size_t bufsiz;
+
+    // Response buffer, grown as needed for large transfers
+    char *resp;
+    size_t resp_size;
+
+    struct spi_stream stream;
+    struct spi_trigger trigger;
+
+    // GPIOs that transfer_segments can drive between segments
+    struct gpio gpios[SPI_GPIO_MAX];
+    unsigned int gpio_count;
+
+    struct script_engine scripts;
+
+    // Set when the device path is a regular file to simulate a flash chip
+    int simulated;
+    struct flash_sim sim;
 };
 
+/**
+ * @brief        Read spidev's max transfer size
+ *
+ * @return       the bufsiz parameter or the spidev default if unknown
+ */
+static size_t spidev_bufsiz(void)
+{
+    char buffer[32];
+    size_t bufsiz = SPIDEV_DEFAULT_BUFSIZ;
+
+    int fd = open(SPIDEV_BUFSIZ_PATH, O_RDONLY);
+    if (fd < 0)
+        return bufsiz;
+
+    ssize_t amount_read = read(fd, buffer, sizeof(buffer) - 1);
+    if (amount_read > 0) {
+        buffer[amount_read] = '\0';
+        unsigned long value = strtoul(buffer, NULL, 0);
+        if (value > 0)
+            bufsiz = value;
+    }
+    close(fd);
+    return bufsiz;
+}
+
+/**
+ * @brief        Get a response buffer that can hold len bytes
+ *
+ * The contents of the previous buffer are preserved.
+ */
+static char *spi_resp_buffer(struct spi_info *spi, size_t len)
+{
+    if (len > spi->resp_size) {
+        char *resp = realloc(spi->resp, len);
+        if (!resp)
+            err(EXIT_FAILURE, "realloc");
+
+        spi->resp = resp;
+        spi->resp_size = len;
+    }
+    return spi->resp;
+}
+
+/**
+ * @brief	Switch the device's SPI mode if needed
+ *
+ * @return 	1 for success, 0 for failure
+ */
+static int spi_set_mode(struct spi_info *spi, uint32_t mode)
+{
+    if (mode == spi->current_mode)
+        return 1;
+
+    if (spi->simulated) {
+        spi->current_mode = mode;
+        return 1;
+    }
+
+    if (mode <= 0xff) {
+        // Use the 8-bit ioctl when possible to support older kernels
+        uint8_t mode8 = mode;
+        if (ioctl(spi->fd, SPI_IOC_WR_MODE, &mode8) < 0) {
+            warn("ioctl(SPI_IOC_WR_MODE 0x%02x)", mode8);
+            return 0;
+        }
+    } else if (ioctl(spi->fd, SPI_IOC_WR_MODE32, &mode) < 0) {
+        warn("ioctl(SPI_IOC_WR_MODE32 0x%08x)", mode);
+        return 0;
+    }
+
+    spi->current_mode = mode;
+    return 1;
+}
+
 /**
  * @brief        Initialize a SPI device
  *
  * @param        spi     Handle to initialize
  * @param        devpath Path to SPI device file
- * @param        mode    SPI mode
+ * @param        mode    SPI mode and SPI_* mode flags
  * @param        bits_per_word    Number of bits
  * @param        speed_hz   Bus speed
  * @param        delay_usecs   Delay between transfers
@@ -60,16 +216,30 @@ struct spi_info
  */
 static void spi_init(struct spi_info *spi,
                      const char *devpath,
-                     uint8_t mode,
+                     uint32_t mode,
                      uint8_t bits_per_word,
                      uint32_t speed_hz,
                      uint16_t delay_usecs)
 {
     memset(spi, 0, sizeof(*spi));
+    spi->stream.timer_fd = -1;
 
     spi->transfer.speed_hz = speed_hz;
     spi->transfer.delay_usecs = delay_usecs;
     spi->transfer.bits_per_word = bits_per_word;
+    spi->bufsiz = spidev_bufsiz();
+
+    // A regular file is an image for the simulated flash chip. This makes
+    // it possible to try out the flash commands without hardware.
+    struct stat st;
+    if (stat(devpath, &st) == 0 && S_ISREG(st.st_mode)) {
+        if (!flash_sim_open(&spi->sim, devpath))
+            err(EXIT_FAILURE, "flash_sim_open %s", devpath);
+        spi->simulated = 1;
+        spi->fd = -1;
+        spi->mode = spi->current_mode = mode;
+        return;
+    }
 
     // Fail hard on error. May need to be nicer if this makes the
     // Erlang side too hard to debug.
@@ -77,8 +247,11 @@ static void spi_init(struct spi_info *spi,
     if (spi->fd < 0)
         err(EXIT_FAILURE, "open %s", devpath);
 
-    if (ioctl(spi->fd, SPI_IOC_WR_MODE, &mode) < 0)
-        err(EXIT_FAILURE, "ioctl(SPI_IOC_WR_MODE %d)", mode);
+    // Force the mode to be written
+    spi->current_mode = ~mode;
+    if (!spi_set_mode(spi, mode))
+        errx(EXIT_FAILURE, "Couldn't set SPI mode 0x%x", mode);
+    spi->mode = mode;
 
     // Set these to check for bad values given by the user. They get
     // set again on each transfer.
@@ -89,36 +262,762 @@ static void spi_init(struct spi_info *spi,
         err(EXIT_FAILURE, "ioctl(SPI_IOC_WR_MAX_SPEED_HZ %d)", speed_hz);
 }
 
+/**
+ * @brief	Send one SPI_IOC_MESSAGE to the device or the simulator
+ *
+ * @return 	1 for success, 0 for failure
+ */
+static int spi_message(struct spi_info *spi, struct spi_ioc_transfer *tfers, unsigned int count)
+{
+    if (spi->simulated) {
+        flash_sim_message(&spi->sim, tfers, count);
+        return 1;
+    }
+
+    if (ioctl(spi->fd, SPI_IOC_MESSAGE(count), tfers) < 0) {
+        warn("ioctl(SPI_IOC_MESSAGE(%d))", count);
+        return 0;
+    }
+    return 1;
+}
+
 /**
  * @brief	spi transfer operation
  *
- * @param	tx      Data to write into the device
- * @param	rx      Data to read from the device
+ * Transfers longer than spidev's bufsiz are split into multiple
+ * ioctls. Chip select is released between them.
+ *
+ * @param	settings Speed, word size and delay to use
+ * @param	mode    SPI mode and flags to use
+ * @param	tx      Data to write into the device or NULL to only read
+ * @param	rx      Data to read from the device or NULL to only write
  * @param	len     Length of data
  *
  * @return 	1 for success, 0 for failure
  */
-static int spi_transfer(struct spi_info *spi, const char *tx, char *rx, unsigned int len)
+static int spi_transfer(struct spi_info *spi,
+                        const struct spi_ioc_transfer *settings,
+                        uint32_t mode,
+                        const char *tx, char *rx, unsigned int len)
+{
+    struct spi_ioc_transfer tfer = *settings;
+
+    if (!spi_set_mode(spi, mode))
+        return 0;
+
+    for (unsigned int offset = 0; offset < len; offset += tfer.len) {
+        tfer.tx_buf = tx ? (__u64) (tx + offset) : 0;
+        tfer.rx_buf = rx ? (__u64) (rx + offset) : 0;
+        tfer.len = len - offset;
+        if (tfer.len > spi->bufsiz)
+            tfer.len = spi->bufsiz;
+
+        if (!spi_message(spi, &tfer, 1))
+            return 0;
+    }
+
+    return 1;
+}
+
+/**
+ * @brief	Write and then read with chip select held for programs
+ *
+ * @return 	1 for success, 0 for failure
+ */
+static int spi_script_xfer(void *cookie,
+                           const uint8_t *tx, size_t tx_len,
+                           uint8_t *rx, size_t rx_len)
+{
+    struct spi_info *spi = (struct spi_info *) cookie;
+    struct spi_ioc_transfer tfers[2];
+    unsigned int count = 0;
+
+    if (tx_len > 0) {
+        tfers[count] = spi->transfer;
+        tfers[count].tx_buf = (__u64) tx;
+        tfers[count].len = tx_len;
+        count++;
+    }
+    if (rx_len > 0) {
+        tfers[count] = spi->transfer;
+        tfers[count].rx_buf = (__u64) rx;
+        tfers[count].len = rx_len;
+        count++;
+    }
+
+    return spi_set_mode(spi, spi->mode) &&
+            spi_message(spi, tfers, count);
+}
+
+/**
+ * @brief	Decode the optional per-transfer settings
+ *
+ * Requests are either just the data (or length) or {data, overrides}
+ * where overrides are {speed_hz, bits_per_word, delay_usecs, mode,
+ * tx_nbits, rx_nbits}. A negative override keeps the handle's setting.
+ * The mode override only changes the clock polarity and phase. This decodes the tuple
+ * header, if any, so that the caller can decode the data next and then
+ * call spi_decode_overrides().
+ *
+ * @return 	1 if overrides follow the data, 0 if not
+ */
+static int spi_decode_override_header(const char *req, int *req_index)
+{
+    int type;
+    int size;
+    int arity;
+    if (ei_get_type(req, req_index, &type, &size) < 0 ||
+            type != ERL_SMALL_TUPLE_EXT)
+        return 0;
+
+    if (ei_decode_tuple_header(req, req_index, &arity) < 0 ||
+            arity != 2)
+        errx(EXIT_FAILURE, "expecting {data, overrides}");
+    return 1;
+}
+
+static void spi_decode_overrides(const char *req, int *req_index,
+                                 struct spi_ioc_transfer *settings,
+                                 uint32_t *mode)
+{
+    int arity;
+    long speed_hz;
+    long bits_per_word;
+    long delay_usecs;
+    long new_mode;
+    long tx_nbits;
+    long rx_nbits;
+
+    if (ei_decode_tuple_header(req, req_index, &arity) < 0 ||
+            arity != 6 ||
+            ei_decode_long(req, req_index, &speed_hz) < 0 ||
+            ei_decode_long(req, req_index, &bits_per_word) < 0 ||
+            ei_decode_long(req, req_index, &delay_usecs) < 0 ||
+            ei_decode_long(req, req_index, &new_mode) < 0 ||
+            ei_decode_long(req, req_index, &tx_nbits) < 0 ||
+            ei_decode_long(req, req_index, &rx_nbits) < 0)
+        errx(EXIT_FAILURE, "expecting {speed_hz, bits_per_word, delay_usecs, mode, tx_nbits, rx_nbits} overrides");
+
+    if (speed_hz >= 0)
+        settings->speed_hz = speed_hz;
+    if (bits_per_word >= 0)
+        settings->bits_per_word = bits_per_word;
+    if (delay_usecs >= 0)
+        settings->delay_usecs = delay_usecs;
+    if (new_mode >= 0)
+        *mode = (*mode & ~SPI_CLOCK_MODE_MASK) | (new_mode & SPI_CLOCK_MODE_MASK);
+    if (tx_nbits >= 0)
+        settings->tx_nbits = tx_nbits;
+    if (rx_nbits >= 0)
+        settings->rx_nbits = rx_nbits;
+}
+
+/**
+ * @brief	Decode one segment of a multi-segment transfer
+ *
+ * Segments are {tx_data, rx_len, cs_change, delay_usecs, speed_hz,
+ * bits_per_word, tx_nbits, rx_nbits}. If both tx_data and rx_len are
+ * given, they must be the same length. A negative delay, speed, word
+ * size or bus width means to use the handle's setting.
+ * The tx buffer points into the request. The caller sets up the rx
+ * buffer.
+ *
+ * @return 	the number of bytes that the segment reads
+ */
+static long spi_decode_segment(const struct spi_info *spi,
+                               const char *req, int *req_index,
+                               struct spi_ioc_transfer *tfer)
+{
+    int arity;
+    const char *tx;
+    int tx_len;
+    long rx_len;
+    long cs_change;
+    long delay_usecs;
+    long speed_hz;
+    long bits_per_word;
+    long tx_nbits;
+    long rx_nbits;
+
+    if (ei_decode_tuple_header(req, req_index, &arity) < 0 ||
+            arity != 8 ||
+            erlcmd_decode_binary_view(req, req_index, &tx, &tx_len) < 0 ||
+            tx_len > SPI_TRANSFER_MAX)
+        errx(EXIT_FAILURE, "segment: expecting {tx_data, rx_len, cs_change, delay_usecs, speed_hz, bits_per_word, tx_nbits, rx_nbits}");
+
+    *tfer = spi->transfer;
+    if (tx_len > 0)
+        tfer->tx_buf = (__u64) tx;
+
+    if (ei_decode_long(req, req_index, &rx_len) < 0 ||
+            ei_decode_long(req, req_index, &cs_change) < 0 ||
+            ei_decode_long(req, req_index, &delay_usecs) < 0 ||
+            ei_decode_long(req, req_index, &speed_hz) < 0 ||
+            ei_decode_long(req, req_index, &bits_per_word) < 0 ||
+            ei_decode_long(req, req_index, &tx_nbits) < 0 ||
+            ei_decode_long(req, req_index, &rx_nbits) < 0 ||
+            rx_len < 0 ||
+            rx_len > SPI_TRANSFER_MAX ||
+            (tx_len > 0 && rx_len > 0 && rx_len != tx_len) ||
+            (tx_len == 0 && rx_len == 0))
+        errx(EXIT_FAILURE, "segment: bad tx_data or rx_len");
+
+    tfer->len = tx_len > 0 ? tx_len : rx_len;
+    tfer->cs_change = cs_change ? 1 : 0;
+    if (delay_usecs >= 0)
+        tfer->delay_usecs = delay_usecs;
+    if (speed_hz >= 0)
+        tfer->speed_hz = speed_hz;
+    if (bits_per_word >= 0)
+        tfer->bits_per_word = bits_per_word;
+    if (tx_nbits >= 0)
+        tfer->tx_nbits = tx_nbits;
+    if (rx_nbits >= 0)
+        tfer->rx_nbits = rx_nbits;
+
+    return rx_len;
+}
+
+/**
+ * @brief	Decode a GPIO write in a list of segments
+ *
+ * GPIO writes are {gpio_index, value} where gpio_index is the position
+ * of the GPIO in the list passed to init_gpios.
+ */
+static void spi_decode_gpio_write(const struct spi_info *spi,
+                                  const char *req, int *req_index,
+                                  struct spi_gpio_write *w)
+{
+    int arity;
+    unsigned long gpio;
+    long value;
+    if (ei_decode_tuple_header(req, req_index, &arity) < 0 ||
+            arity != 2 ||
+            ei_decode_ulong(req, req_index, &gpio) < 0 ||
+            ei_decode_long(req, req_index, &value) < 0 ||
+            gpio >= spi->gpio_count)
+        errx(EXIT_FAILURE, "segment: expecting {gpio_index, value} with a gpio_index less than %d", spi->gpio_count);
+
+    w->gpio = gpio;
+    w->value = value;
+}
+
+/**
+ * @brief	Run several segments as one SPI message
+ *
+ * Chip select stays asserted between segments unless a segment sets
+ * cs_change. The whole message must fit in spidev's bufsiz.
+ *
+ * If there are GPIO writes, the segments between them are sent as
+ * separate messages so that the GPIOs change at the right time. This
+ * is for devices that use a GPIO for chip select or data/command.
+ *
+ * @return 	1 for success, 0 for failure
+ */
+static int spi_transfer_segments(struct spi_info *spi,
+                                 struct spi_ioc_transfer *tfers, unsigned int count,
+                                 const struct spi_gpio_write *gpio_writes, unsigned int gpio_write_count)
+{
+    if (!spi_set_mode(spi, spi->mode))
+        return 0;
+
+    unsigned int done = 0;
+    for (unsigned int i = 0; i < gpio_write_count; i++) {
+        const struct spi_gpio_write *w = &gpio_writes[i];
+        if (w->before > done) {
+            if (!spi_message(spi, &tfers[done], w->before - done))
+                return 0;
+            done = w->before;
+        }
+        gpio_write(&spi->gpios[w->gpio], w->value);
+    }
+
+    return done == count || spi_message(spi, &tfers[done], count - done);
+}
+
+static uint64_t monotonic_ns(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t) now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+/**
+ * @brief	Send the samples collected so far to Erlang
+ */
+static void spi_stream_report(struct spi_stream *stream)
+{
+    if (stream->sample_count == 0)
+        return;
+
+    size_t len = stream->sample_count * stream->sample_len;
+    char *resp = malloc(len + 64);
+    if (!resp)
+        err(EXIT_FAILURE, "malloc");
+
+    int resp_index = sizeof(uint32_t) + 1; // Space for payload size and type
+    resp[4] = 1; // Notification
+    ei_encode_version(resp, &resp_index);
+    ei_encode_tuple_header(resp, &resp_index, 4);
+    ei_encode_atom(resp, &resp_index, "spi_samples");
+    ei_encode_longlong(resp, &resp_index, stream->chunk_timestamp);
+    ei_encode_ulong(resp, &resp_index, stream->overruns);
+    ei_encode_binary(resp, &resp_index, stream->samples, len);
+    erlcmd_send(resp, resp_index);
+    free(resp);
+
+    stream->sample_count = 0;
+}
+
+/**
+ * @brief	Stop streaming and report any samples that haven't been sent
+ */
+static void spi_stream_stop(struct spi_stream *stream)
+{
+    if (!stream->active)
+        return;
+
+    spi_stream_report(stream);
+
+    if (stream->timer_fd >= 0)
+        close(stream->timer_fd);
+    free(stream->tx);
+    free(stream->samples);
+
+    memset(stream, 0, sizeof(*stream));
+    stream->timer_fd = -1;
+}
+
+/**
+ * @brief	Start sampling
+ *
+ * @param	tx              What to send for each sample (ownership is taken)
+ * @param	sample_len      Length of tx and of each sample
+ * @param	rate_hz         Samples per second or 0 to sample as fast as possible
+ * @param	chunk_size      Number of samples to send to Erlang at a time
+ *
+ * @return 	1 for success, 0 for failure
+ */
+static int spi_stream_start(struct spi_info *spi,
+                            char *tx, size_t sample_len,
+                            unsigned long rate_hz,
+                            unsigned int chunk_size)
+{
+    struct spi_stream *stream = &spi->stream;
+
+    spi_stream_stop(stream);
+
+    if (rate_hz > 0) {
+        stream->timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+        if (stream->timer_fd < 0) {
+            warn("timerfd_create");
+            free(tx);
+            return 0;
+        }
+
+        uint64_t period_ns = 1000000000ULL / rate_hz;
+        struct itimerspec period;
+        period.it_interval.tv_sec = period_ns / 1000000000ULL;
+        period.it_interval.tv_nsec = period_ns % 1000000000ULL;
+        period.it_value = period.it_interval;
+        if (timerfd_settime(stream->timer_fd, 0, &period, NULL) < 0) {
+            warn("timerfd_settime");
+            close(stream->timer_fd);
+            stream->timer_fd = -1;
+            free(tx);
+            return 0;
+        }
+    }
+
+    stream->samples = malloc(sample_len * chunk_size);
+    if (!stream->samples)
+        err(EXIT_FAILURE, "malloc");
+
+    stream->tx = tx;
+    stream->sample_len = sample_len;
+    stream->chunk_size = chunk_size;
+    stream->active = 1;
+    return 1;
+}
+
+/**
+ * @brief	Take one sample and send the chunk if it's full
+ */
+static void spi_stream_sample(struct spi_info *spi)
+{
+    struct spi_stream *stream = &spi->stream;
+
+    if (stream->timer_fd >= 0) {
+        uint64_t expirations;
+        if (read(stream->timer_fd, &expirations, sizeof(expirations)) != sizeof(expirations))
+            return;
+
+        stream->overruns += expirations - 1;
+    }
+
+    if (stream->sample_count == 0)
+        stream->chunk_timestamp = monotonic_ns();
+
+    char *rx = &stream->samples[stream->sample_count * stream->sample_len];
+    if (!spi_transfer(spi, &spi->transfer, spi->mode, stream->tx, rx, stream->sample_len)) {
+        // Count a failed transfer as a lost sample and keep going.
+        stream->overruns++;
+        return;
+    }
+
+    stream->sample_count++;
+    if (stream->sample_count == stream->chunk_size)
+        spi_stream_report(stream);
+}
+
+// SPI NOR flash commands that are the same on nearly every part
+#define FLASH_CMD_WRITE_ENABLE  0x06
+#define FLASH_CMD_READ_STATUS   0x05
+#define FLASH_CMD_READ_JEDEC_ID 0x9f
+#define FLASH_CMD_READ_SFDP     0x5a
+#define FLASH_CMD_CHIP_ERASE    0xc7
+
+#define FLASH_STATUS_WIP        0x01
+
+#define FLASH_PAGE_SIZE         256
+#define FLASH_SECTOR_SIZE       4096
+#define FLASH_BLOCK_SIZE        65536
+
+// Worst case times from common datasheets with some margin
+#define FLASH_PROGRAM_TIMEOUT_MS    50
+#define FLASH_ERASE_TIMEOUT_MS      5000
+#define FLASH_CHIP_ERASE_TIMEOUT_MS 400000
+
+/**
+ * @brief	Run one flash command with chip select held the whole time
+ *
+ * @param	header     Opcode, address and dummy bytes
+ * @param	tx         Data to send after the header or NULL
+ * @param	rx         Where to read data after the header or NULL
+ * @param	len        Length of the data phase
+ * @param	nbits      Number of data lines for the data phase
+ *
+ * @return 	1 for success, 0 for failure
+ */
+static int flash_command(struct spi_info *spi,
+                         const uint8_t *header, size_t header_len,
+                         const uint8_t *tx, uint8_t *rx, size_t len,
+                         uint8_t nbits)
+{
+    struct spi_ioc_transfer tfers[2];
+
+    tfers[0] = spi->transfer;
+    tfers[0].tx_buf = (__u64) header;
+    tfers[0].len = header_len;
+    tfers[0].delay_usecs = 0;
+
+    tfers[1] = spi->transfer;
+    tfers[1].tx_buf = (__u64) tx;
+    tfers[1].rx_buf = (__u64) rx;
+    tfers[1].len = len;
+    tfers[1].tx_nbits = tx ? nbits : 0;
+    tfers[1].rx_nbits = rx ? nbits : 0;
+
+    if (!spi_set_mode(spi, spi->mode))
+        return 0;
+
+    return spi_message(spi, tfers, len > 0 ? 2 : 1);
+}
+
+/**
+ * @brief	Poll the status register until the WIP bit clears
+ *
+ * @return 	1 when ready, 0 on timeout or failure
+ */
+static int flash_wait_ready(struct spi_info *spi, unsigned long timeout_ms)
+{
+    static const uint8_t cmd = FLASH_CMD_READ_STATUS;
+    uint64_t deadline = monotonic_ns() + timeout_ms * 1000000ULL;
+
+    // Sleep between polls for long operations so as not to hog the bus
+    struct timespec poll_interval = { 0, timeout_ms > FLASH_PROGRAM_TIMEOUT_MS ? 1000000 : 20000 };
+
+    for (;;) {
+        uint8_t status;
+        if (!flash_command(spi, &cmd, 1, NULL, &status, 1, 1))
+            return 0;
+
+        if (!(status & FLASH_STATUS_WIP))
+            return 1;
+
+        if (monotonic_ns() > deadline) {
+            warnx("flash busy after %lu ms", timeout_ms);
+            return 0;
+        }
+        nanosleep(&poll_interval, NULL);
+    }
+}
+
+static int flash_write_enable(struct spi_info *spi)
+{
+    static const uint8_t cmd = FLASH_CMD_WRITE_ENABLE;
+    return flash_command(spi, &cmd, 1, NULL, NULL, 0, 1);
+}
+
+static size_t flash_header(uint8_t *header, uint8_t opcode, uint32_t addr, unsigned int addr_width, unsigned int dummy)
+{
+    size_t len = 0;
+    header[len++] = opcode;
+    for (unsigned int i = 0; i < addr_width; i++)
+        header[len++] = addr >> (8 * (addr_width - i - 1));
+    for (unsigned int i = 0; i < dummy; i++)
+        header[len++] = 0;
+    return len;
+}
+
+/**
+ * @brief	Identify a flash chip
+ *
+ * The size comes from the SFDP basic flash parameter table when the
+ * chip has one. Otherwise it's guessed from the JEDEC capacity byte
+ * which is log2 of the size on most parts.
+ *
+ * @param	jedec_id  The 3 ID bytes
+ * @param	size      The size in bytes or 0 if unknown
+ *
+ * @return 	1 for success, 0 for failure
+ */
+static int flash_identify(struct spi_info *spi, uint8_t *jedec_id, uint64_t *size)
+{
+    static const uint8_t id_cmd = FLASH_CMD_READ_JEDEC_ID;
+    if (!flash_command(spi, &id_cmd, 1, NULL, jedec_id, 3, 1))
+        return 0;
+
+    *size = 0;
+    if (jedec_id[2] >= 0x10 && jedec_id[2] <= 0x22)
+        *size = 1ULL << jedec_id[2];
+
+    uint8_t header[5];
+    uint8_t sfdp[16];
+    flash_header(header, FLASH_CMD_READ_SFDP, 0, 3, 1);
+    if (!flash_command(spi, header, sizeof(header), NULL, sfdp, sizeof(sfdp), 1))
+        return 0;
+
+    // The first parameter header is always the basic flash parameter table
+    if (memcmp(sfdp, "SFDP", 4) != 0 || sfdp[11] < 2)
+        return 1;
+
+    uint32_t bfpt = sfdp[12] | (sfdp[13] << 8) | (sfdp[14] << 16);
+    uint8_t density_bytes[4];
+    flash_header(header, FLASH_CMD_READ_SFDP, bfpt + 4, 3, 1);
+    if (!flash_command(spi, header, sizeof(header), NULL, density_bytes, sizeof(density_bytes), 1))
+        return 0;
+
+    uint32_t density = density_bytes[0] | (density_bytes[1] << 8) |
+            (density_bytes[2] << 16) | ((uint32_t) density_bytes[3] << 24);
+    if (density & 0x80000000)
+        *size = (1ULL << (density & 0x7fffffff)) / 8;
+    else
+        *size = ((uint64_t) density + 1) / 8;
+    return 1;
+}
+
+/**
+ * @brief	Fast read from flash using 1, 2 or 4 data lines
+ *
+ * Each chunk is one message with the command in the first segment so
+ * that reads are as large as spidev allows.
+ *
+ * @return 	1 for success, 0 for failure
+ */
+static int flash_read(struct spi_info *spi, uint32_t addr, unsigned int addr_width,
+                      unsigned int width, uint8_t *data, size_t len)
+{
+    uint8_t opcode;
+    switch (width) {
+    case 2:
+        opcode = addr_width == 4 ? 0x3c : 0x3b;
+        break;
+    case 4:
+        opcode = addr_width == 4 ? 0x6c : 0x6b;
+        break;
+    default:
+        opcode = addr_width == 4 ? 0x0c : 0x0b;
+        break;
+    }
+
+    uint8_t header[6];
+    size_t chunk_max = spi->bufsiz - sizeof(header);
+    for (size_t done = 0; done < len; ) {
+        size_t chunk = len - done;
+        if (chunk > chunk_max)
+            chunk = chunk_max;
+
+        size_t header_len = flash_header(header, opcode, addr + done, addr_width, 1);
+        if (!flash_command(spi, header, header_len, NULL, &data[done], chunk, width))
+            return 0;
+
+        done += chunk;
+    }
+    return 1;
+}
+
+/**
+ * @brief	Program flash a page at a time
+ *
+ * The area must have been erased first.
+ *
+ * @return 	1 for success, 0 for failure
+ */
+static int flash_program(struct spi_info *spi, uint32_t addr, unsigned int addr_width,
+                         const uint8_t *data, size_t len)
+{
+    uint8_t opcode = addr_width == 4 ? 0x12 : 0x02;
+    for (size_t done = 0; done < len; ) {
+        uint32_t page_addr = addr + done;
+        size_t chunk = FLASH_PAGE_SIZE - page_addr % FLASH_PAGE_SIZE;
+        if (chunk > len - done)
+            chunk = len - done;
+
+        uint8_t header[5];
+        size_t header_len = flash_header(header, opcode, page_addr, addr_width, 0);
+        if (!flash_write_enable(spi) ||
+                !flash_command(spi, header, header_len, &data[done], NULL, chunk, 1) ||
+                !flash_wait_ready(spi, FLASH_PROGRAM_TIMEOUT_MS))
+            return 0;
+
+        done += chunk;
+    }
+    return 1;
+}
+
+/**
+ * @brief	Erase flash using 64 KB blocks where possible and 4 KB sectors elsewhere
+ *
+ * The address and length must be multiples of the sector size.
+ *
+ * @return 	1 for success, 0 for failure
+ */
+static int flash_erase(struct spi_info *spi, uint32_t addr, unsigned int addr_width, size_t len)
+{
+    for (size_t done = 0; done < len; ) {
+        uint32_t erase_addr = addr + done;
+        size_t erase_size;
+        uint8_t opcode;
+        if (erase_addr % FLASH_BLOCK_SIZE == 0 && len - done >= FLASH_BLOCK_SIZE) {
+            erase_size = FLASH_BLOCK_SIZE;
+            opcode = addr_width == 4 ? 0xdc : 0xd8;
+        } else {
+            erase_size = FLASH_SECTOR_SIZE;
+            opcode = addr_width == 4 ? 0x21 : 0x20;
+        }
+
+        uint8_t header[5];
+        size_t header_len = flash_header(header, opcode, erase_addr, addr_width, 0);
+        if (!flash_write_enable(spi) ||
+                !flash_command(spi, header, header_len, NULL, NULL, 0, 1) ||
+                !flash_wait_ready(spi, FLASH_ERASE_TIMEOUT_MS))
+            return 0;
+
+        done += erase_size;
+    }
+    return 1;
+}
+
+static int flash_erase_chip(struct spi_info *spi)
+{
+    static const uint8_t cmd = FLASH_CMD_CHIP_ERASE;
+    return flash_write_enable(spi) &&
+            flash_command(spi, &cmd, 1, NULL, NULL, 0, 1) &&
+            flash_wait_ready(spi, FLASH_CHIP_ERASE_TIMEOUT_MS);
+}
+
+/**
+ * @brief	Stop running the trigger's transfer on GPIO edges
+ */
+static void spi_trigger_stop(struct spi_trigger *trigger)
+{
+    if (!trigger->active)
+        return;
+
+    gpio_set_int(&trigger->pin, "none");
+    close(trigger->pin.fd);
+    free(trigger->tx);
+    trigger->tx = NULL;
+    trigger->active = 0;
+}
+
+/**
+ * @brief	Run a transfer each time a GPIO has an edge
+ *
+ * @param	pin_number   The GPIO
+ * @param	edge         "rising", "falling" or "both"
+ * @param	tx           What to send (ownership is taken)
+ * @param	len          Length of tx and what's received
+ *
+ * @return 	1 for success, 0 for failure
+ */
+static int spi_trigger_start(struct spi_trigger *trigger,
+                             unsigned int pin_number,
+                             const char *edge,
+                             char *tx, size_t len)
 {
-    struct spi_ioc_transfer tfer = spi->transfer;
+    spi_trigger_stop(trigger);
+
+    if (gpio_init(&trigger->pin, pin_number, GPIO_INPUT) < 0) {
+        free(tx);
+        return 0;
+    }
 
-    tfer.tx_buf = (__u64) tx;
-    tfer.rx_buf = (__u64) rx;
-    tfer.len = len;
+    if (gpio_set_int(&trigger->pin, edge) < 0) {
+        close(trigger->pin.fd);
+        free(tx);
+        return 0;
+    }
 
-    if (ioctl(spi->fd, SPI_IOC_MESSAGE(1), &tfer) < 1)
-        err(EXIT_FAILURE, "ioctl(SPI_IOC_MESSAGE)");
+    // Clear the edge that Linux reports on registration
+    gpio_read(&trigger->pin);
 
+    trigger->tx = tx;
+    trigger->len = len;
+    trigger->active = 1;
     return 1;
 }
 
+/**
+ * @brief	Run the trigger's transfer and send the result to Erlang
+ *
+ * @param	timestamp    CLOCK_MONOTONIC time of the edge in nanoseconds
+ */
+static void spi_trigger_run(struct spi_info *spi, uint64_t timestamp)
+{
+    struct spi_trigger *trigger = &spi->trigger;
+
+    // Reading the value clears the edge
+    gpio_read(&trigger->pin);
+
+    char *resp = spi_resp_buffer(spi, trigger->len + 64);
+    int resp_index = sizeof(uint32_t) + 1; // Space for payload size and type
+    resp[4] = 1; // Notification
+    ei_encode_version(resp, &resp_index);
+    ei_encode_tuple_header(resp, &resp_index, 3);
+    ei_encode_atom(resp, &resp_index, "spi_trigger");
+    ei_encode_ulonglong(resp, &resp_index, timestamp);
+
+    char *rx = &resp[resp_index + ERLCMD_BINARY_HEADER_SIZE];
+    if (spi_transfer(spi, &spi->transfer, spi->mode, trigger->tx, rx, trigger->len)) {
+        erlcmd_encode_binary_header(resp, &resp_index, trigger->len);
+        resp_index += trigger->len;
+    } else {
+        ei_encode_tuple_header(resp, &resp_index, 2);
+        ei_encode_atom(resp, &resp_index, "error");
+        ei_encode_atom(resp, &resp_index, "spi_transfer_failed");
+    }
+    erlcmd_send(resp, resp_index);
+}
+
 static void spi_handle_request(const char *req, void *cookie)
 {
     struct spi_info *spi = (struct spi_info *) cookie;
 
     // Commands are of the form {Command, Arguments}:
     // { atom(), term() }
-    int req_index = sizeof(uint16_t);
+    int req_index = sizeof(uint32_t);
     if (ei_decode_version(req, &req_index, NULL) < 0)
         errx(EXIT_FAILURE, "Message version issue?");
 
@@ -131,33 +1030,328 @@ static void spi_handle_request(const char *req, void *cookie)
     if (ei_decode_atom(req, &req_index, cmd) < 0)
         errx(EXIT_FAILURE, "expecting command atom");
 
-    char resp[SPI_TRANSFER_MAX + 64];
-    int resp_index = sizeof(uint16_t); // Space for payload size
+    char *resp = spi_resp_buffer(spi, 64);
+    int resp_index = sizeof(uint32_t) + 1; // Space for payload size and type
+    resp[4] = 0; // Reply
     ei_encode_version(resp, &resp_index);
     if (strcmp(cmd, "transfer") == 0) {
-        char data[SPI_TRANSFER_MAX];
+        struct spi_ioc_transfer settings = spi->transfer;
+        uint32_t mode = spi->mode;
+        int has_overrides = spi_decode_override_header(req, &req_index);
+        const char *data;
+        int len;
+        if (erlcmd_decode_binary_view(req, &req_index, &data, &len) < 0 ||
+                len < 1 ||
+                len > SPI_TRANSFER_MAX)
+            errx(EXIT_FAILURE, "transfer: need a binary between 1 and %d bytes", SPI_TRANSFER_MAX);
+
+        if (has_overrides)
+            spi_decode_overrides(req, &req_index, &settings, &mode);
+
+        // Receive straight into the response
+        resp = spi_resp_buffer(spi, len + 64);
+        char *rx = &resp[resp_index + ERLCMD_BINARY_HEADER_SIZE];
+        if (spi_transfer(spi, &settings, mode, data, rx, len)) {
+            erlcmd_encode_binary_header(resp, &resp_index, len);
+            resp_index += len;
+        } else {
+            ei_encode_tuple_header(resp, &resp_index, 2);
+            ei_encode_atom(resp, &resp_index, "error");
+            ei_encode_atom(resp, &resp_index, "spi_transfer_failed");
+        }
+    } else if (strcmp(cmd, "write") == 0) {
+        struct spi_ioc_transfer settings = spi->transfer;
+        uint32_t mode = spi->mode;
+        int has_overrides = spi_decode_override_header(req, &req_index);
+        const char *data;
+        int len;
+        if (erlcmd_decode_binary_view(req, &req_index, &data, &len) < 0 ||
+                len < 1 ||
+                len > SPI_TRANSFER_MAX)
+            errx(EXIT_FAILURE, "write: need a binary between 1 and %d bytes", SPI_TRANSFER_MAX);
+
+        if (has_overrides)
+            spi_decode_overrides(req, &req_index, &settings, &mode);
+
+        if (spi_transfer(spi, &settings, mode, data, NULL, len))
+            ei_encode_atom(resp, &resp_index, "ok");
+        else {
+            ei_encode_tuple_header(resp, &resp_index, 2);
+            ei_encode_atom(resp, &resp_index, "error");
+            ei_encode_atom(resp, &resp_index, "spi_write_failed");
+        }
+    } else if (strcmp(cmd, "read") == 0) {
+        struct spi_ioc_transfer settings = spi->transfer;
+        uint32_t mode = spi->mode;
+        int has_overrides = spi_decode_override_header(req, &req_index);
+        long len;
+        if (ei_decode_long(req, &req_index, &len) < 0 ||
+                len < 1 ||
+                len > SPI_TRANSFER_MAX)
+            errx(EXIT_FAILURE, "read: amount: min=1, max=%d", SPI_TRANSFER_MAX);
+
+        if (has_overrides)
+            spi_decode_overrides(req, &req_index, &settings, &mode);
+
+        resp = spi_resp_buffer(spi, len + 64);
+        char *rx = &resp[resp_index + ERLCMD_BINARY_HEADER_SIZE];
+        if (spi_transfer(spi, &settings, mode, NULL, rx, len)) {
+            erlcmd_encode_binary_header(resp, &resp_index, len);
+            resp_index += len;
+        } else {
+            ei_encode_tuple_header(resp, &resp_index, 2);
+            ei_encode_atom(resp, &resp_index, "error");
+            ei_encode_atom(resp, &resp_index, "spi_read_failed");
+        }
+    } else if (strcmp(cmd, "transfer_segments") == 0) {
+        int count;
+        if (ei_decode_list_header(req, &req_index, &count) < 0 ||
+                count < 1 ||
+                count > SPI_SEGMENTS_MAX)
+            errx(EXIT_FAILURE, "transfer_segments: need between 1 and %d segments", SPI_SEGMENTS_MAX);
+
+        struct spi_ioc_transfer tfers[SPI_SEGMENTS_MAX];
+        int reads[SPI_SEGMENTS_MAX];
+        struct spi_gpio_write gpio_writes[SPI_SEGMENTS_MAX];
+        unsigned int gpio_write_count = 0;
+        size_t rx_total = 0;
+        int rx_count = 0;
+        for (int i = 0; i < count; i++) {
+            int type;
+            int size;
+            if (ei_get_type(req, &req_index, &type, &size) < 0 ||
+                    type != ERL_SMALL_TUPLE_EXT)
+                errx(EXIT_FAILURE, "transfer_segments: expecting segment tuples");
+
+            // Segments are 8-tuples and GPIO writes are 2-tuples
+            if (size == 2) {
+                struct spi_gpio_write *w = &gpio_writes[gpio_write_count++];
+                spi_decode_gpio_write(spi, req, &req_index, w);
+                w->before = i - gpio_write_count + 1;
+                continue;
+            }
+
+            int segment = i - gpio_write_count;
+            reads[segment] = spi_decode_segment(spi, req, &req_index, &tfers[segment]) > 0;
+            if (reads[segment]) {
+                rx_total += tfers[segment].len;
+                rx_count++;
+            }
+        }
+        count -= gpio_write_count;
+
+        // Everything that's read has to fit in one reply
+        if (rx_total + ERLCMD_BINARY_HEADER_SIZE * rx_count > SPI_TRANSFER_MAX) {
+            ei_encode_tuple_header(resp, &resp_index, 2);
+            ei_encode_atom(resp, &resp_index, "error");
+            ei_encode_atom(resp, &resp_index, "spi_reply_too_long");
+        } else {
+            // Lay out the list of received binaries in the response and
+            // have each segment receive into its place.
+            resp = spi_resp_buffer(spi, rx_total + ERLCMD_BINARY_HEADER_SIZE * rx_count + 64);
+            int reply_index = resp_index;
+            if (rx_count > 0) {
+                ei_encode_list_header(resp, &reply_index, rx_count);
+                for (int i = 0; i < count; i++) {
+                    if (reads[i]) {
+                        erlcmd_encode_binary_header(resp, &reply_index, tfers[i].len);
+                        tfers[i].rx_buf = (__u64) &resp[reply_index];
+                        reply_index += tfers[i].len;
+                    }
+                }
+            }
+            ei_encode_empty_list(resp, &reply_index);
+
+            if (spi_transfer_segments(spi, tfers, count, gpio_writes, gpio_write_count))
+                resp_index = reply_index;
+            else {
+                ei_encode_tuple_header(resp, &resp_index, 2);
+                ei_encode_atom(resp, &resp_index, "error");
+                ei_encode_atom(resp, &resp_index, "spi_transfer_failed");
+            }
+        }
+    } else if (strcmp(cmd, "script_load") == 0) {
+        script_load_request(&spi->scripts, req, &req_index, resp, &resp_index);
+    } else if (strcmp(cmd, "script_run") == 0) {
+        resp = spi_resp_buffer(spi, SCRIPT_RESULT_MAX + 64);
+        script_run_request(&spi->scripts, req, &req_index, resp, &resp_index);
+    } else if (strcmp(cmd, "script_delete") == 0) {
+        script_delete_request(&spi->scripts, req, &req_index, resp, &resp_index);
+    } else if (strcmp(cmd, "init_gpios") == 0) {
+        // Claim GPIOs for transfer_segments and programs to use
+        if (gpio_init_list(spi->gpios, &spi->gpio_count, SPI_GPIO_MAX, req, &req_index))
+            ei_encode_atom(resp, &resp_index, "ok");
+        else {
+            ei_encode_tuple_header(resp, &resp_index, 2);
+            ei_encode_atom(resp, &resp_index, "error");
+            ei_encode_atom(resp, &resp_index, "spi_gpio_init_failed");
+        }
+    } else if (strcmp(cmd, "start_stream") == 0) {
+        unsigned long rate_hz;
+        unsigned long chunk_size;
         int len;
         int type;
         long llen;
-        if (ei_get_type(req, &req_index, &type, &len) < 0 ||
+        if (ei_decode_tuple_header(req, &req_index, &arity) < 0 ||
+                arity != 3 ||
+                ei_get_type(req, &req_index, &type, &len) < 0 ||
                 type != ERL_BINARY_EXT ||
                 len < 1 ||
+                (size_t) len > spi->bufsiz)
+            errx(EXIT_FAILURE, "start_stream: need a tx template between 1 and %d bytes", (int) spi->bufsiz);
+
+        char *tx = malloc(len);
+        if (!tx)
+            err(EXIT_FAILURE, "malloc");
+
+        if (ei_decode_binary(req, &req_index, tx, &llen) < 0 ||
+                ei_decode_ulong(req, &req_index, &rate_hz) < 0 ||
+                ei_decode_ulong(req, &req_index, &chunk_size) < 0 ||
+                rate_hz > 1000000 ||
+                chunk_size < 1 ||
+                len * chunk_size > SPI_TRANSFER_MAX)
+            errx(EXIT_FAILURE, "start_stream: expecting {tx, rate_hz (0-1000000), chunk_size}");
+
+        if (spi_stream_start(spi, tx, len, rate_hz, chunk_size))
+            ei_encode_atom(resp, &resp_index, "ok");
+        else {
+            ei_encode_tuple_header(resp, &resp_index, 2);
+            ei_encode_atom(resp, &resp_index, "error");
+            ei_encode_atom(resp, &resp_index, "spi_stream_failed");
+        }
+    } else if (strcmp(cmd, "start_trigger") == 0) {
+        unsigned long pin_number;
+        char edge[MAXATOMLEN];
+        int len;
+        int type;
+        long llen;
+        if (ei_decode_tuple_header(req, &req_index, &arity) < 0 ||
+                arity != 3 ||
+                ei_decode_ulong(req, &req_index, &pin_number) < 0 ||
+                ei_decode_atom(req, &req_index, edge) < 0 ||
+                (strcmp(edge, "rising") != 0 && strcmp(edge, "falling") != 0 && strcmp(edge, "both") != 0) ||
+                ei_get_type(req, &req_index, &type, &len) < 0 ||
+                type != ERL_BINARY_EXT ||
+                len < 1 ||
+                (size_t) len > spi->bufsiz)
+            errx(EXIT_FAILURE, "start_trigger: expecting {pin, rising | falling | both, tx} with tx between 1 and %d bytes", (int) spi->bufsiz);
+
+        // The trigger keeps tx, so copy it out of the request
+        char *tx = malloc(len);
+        if (!tx)
+            err(EXIT_FAILURE, "malloc");
+        if (ei_decode_binary(req, &req_index, tx, &llen) < 0)
+            errx(EXIT_FAILURE, "start_trigger: bad tx");
+
+        if (spi_trigger_start(&spi->trigger, pin_number, edge, tx, len))
+            ei_encode_atom(resp, &resp_index, "ok");
+        else {
+            ei_encode_tuple_header(resp, &resp_index, 2);
+            ei_encode_atom(resp, &resp_index, "error");
+            ei_encode_atom(resp, &resp_index, "spi_trigger_failed");
+        }
+    } else if (strcmp(cmd, "stop_trigger") == 0) {
+        spi_trigger_stop(&spi->trigger);
+        ei_encode_atom(resp, &resp_index, "ok");
+    } else if (strcmp(cmd, "stop_stream") == 0) {
+        spi_stream_stop(&spi->stream);
+        ei_encode_atom(resp, &resp_index, "ok");
+    } else if (strcmp(cmd, "flash_id") == 0) {
+        uint8_t jedec_id[3];
+        uint64_t size;
+        if (flash_identify(spi, jedec_id, &size)) {
+            ei_encode_tuple_header(resp, &resp_index, 3);
+            ei_encode_ulong(resp, &resp_index, jedec_id[0]);
+            ei_encode_ulong(resp, &resp_index, (jedec_id[1] << 8) | jedec_id[2]);
+            if (size > 0)
+                ei_encode_ulonglong(resp, &resp_index, size);
+            else
+                ei_encode_atom(resp, &resp_index, "undefined");
+        } else {
+            ei_encode_tuple_header(resp, &resp_index, 2);
+            ei_encode_atom(resp, &resp_index, "error");
+            ei_encode_atom(resp, &resp_index, "spi_flash_id_failed");
+        }
+    } else if (strcmp(cmd, "flash_read") == 0) {
+        unsigned long addr;
+        unsigned long len;
+        unsigned long addr_width;
+        unsigned long width;
+        if (ei_decode_tuple_header(req, &req_index, &arity) < 0 ||
+                arity != 4 ||
+                ei_decode_ulong(req, &req_index, &addr) < 0 ||
+                ei_decode_ulong(req, &req_index, &len) < 0 ||
+                ei_decode_ulong(req, &req_index, &addr_width) < 0 ||
+                ei_decode_ulong(req, &req_index, &width) < 0 ||
+                len < 1 ||
                 len > SPI_TRANSFER_MAX ||
-                ei_decode_binary(req, &req_index, &data, &llen) < 0)
-            errx(EXIT_FAILURE, "transfer: need a binary between 1 and %d bytes (%d, %d)", SPI_TRANSFER_MAX,
-                    type, len);
+                (addr_width != 3 && addr_width != 4) ||
+                (width != 1 && width != 2 && width != 4))
+            errx(EXIT_FAILURE, "flash_read: expecting {addr, len (1-%d), addr_width (3-4), width (1, 2, 4)}", SPI_TRANSFER_MAX);
 
-        char rxbuffer[SPI_TRANSFER_MAX];
+        resp = spi_resp_buffer(spi, len + 64);
+        uint8_t *data = (uint8_t *) &resp[resp_index + ERLCMD_BINARY_HEADER_SIZE];
+        if (flash_read(spi, addr, addr_width, width, data, len)) {
+            erlcmd_encode_binary_header(resp, &resp_index, len);
+            resp_index += len;
+        } else {
+            ei_encode_tuple_header(resp, &resp_index, 2);
+            ei_encode_atom(resp, &resp_index, "error");
+            ei_encode_atom(resp, &resp_index, "spi_flash_read_failed");
+        }
+    } else if (strcmp(cmd, "flash_program") == 0) {
+        unsigned long addr;
+        unsigned long addr_width;
+        const char *data;
+        int len;
+        if (ei_decode_tuple_header(req, &req_index, &arity) < 0 ||
+                arity != 3 ||
+                ei_decode_ulong(req, &req_index, &addr) < 0 ||
+                erlcmd_decode_binary_view(req, &req_index, &data, &len) < 0 ||
+                len < 1 ||
+                len > SPI_TRANSFER_MAX)
+            errx(EXIT_FAILURE, "flash_program: need a binary between 1 and %d bytes", SPI_TRANSFER_MAX);
+
+        if (ei_decode_ulong(req, &req_index, &addr_width) < 0 ||
+                (addr_width != 3 && addr_width != 4))
+            errx(EXIT_FAILURE, "flash_program: expecting {addr, data, addr_width (3-4)}");
 
-        if (spi_transfer(spi,
-                         data,
-                         rxbuffer,
-                         len))
-            ei_encode_binary(resp, &resp_index, rxbuffer, len);
+        if (flash_program(spi, addr, addr_width, (const uint8_t *) data, len))
+            ei_encode_atom(resp, &resp_index, "ok");
         else {
             ei_encode_tuple_header(resp, &resp_index, 2);
             ei_encode_atom(resp, &resp_index, "error");
-            ei_encode_atom(resp, &resp_index, "spi_transfer_failed");
+            ei_encode_atom(resp, &resp_index, "spi_flash_program_failed");
+        }
+    } else if (strcmp(cmd, "flash_erase") == 0) {
+        unsigned long addr;
+        unsigned long len;
+        unsigned long addr_width;
+        if (ei_decode_tuple_header(req, &req_index, &arity) < 0 ||
+                arity != 3 ||
+                ei_decode_ulong(req, &req_index, &addr) < 0 ||
+                ei_decode_ulong(req, &req_index, &len) < 0 ||
+                ei_decode_ulong(req, &req_index, &addr_width) < 0 ||
+                addr % FLASH_SECTOR_SIZE != 0 ||
+                len == 0 ||
+                len % FLASH_SECTOR_SIZE != 0 ||
+                (addr_width != 3 && addr_width != 4))
+            errx(EXIT_FAILURE, "flash_erase: expecting {addr, len, addr_width (3-4)} with a %d byte aligned addr and non-zero len", FLASH_SECTOR_SIZE);
+
+        if (flash_erase(spi, addr, addr_width, len))
+            ei_encode_atom(resp, &resp_index, "ok");
+        else {
+            ei_encode_tuple_header(resp, &resp_index, 2);
+            ei_encode_atom(resp, &resp_index, "error");
+            ei_encode_atom(resp, &resp_index, "spi_flash_erase_failed");
+        }
+    } else if (strcmp(cmd, "flash_erase_chip") == 0) {
+        if (flash_erase_chip(spi))
+            ei_encode_atom(resp, &resp_index, "ok");
+        else {
+            ei_encode_tuple_header(resp, &resp_index, 2);
+            ei_encode_atom(resp, &resp_index, "error");
+            ei_encode_atom(resp, &resp_index, "spi_flash_erase_failed");
         }
     } else
         errx(EXIT_FAILURE, "unknown command: %s", cmd);
@@ -173,23 +1367,57 @@ static void spi_handle_request(const char *req, void *cookie)
 int spi_main(int argc, char *argv[])
 {
     if (argc != 7)
-        errx(EXIT_FAILURE, "%s spi <device path> <SPI mode (0-3)> <bits/word (8)> <speed (1000000 Hz)> <delay (10 us)>", argv[0]);
+        errx(EXIT_FAILURE, "%s spi <device path> <SPI mode (0-3 + SPI_* flags)> <bits/word (8)> <speed (1000000 Hz)> <delay (10 us)>", argv[0]);
 
     const char *devpath = argv[2];
-    uint8_t mode = (uint8_t) strtoul(argv[3], 0, 0);
+    uint32_t mode = (uint32_t) strtoul(argv[3], 0, 0);
     uint8_t bits = (uint8_t) strtoul(argv[4], 0, 0);
     uint32_t speed = (uint32_t) strtoul(argv[5], 0, 0);
     uint16_t delay = (uint16_t) strtoul(argv[6], 0, 0);
 
     struct spi_info spi;
     spi_init(&spi, devpath, mode, bits, speed, delay);
+    script_init(&spi.scripts, spi_script_xfer, &spi, spi.gpios, &spi.gpio_count);
 
     struct erlcmd handler;
     erlcmd_init(&handler, spi_handle_request, &spi);
 
     for (;;) {
-        // Loop forever and process requests from Erlang.
-        erlcmd_process(&handler);
+        struct pollfd fdset[3];
+
+        fdset[0].fd = STDIN_FILENO;
+        fdset[0].events = POLLIN;
+        fdset[0].revents = 0;
+
+        // Negative fds are ignored by poll()
+        fdset[1].fd = spi.stream.timer_fd;
+        fdset[1].events = POLLIN;
+        fdset[1].revents = 0;
+
+        fdset[2].fd = spi.trigger.active ? spi.trigger.pin.fd : -1;
+        fdset[2].events = POLLPRI;
+        fdset[2].revents = 0;
+
+        // Don't block if streaming back to back.
+        int back_to_back = spi.stream.active && spi.stream.timer_fd < 0;
+        int rc = poll(fdset, 3, back_to_back ? 0 : -1);
+        if (rc < 0) {
+            // Retry if EINTR
+            if (errno == EINTR)
+                continue;
+
+            err(EXIT_FAILURE, "poll");
+        }
+
+        // Handle the trigger first to keep its latency down
+        if (spi.trigger.active && (fdset[2].revents & POLLPRI))
+            spi_trigger_run(&spi, monotonic_ns());
+
+        if (fdset[0].revents & (POLLIN | POLLHUP))
+            erlcmd_process(&handler);
+
+        if (spi.stream.active && ((fdset[1].revents & POLLIN) || back_to_back))
+            spi_stream_sample(&spi);
     }
 
     return 1;
@@ -0,0 +1,278 @@
+/*
+ *  Copyright 2015 Frank Hunleth
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * Timed GPIO waveforms played from a port's poll loop
+ */
+
+#include <err.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/prctl.h>
+#include <sys/timerfd.h>
+
+#include "erlcmd.h"
+#include "waveform.h"
+
+/*
+ * Back to back short steps are played with clock_nanosleep, but only
+ * for this long before going back through poll() so that requests like
+ * stopping a looping waveform still get handled.
+ */
+#define WAVEFORM_SLICE_NS 10000000
+
+/*
+ * A loop that can't keep up would underrun on every pass, so passes
+ * with underruns are added up and reported at most this often.
+ */
+#define WAVEFORM_UNDERRUN_REPORT_NS 100000000
+
+static uint64_t waveform_now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void waveform_to_timespec(uint64_t ns, struct timespec *ts)
+{
+    ts->tv_sec = ns / 1000000000ULL;
+    ts->tv_nsec = ns % 1000000000ULL;
+}
+
+static void waveform_arm(struct waveform_player *player)
+{
+    struct itimerspec its;
+    memset(&its, 0, sizeof(its));
+    waveform_to_timespec(player->deadline_ns, &its.it_value);
+    if (timerfd_settime(player->timer_fd, TFD_TIMER_ABSTIME, &its, NULL) < 0)
+        err(EXIT_FAILURE, "timerfd_settime");
+}
+
+static void waveform_free(struct waveform *waveform)
+{
+    free(waveform->steps);
+    waveform->steps = NULL;
+    waveform->count = 0;
+    waveform->loop = 0;
+}
+
+static void waveform_notify(const char *what, unsigned int underruns)
+{
+    char resp[64];
+    int resp_index = sizeof(uint32_t) + 1; // Space for payload size and type
+    resp[4] = 1; // Notification
+    ei_encode_version(resp, &resp_index);
+    ei_encode_tuple_header(resp, &resp_index, 2);
+    ei_encode_atom(resp, &resp_index, what);
+    ei_encode_ulong(resp, &resp_index, underruns);
+    erlcmd_send(resp, resp_index);
+}
+
+void waveform_init(struct waveform_player *player, waveform_write_fn write, void *cookie, int group)
+{
+    memset(player, 0, sizeof(*player));
+    player->timer_fd = -1;
+    player->write = write;
+    player->cookie = cookie;
+    player->group = group;
+}
+
+/**
+ * @brief	Stop playing and drop anything that's queued
+ */
+void waveform_stop(struct waveform_player *player)
+{
+    if (player->timer_fd >= 0) {
+        close(player->timer_fd);
+        player->timer_fd = -1;
+    }
+    waveform_free(&player->current);
+    waveform_free(&player->next);
+    player->unreported_underruns = 0;
+}
+
+/**
+ * @brief	Play steps until the next one is far enough off to wait for
+ *          with the timer
+ *
+ * A step that comes up after it should have already ended is counted
+ * as an underrun and skipped if there's another step to play so that
+ * the rest keep their timing.
+ */
+void waveform_process(struct waveform_player *player)
+{
+    // A request may have stopped the waveform after poll() returned
+    if (player->timer_fd < 0)
+        return;
+
+    uint64_t expirations;
+    if (read(player->timer_fd, &expirations, sizeof(expirations)) < 0 && errno != EAGAIN)
+        err(EXIT_FAILURE, "read timerfd");
+
+    uint64_t slice_end_ns = waveform_now_ns() + WAVEFORM_SLICE_NS;
+    for (;;) {
+        if (player->pos == player->current.count) {
+            if (player->current.loop && !player->next.steps) {
+                player->unreported_underruns += player->underruns;
+                uint64_t now_ns = waveform_now_ns();
+                if (player->unreported_underruns &&
+                        now_ns - player->last_report_ns >= WAVEFORM_UNDERRUN_REPORT_NS) {
+                    waveform_notify("gpio_play_underrun", player->unreported_underruns);
+                    player->unreported_underruns = 0;
+                    player->last_report_ns = now_ns;
+                }
+            } else {
+                waveform_notify("gpio_play_done",
+                                player->underruns + player->unreported_underruns);
+                player->unreported_underruns = 0;
+                waveform_free(&player->current);
+                player->current = player->next;
+                memset(&player->next, 0, sizeof(player->next));
+                if (!player->current.steps) {
+                    waveform_stop(player);
+                    return;
+                }
+            }
+            player->pos = 0;
+            player->underruns = 0;
+        }
+
+        const struct waveform_step *step = &player->current.steps[player->pos];
+        uint64_t end_ns = player->deadline_ns + step->duration_ns;
+        if (waveform_now_ns() < end_ns)
+            player->write(player->cookie, step->value);
+        else {
+            player->underruns++;
+            if (player->pos + 1 == player->current.count &&
+                    !player->current.loop && !player->next.steps)
+                player->write(player->cookie, step->value);
+        }
+        player->deadline_ns = end_ns;
+        player->pos++;
+
+        uint64_t now_ns = waveform_now_ns();
+        if (player->deadline_ns > now_ns + WAVEFORM_SLEEP_NS ||
+                now_ns >= slice_end_ns) {
+            waveform_arm(player);
+            return;
+        }
+
+        if (player->deadline_ns > now_ns) {
+            struct timespec ts;
+            waveform_to_timespec(player->deadline_ns, &ts);
+            while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR)
+                ;
+        }
+    }
+}
+
+static int waveform_decode(struct waveform_player *player, const char *data, int len,
+                           struct waveform *waveform)
+{
+    int step_size = player->group ? 12 : 4;
+    if (len % step_size != 0)
+        return 0;
+
+    waveform->count = len / step_size;
+    waveform->steps = NULL;
+    if (waveform->count == 0)
+        return 1;
+
+    waveform->steps = malloc(waveform->count * sizeof(struct waveform_step));
+    if (!waveform->steps)
+        err(EXIT_FAILURE, "malloc");
+
+    const uint8_t *p = (const uint8_t *) data;
+    for (unsigned int i = 0; i < waveform->count; i++) {
+        struct waveform_step *step = &waveform->steps[i];
+        if (player->group) {
+            // <<Values:64, DurationNs:32>>
+            step->value = 0;
+            for (int j = 0; j < 8; j++)
+                step->value = (step->value << 8) | p[j];
+            step->duration_ns = ((uint32_t) p[8] << 24) | (p[9] << 16) | (p[10] << 8) | p[11];
+        } else {
+            // <<Level:1, DurationNs:31>>
+            uint32_t word = ((uint32_t) p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+            step->value = word >> 31;
+            step->duration_ns = word & 0x7fffffff;
+        }
+        p += step_size;
+    }
+    return 1;
+}
+
+/**
+ * @brief	Play a waveform. Args are {Steps, Loop}
+ *
+ * If a waveform is already playing, this one is queued to start right
+ * when it ends (or at the end of its current pass if it loops). Only
+ * one can be queued.
+ */
+void waveform_play_request(struct waveform_player *player,
+                           const char *req, int *req_index,
+                           char *resp, int *resp_index)
+{
+    int arity;
+    const char *data;
+    int len;
+    int loop;
+    struct waveform waveform;
+    if (ei_decode_tuple_header(req, req_index, &arity) < 0 ||
+            arity != 2 ||
+            erlcmd_decode_binary_view(req, req_index, &data, &len) < 0 ||
+            ei_decode_boolean(req, req_index, &loop) < 0 ||
+            !waveform_decode(player, data, len, &waveform))
+        errx(EXIT_FAILURE, "play: expecting {steps, loop}");
+    waveform.loop = loop;
+
+    if (waveform.count == 0) {
+        ei_encode_tuple_header(resp, resp_index, 2);
+        ei_encode_atom(resp, resp_index, "error");
+        ei_encode_atom(resp, resp_index, "empty_waveform");
+        return;
+    }
+
+    if (player->next.steps) {
+        waveform_free(&waveform);
+        ei_encode_tuple_header(resp, resp_index, 2);
+        ei_encode_atom(resp, resp_index, "error");
+        ei_encode_atom(resp, resp_index, "queue_full");
+        return;
+    }
+
+    if (player->timer_fd >= 0) {
+        player->next = waveform;
+    } else {
+        player->timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+        if (player->timer_fd < 0)
+            err(EXIT_FAILURE, "timerfd_create");
+
+        // The default 50 us timer slack would be most of a short step
+        prctl(PR_SET_TIMERSLACK, 1);
+
+        player->current = waveform;
+        player->pos = 0;
+        player->underruns = 0;
+        player->deadline_ns = waveform_now_ns();
+
+        // Start from the poll loop once the reply has been sent
+        waveform_arm(player);
+    }
+    ei_encode_atom(resp, resp_index, "ok");
+}
@@ -0,0 +1,73 @@
+/*
+ *  Copyright 2015 Frank Hunleth
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * Timed GPIO waveforms played from a port's poll loop
+ */
+
+#ifndef WAVEFORM_H
+#define WAVEFORM_H
+
+#include <stdint.h>
+
+/*
+ * Steps closer together than this are waited for with clock_nanosleep
+ * instead of going back through poll().
+ */
+#define WAVEFORM_SLEEP_NS 200000
+
+struct waveform_step {
+    uint64_t value;
+    uint32_t duration_ns;
+};
+
+struct waveform {
+    struct waveform_step *steps;  // NULL if none
+    unsigned int count;
+    int loop;
+};
+
+// Set the GPIO or GPIOs to value. Returns 1 on success.
+typedef int (*waveform_write_fn)(void *cookie, uint64_t value);
+
+struct waveform_player {
+    // timerfd for the next step or -1 when idle
+    int timer_fd;
+
+    waveform_write_fn write;
+    void *cookie;
+
+    // 1 if steps are group bitmasks rather than pin levels
+    int group;
+
+    struct waveform current;
+    struct waveform next;
+    unsigned int pos;
+    uint64_t deadline_ns;  // When steps[pos] starts
+    unsigned int underruns;
+
+    // Underruns from looping passes that haven't been reported yet
+    unsigned int unreported_underruns;
+    uint64_t last_report_ns;
+};
+
+void waveform_init(struct waveform_player *player, waveform_write_fn write, void *cookie, int group);
+void waveform_stop(struct waveform_player *player);
+void waveform_process(struct waveform_player *player);
+
+void waveform_play_request(struct waveform_player *player,
+                           const char *req, int *req_index,
+                           char *resp, int *resp_index);
+
+#endif
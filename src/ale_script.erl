@@ -0,0 +1,127 @@
+%%% @author Frank Hunleth <fhunleth@troodon-software.com>
+%%% @copyright (C) 2015, Frank Hunleth
+%%% @doc
+%%% Programs of bus and GPIO operations that the I2C and SPI ports run
+%%% without going back to Erlang between steps. This is useful for
+%%% driver init and read sequences that would otherwise take a round
+%%% trip to the port for each write, wait and status check.
+%%%
+%%% A program is a list of these operations:
+%%%
+%%%    {write, Tx}                  Write Tx
+%%%    {read, Len}                  Read Len bytes
+%%%    {write_read, Tx, Len}        Write Tx and then read Len bytes in one
+%%%                                 transaction
+%%%    {delay_us, Us}               Wait
+%%%    {gpio_write, Name, 0 | 1}    Set a GPIO
+%%%    {gpio_wait, Name, 0 | 1, TimeoutUs}
+%%%                                 Wait for a GPIO to have the value
+%%%    {poll, Tx, Len, {ByteIndex, Mask, Value}, TimeoutUs}
+%%%    {poll, Tx, Len, {ByteIndex, Mask, Value}, TimeoutUs, IntervalUs}
+%%%                                 Repeat a write_read every IntervalUs
+%%%                                 (default 100) until byte ByteIndex of
+%%%                                 what's read ANDed with Mask is Value
+%%%
+%%% Tx is a binary or a list of bytes and {param, N} where {param, N} is
+%%% byte N (counting from 0) of the parameters that the program is run
+%%% with. GPIO names are the ones that the I2C or SPI server was given.
+%%% Everything that the program reads, including the last read of each
+%%% poll, is returned together in one binary.
+%%%
+%%% The port doesn't handle other requests while a program runs, so the
+%%% delays and timeouts in a program can add up to at most 5 seconds,
+%%% the default gen_server:call/2 timeout. The op that goes over is
+%%% returned as invalid.
+%%% @end
+
+-module(ale_script).
+
+%% API
+-export([compile/2]).
+
+-define(POLL_INTERVAL_US, 100).
+-define(MAX_WAIT_US, 5000000).
+
+-type op() :: tuple().
+
+%%%===================================================================
+%%% API
+%%%===================================================================
+
+%% @doc
+%% Check a program and convert it to what the port takes.
+%% @end
+-spec compile([op()], [atom()]) -> {ok, [tuple()]} | {error, empty_program | {invalid_op, pos_integer()}}.
+compile([], _GpioNames) ->
+    {error, empty_program};
+compile(Ops, GpioNames) when is_list(Ops) ->
+    compile(Ops, GpioNames, 1, 0, []).
+
+%%%===================================================================
+%%% Internal functions
+%%%===================================================================
+
+compile([], _GpioNames, _N, _WaitUs, Acc) ->
+    {ok, lists:reverse(Acc)};
+compile([Op | Rest], GpioNames, N, WaitUs, Acc) ->
+    try compile_op(Op, GpioNames) of
+        PortOp ->
+            case WaitUs + wait_us(PortOp) of
+                TotalUs when TotalUs =< ?MAX_WAIT_US ->
+                    compile(Rest, GpioNames, N + 1, TotalUs, [PortOp | Acc]);
+                _ ->
+                    {error, {invalid_op, N}}
+            end
+    catch
+        error:_ -> {error, {invalid_op, N}}
+    end.
+
+%% The longest that the port can spend waiting in an op
+wait_us({delay, Us}) -> Us;
+wait_us({gpio_wait, _Index, _Value, TimeoutUs}) -> TimeoutUs;
+wait_us({poll, _Data, _Refs, _Len, _ByteIndex, _Mask, _Value, IntervalUs, TimeoutUs}) ->
+    TimeoutUs + IntervalUs;
+wait_us(_PortOp) -> 0.
+
+compile_op({write, Tx}, _GpioNames) ->
+    xfer(Tx, 0);
+compile_op({read, Len}, _GpioNames) ->
+    xfer(<<>>, Len);
+compile_op({write_read, Tx, Len}, _GpioNames) ->
+    xfer(Tx, Len);
+compile_op({delay_us, Us}, _GpioNames) when is_integer(Us), Us >= 0 ->
+    {delay, Us};
+compile_op({gpio_write, Name, Value}, GpioNames) when Value =:= 0; Value =:= 1 ->
+    {gpio_write, gpio_index(Name, GpioNames, 0), Value};
+compile_op({gpio_wait, Name, Value, TimeoutUs}, GpioNames)
+  when (Value =:= 0 orelse Value =:= 1), is_integer(TimeoutUs), TimeoutUs >= 0 ->
+    {gpio_wait, gpio_index(Name, GpioNames, 0), Value, TimeoutUs};
+compile_op({poll, Tx, Len, Match, TimeoutUs}, GpioNames) ->
+    compile_op({poll, Tx, Len, Match, TimeoutUs, ?POLL_INTERVAL_US}, GpioNames);
+compile_op({poll, Tx, Len, {ByteIndex, Mask, Value}, TimeoutUs, IntervalUs}, _GpioNames)
+  when is_integer(Len), ByteIndex >= 0, ByteIndex < Len,
+       is_integer(TimeoutUs), TimeoutUs >= 0, is_integer(IntervalUs), IntervalUs >= 0 ->
+    {Data, Refs} = tx_data(Tx),
+    {poll, Data, Refs, Len, ByteIndex, Mask, Value, IntervalUs, TimeoutUs}.
+
+xfer(Tx, Len) when is_integer(Len), Len >= 0 ->
+    {Data, Refs} = tx_data(Tx),
+    true = byte_size(Data) + Len > 0,
+    {xfer, Data, Refs, Len}.
+
+%% The port takes tx data as a binary and a list of {Offset, Param} for
+%% the bytes that come from parameters.
+tx_data(Tx) when is_binary(Tx) ->
+    {Tx, []};
+tx_data(Tx) when is_list(Tx) ->
+    tx_data(Tx, 0, [], []).
+
+tx_data([], _Offset, Bytes, Refs) ->
+    {list_to_binary(lists:reverse(Bytes)), lists:reverse(Refs)};
+tx_data([{param, N} | Rest], Offset, Bytes, Refs) when is_integer(N), N >= 0 ->
+    tx_data(Rest, Offset + 1, [0 | Bytes], [{Offset, N} | Refs]);
+tx_data([Byte | Rest], Offset, Bytes, Refs) when is_integer(Byte), Byte >= 0, Byte =< 255 ->
+    tx_data(Rest, Offset + 1, [Byte | Bytes], Refs).
+
+gpio_index(Name, [Name | _], N) -> N;
+gpio_index(Name, [_ | Rest], N) -> gpio_index(Name, Rest, N + 1).
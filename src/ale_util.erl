@@ -7,16 +7,39 @@
 -module(ale_util).
 
 %% API
--export([open_port/1
+-export([open_port/1,
+         keyword_get/3,
+         gpio_spec/1
          ]).
 
 
 -spec open_port([list()]) -> port().
 open_port(Args) ->
     open_port({spawn_executable, code:priv_dir(erlang_ale) ++ "/erlang-ale"},
-              [{packet, 2},
+              [{packet, 4},
               binary,
               use_stdio,
               exit_status,
               {args, Args}]).
 
+%% @doc
+%% Look up Key in a list of {Key, Value} options.
+%% @end
+-spec keyword_get([{atom(), term()}], atom(), term()) -> term().
+keyword_get(Keywords, Key, Default) ->
+    case lists:keyfind(Key, 1, Keywords) of
+        {Key, Value} -> Value;
+        false -> Default
+    end.
+
+%% @doc
+%% Normalize an entry of the gpios option that the I2C and SPI servers
+%% take to {Name, Pin, Initial}. The ports take an Initial of -1 for an
+%% input.
+%% @end
+-spec gpio_spec({atom(), non_neg_integer()} |
+                {atom(), non_neg_integer(), 0 | 1 | input}) ->
+                       {atom(), non_neg_integer(), -1 | 0 | 1}.
+gpio_spec({Name, Pin}) -> {Name, Pin, 1};
+gpio_spec({Name, Pin, input}) -> {Name, Pin, -1};
+gpio_spec({Name, Pin, Initial}) when Initial =:= 0; Initial =:= 1 -> {Name, Pin, Initial}.
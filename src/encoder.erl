@@ -0,0 +1,211 @@
+%%% @author Frank Hunleth <fhunleth@troodon-software.com>
+%%% @copyright (C) 2015, Frank Hunleth
+%%% @doc
+%%% This is the implementation of the quadrature encoder interface
+%%% module. The port watches both of the encoder's GPIOs and keeps the
+%%% position itself, so no edges go through Erlang.
+%%% @end
+
+-module(encoder).
+
+-behaviour(gen_server).
+
+%% API
+-export([start_link/2, start_link/3, stop/1]).
+-export([read/1, errors/1, set_position/2, subscribe/2]).
+
+%% gen_server callbacks
+-export([init/1, handle_call/3, handle_cast/2, handle_info/2,
+         terminate/2, code_change/3]).
+
+-define(SERVER, ?MODULE).
+-define(REPLY, 0).
+-define(NOTIFICATION, 1).
+
+-type pin() :: non_neg_integer().
+-type server_ref() :: atom() | {atom(), atom()} | pid().
+
+-record(state,
+        { port              :: port(),
+          notify_pid        :: pid() | undefined
+        }).
+
+%%%===================================================================
+%%% API
+%%%===================================================================
+
+%% @doc
+%% Starts the process to decode an encoder on GPIOs PinA and PinB.
+%% The position counts every edge of both (4x decoding) and goes up
+%% when B leads A. Swap the pins to count the other way.
+%% @end
+-spec(start_link(term(), pin(), pin()) -> {ok, pid()} | {error, reason}).
+start_link(ServerName, PinA, PinB) ->
+    gen_server:start_link(ServerName, ?MODULE, {PinA, PinB}, []).
+
+-spec(start_link(pin(), pin()) -> {ok, pid()} | {error, reason}).
+start_link(PinA, PinB) ->
+    gen_server:start_link(?MODULE, {PinA, PinB}, []).
+
+%% @doc
+%% Stop the process and release it.
+%% @end
+-spec(stop(server_ref()) -> ok).
+stop(ServerRef) ->
+    gen_server:cast(ServerRef, stop).
+
+%% @doc
+%% Return the position and the velocity in counts per second. The
+%% velocity is measured over at least the last 100 ms.
+%% @end
+-spec(read(server_ref()) -> {integer(), integer()}).
+read(ServerRef) ->
+    gen_server:call(ServerRef, read).
+
+%% @doc
+%% Return how many times both GPIOs changed between edges. Each of
+%% these means that edges came faster than the port could handle and
+%% the position may be off.
+%% @end
+-spec(errors(server_ref()) -> non_neg_integer()).
+errors(ServerRef) ->
+    gen_server:call(ServerRef, errors).
+
+%% @doc
+%% Set the position, e.g. to 0 at a home switch.
+%% @end
+-spec(set_position(server_ref(), integer()) -> ok).
+set_position(ServerRef, Position) ->
+    gen_server:call(ServerRef, {set_position, Position}).
+
+%% @doc
+%% Have the caller sent
+%% <code>{encoder_position, Server, Position, Velocity}</code> when the
+%% position changes, but no more often than every IntervalMs. An
+%% IntervalMs of 0 stops the notifications.
+%% @end
+-spec(subscribe(server_ref(), non_neg_integer()) -> ok).
+subscribe(ServerRef, IntervalMs) ->
+    gen_server:call(ServerRef, {subscribe, self(), IntervalMs}).
+
+%%%===================================================================
+%%% gen_server callbacks
+%%%===================================================================
+
+%%--------------------------------------------------------------------
+%% @private
+%% @doc
+%% Initializes the server
+%%
+%% @spec init(Args) -> {ok, State} |
+%%                     {ok, State, Timeout} |
+%%                     ignore |
+%%                     {stop, Reason}
+%% @end
+%%--------------------------------------------------------------------
+init({PinA, PinB}) ->
+    Port = ale_util:open_port(["encoder",
+                               integer_to_list(PinA),
+                               integer_to_list(PinB)]),
+    {ok, #state{port=Port}}.
+
+%%--------------------------------------------------------------------
+%% @private
+%% @doc
+%% Handling call messages
+%%
+%% @spec handle_call(Request, From, State) ->
+%%                                   {reply, Reply, State} |
+%%                                   {reply, Reply, State, Timeout} |
+%%                                   {noreply, State} |
+%%                                   {noreply, State, Timeout} |
+%%                                   {stop, Reason, Reply, State} |
+%%                                   {stop, Reason, State}
+%% @end
+%%--------------------------------------------------------------------
+handle_call(read, _From, #state{port=Port}=State) ->
+    {Position, Velocity, _Errors} = call_port(Port, read, []),
+    {reply, {Position, Velocity}, State};
+handle_call(errors, _From, #state{port=Port}=State) ->
+    {_Position, _Velocity, Errors} = call_port(Port, read, []),
+    {reply, Errors, State};
+handle_call({set_position, Position}, _From, #state{port=Port}=State) ->
+    Reply = call_port(Port, set_position, Position),
+    {reply, Reply, State};
+handle_call({subscribe, Pid, IntervalMs}, _From, #state{port=Port}=State) ->
+    Reply = call_port(Port, notify, IntervalMs),
+    {reply, Reply, State#state{notify_pid=Pid}}.
+
+%%--------------------------------------------------------------------
+%% @private
+%% @doc
+%% Handling cast messages
+%%
+%% @spec handle_cast(Msg, State) -> {noreply, State} |
+%%                                  {noreply, State, Timeout} |
+%%                                  {stop, Reason, State}
+%% @end
+%%--------------------------------------------------------------------
+handle_cast(stop, State) ->
+    {stop, normal, State}.
+
+%%--------------------------------------------------------------------
+%% @private
+%% @doc
+%% Handling all non call/cast messages
+%%
+%% @spec handle_info(Info, State) -> {noreply, State} |
+%%                                   {noreply, State, Timeout} |
+%%                                   {stop, Reason, State}
+%% @end
+%%--------------------------------------------------------------------
+handle_info({Port, {data, <<?NOTIFICATION, Msg/binary>>}}, #state{port=Port}=State) ->
+    {encoder_position, Position, Velocity} = binary_to_term(Msg),
+    notify(State#state.notify_pid, {encoder_position, self(), Position, Velocity}),
+    {noreply, State};
+handle_info({Port, {exit_status, _}}, #state{port=Port}=State) ->
+    {stop, port_exited, State};
+handle_info(_Info, State) ->
+    {noreply, State}.
+
+%%--------------------------------------------------------------------
+%% @private
+%% @doc
+%% This function is called by a gen_server when it is about to
+%% terminate. It should be the opposite of Module:init/1 and do any
+%% necessary cleaning up. When it returns, the gen_server terminates
+%% with Reason. The return value is ignored.
+%%
+%% @spec terminate(Reason, State) -> void()
+%% @end
+%%--------------------------------------------------------------------
+terminate(_Reason, _State) ->
+    ok.
+
+%%--------------------------------------------------------------------
+%% @private
+%% @doc
+%% Convert process state when code is changed
+%%
+%% @spec code_change(OldVsn, State, Extra) -> {ok, NewState}
+%% @end
+%%--------------------------------------------------------------------
+code_change(_OldVsn, State, _Extra) ->
+    {ok, State}.
+
+%%%===================================================================
+%%% Internal functions
+%%%===================================================================
+
+notify(Pid, Msg) when is_pid(Pid) ->
+    Pid ! Msg;
+notify(undefined, _Msg) ->
+    ok.
+
+call_port(Port, Command, Args) ->
+    Message = {Command, Args},
+    erlang:send(Port, {self(), {command, term_to_binary(Message)}}),
+    receive
+        {Port, {data, <<?REPLY, Response/binary>>}} -> binary_to_term(Response);
+        {Port, {exit_status, _}} -> exit(port_exited)
+    end.
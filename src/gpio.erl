@@ -13,6 +13,7 @@
 %% API
 -export([start_link/2,
          start_link/3,
+         start_link/4,
          stop/1,
          write/2,
          read/1,
@@ -20,7 +21,20 @@
          register_int/1,
          register_int/2,
          unregister_int/1,
-         unregister_int/2]).
+         unregister_int/2,
+         pwm/3,
+         pwm/4,
+         pwm_stats/1,
+         write_stats/1,
+         capture/3,
+         play/2,
+         play/3,
+         stop_play/1,
+         set_reflexes/2,
+         reset_reflexes/1,
+         open_group/3,
+         read_all/1,
+         write_mask/3]).
 
 %% gen_server callbacks
 -export([init/1, handle_call/3, handle_cast/2, handle_info/2,
@@ -35,13 +49,15 @@
 -type pin_state() :: 0 | 1.
 -type interrupt_condition() :: 'enabled' | 'summarize' | 'none' | 'rising' | 'falling' | 'both'.
 -type server_ref() :: atom() | {atom(), atom()} | pid().
+-type chip() :: non_neg_integer() | string().
 
 -export_type([interrupt_condition/0]).
 
 -record(state,
-        { pin               :: pos_integer(),
+        { pin               :: pos_integer() | undefined,
           pids = []         :: [pid()],
-          port              :: port()
+          port              :: port(),
+          play_pids = []    :: [pid()]  % For the playing and queued waveforms
         }).
 
 %%%===================================================================
@@ -60,6 +76,33 @@ start_link(ServerName, Pin, Direction) ->
 start_link(Pin, Direction) ->
   gen_server:start_link(?MODULE, {Pin, Direction}, []).
 
+%% @doc
+%% Starts a process to handle a GPIO with options.
+%%
+%% Options:
+%%    {mmio, Path}            Read and write the pin through the SoC's
+%%                            memory mapped GPIO registers instead of
+%%                            sysfs, e.g. "/dev/gpiomem". This is much
+%%                            faster for bit-banging, but interrupts,
+%%                            capture/3 and reflexes aren't available.
+%%                            A regular file works as a stand-in for
+%%                            testing.
+%%    {mmio_layout, Layout}   Register layout of the mmio block
+%%                            (default bcm2835 for Raspberry Pis)
+%%    {cache, true}           Remember what was written to an output
+%%                            last, skip writing the same value again
+%%                            and return it from read/1. Only use this
+%%                            if nothing else drives the pin. Reflexes
+%%                            can't drive a cached pin, and starting
+%%                            with {cache, true} returns
+%%                            {error, gpio_cache_failed} if one already
+%%                            does.
+%% @end
+-spec start_link(term(), pin(), pin_direction(), list()) ->
+                    {'ok', pid()} | 'ignore' | {'error', term()}.
+start_link(ServerName, Pin, Direction, Options) ->
+  gen_server:start_link(ServerName, ?MODULE, {Pin, Direction, Options}, []).
+
 %% @doc
 %% Stop the process channel and release it.
 %% @end
@@ -127,6 +170,175 @@ unregister_int(ServerRef) ->
 unregister_int(ServerRef, Pid) ->
   gen_server:call(ServerRef, {unregister_int, Pid}).
 
+%% @doc pwm/3 drives an output pin with software PWM from the port.
+%%
+%% PeriodUs is the period in microseconds and Duty is the fraction of
+%% the period that the pin is high (0.0 to 1.0). Calling pwm/3 again
+%% with the same period changes the duty cycle from the next period on
+%% without restarting. A PeriodUs of 0 stops PWM and leaves the pin
+%% low as does write/2.
+%% @end
+-spec pwm(server_ref(), non_neg_integer(), number()) -> 'ok' | {'error', term()}.
+pwm(ServerRef, PeriodUs, Duty) ->
+  pwm(ServerRef, PeriodUs, Duty, []).
+
+%% @doc pwm/4 is pwm/3 with options.
+%%
+%% Options:
+%%    {priority, 1..99}   Run the port with this SCHED_FIFO priority to
+%%                        reduce jitter when the system is busy. The
+%%                        port goes back to normal scheduling when PWM
+%%                        stops or is set without a priority.
+%% @end
+-spec pwm(server_ref(), non_neg_integer(), number(), list()) -> 'ok' | {'error', term()}.
+pwm(ServerRef, PeriodUs, Duty, Options) when Duty >= 0, Duty =< 1 ->
+  Priority = ale_util:keyword_get(Options, priority, 0),
+  PeriodNs = PeriodUs * 1000,
+  gen_server:call(ServerRef, {pwm, PeriodNs, round(PeriodNs * Duty), Priority}).
+
+%% @doc pwm_stats/1 returns timing statistics for the PWM since its
+%% period was set.
+%%
+%% The periods are measured between rising edges and max_jitter_ns is
+%% the furthest that one was from the requested period. skipped counts
+%% the periods that were dropped because the port fell more than a
+%% period behind. max_late_ns is the latest that an edge was written.
+%% @end
+-spec pwm_stats(server_ref()) -> [{atom(), non_neg_integer()}].
+pwm_stats(ServerRef) ->
+  gen_server:call(ServerRef, pwm_stats).
+
+%% @doc write_stats/1 returns how many times an output was written and
+%% how many writes were skipped because the pin already had the value.
+%% Writes are only skipped when the pin was started with {cache, true}.
+%% @end
+-spec write_stats(server_ref()) -> [{atom(), non_neg_integer()}].
+write_stats(ServerRef) ->
+  gen_server:call(ServerRef, write_stats).
+
+%% @doc capture/3 records the timing of an input pin's edges, e.g. to
+%% decode a DHT22 sensor, an IR remote or an RC receiver.
+%%
+%% The port waits on the pin until MaxEdges edges have been seen or
+%% TimeoutMs passes and returns a binary with a 32-bit word for each
+%% edge. Decode it with
+%% <code>[{Level, DeltaUs} || &lt;&lt;Level:1, DeltaUs:31&gt;&gt; &lt;= Bin]</code>
+%% where Level is the pin's value after the edge and DeltaUs is the
+%% microseconds since the edge before it or since the capture started.
+%% Interrupt notifications aren't sent during the capture, but reflexes
+%% still drive their outputs.
+%% @end
+-spec capture(server_ref(), non_neg_integer(), non_neg_integer()) -> binary() | {'error', term()}.
+capture(ServerRef, MaxEdges, TimeoutMs) when MaxEdges =< 65536 ->
+  gen_server:call(ServerRef, {capture, MaxEdges, TimeoutMs * 1000}, infinity).
+
+%% @doc play/2 plays a waveform on an output pin or group.
+%%
+%% For a pin, the waveform is a list of {Level, DurationNs} or a binary
+%% of <code>&lt;&lt;Level:1, DurationNs:31&gt;&gt;</code> words. For a
+%% group, it's a list of {Values, DurationNs} where Values is a bitmask
+%% like write_mask/3 takes, or a binary of
+%% <code>&lt;&lt;Values:64, DurationNs:32&gt;&gt;</code> entries. A step
+%% that doesn't fit in those fields, like a pin step of 2^31 ns (about
+%% 2.1 seconds) or more, returns {error, badarg}. Split long steps into
+%% several. The port times each step against absolute deadlines so that
+%% errors don't add up.
+%%
+%% If a waveform is already playing, this one is queued to start as soon
+%% as it ends. One waveform can be queued and {error, queue_full} is
+%% returned if there's one already. The caller is sent
+%% <code>{gpio_play_done, Server, Underruns}</code> when each waveform
+%% ends where Underruns is how many steps were started too late to play.
+%% Those are skipped so that the following steps stay on time.
+%% @end
+-spec play(server_ref(), binary() | [{non_neg_integer(), non_neg_integer()}]) -> 'ok' | {'error', term()}.
+play(ServerRef, Waveform) ->
+  play(ServerRef, Waveform, []).
+
+%% @doc play/3 is play/2 with options.
+%%
+%% Options:
+%%    {loop, true}   Repeat the waveform until another is queued or
+%%                   stop_play/1 is called. Underruns are added up
+%%                   over the passes and sent as
+%%                   <code>{gpio_play_underrun, Server, Underruns}</code>
+%%                   at most every 100 ms. Those not sent yet are in
+%%                   gpio_play_done's count.
+%% @end
+-spec play(server_ref(), binary() | [{non_neg_integer(), non_neg_integer()}], list()) -> 'ok' | {'error', term()}.
+play(ServerRef, Waveform, Options) ->
+  Loop = ale_util:keyword_get(Options, loop, false),
+  gen_server:call(ServerRef, {play, self(), Waveform, Loop}).
+
+%% @doc stop_play/1 stops the waveform that's playing and drops the
+%% queued one. The outputs keep their current values.
+%% @end
+-spec stop_play(server_ref()) -> 'ok'.
+stop_play(ServerRef) ->
+  gen_server:call(ServerRef, stop_play).
+
+%% @doc set_reflexes/2 has the port of an input pin drive other pins
+%% as soon as it sees the input change, e.g. to cut a motor enable when
+%% a limit switch trips without waiting on Erlang.
+%%
+%% Each rule is {When, OutputPin, Drive} or {When, OutputPin, Drive,
+%% Options} and drives OutputPin to Drive while the input reads When.
+%% OutputPin has to be exported as an output already, usually by another
+%% gpio server that wasn't started with {cache, true}, or
+%% {error, gpio_reflex_failed} is returned. The rules replace any from
+%% before and are checked against the input right away. Up to 8 are
+%% supported and [] removes them all.
+%%
+%% Options:
+%%    {latch, true}    Leave the output at Drive when the input changes
+%%                     back until reset_reflexes/1 is called
+%%    {notify, true}   Send <code>{gpio_reflex, Pin, OutputPin, Value}</code>
+%%                     to the processes registered with register_int
+%%                     after the output changes
+%% @end
+-spec set_reflexes(server_ref(), [{pin_state(), pin(), pin_state()} |
+                                  {pin_state(), pin(), pin_state(), list()}]) -> 'ok' | {'error', term()}.
+set_reflexes(ServerRef, Rules) ->
+  gen_server:call(ServerRef, {reflex, [reflex_rule(Rule) || Rule <- Rules]}).
+
+%% @doc reset_reflexes/1 rearms latched reflexes. Their outputs are left
+%% as they are unless the input still trips them.
+%% @end
+-spec reset_reflexes(server_ref()) -> 'ok'.
+reset_reflexes(ServerRef) ->
+  gen_server:call(ServerRef, reset_reflex).
+
+%% @doc open_group/3 starts a process to handle a group of lines on a
+%% gpiochip. The lines are read and written together so that they all
+%% change at once, e.g. for a parallel bus or a bank of relays.
+%%
+%% Chip is the chip number, a name like "gpiochip0" or a path. Lines
+%% are offsets on the chip and there may be up to 64. Outputs start low.
+%% Bit N of the masks that read_all/1 and write_mask/3 use is the Nth
+%% line in Lines.
+%%
+%% Groups support read_all/1, write_mask/3, play/2, play/3 and
+%% stop_play/1. Other calls return {error, not_supported}, as do
+%% read_all/1 and write_mask/3 on a pin.
+%% @end
+-spec open_group(chip(), [non_neg_integer()], pin_direction()) ->
+                    {'ok', pid()} | {'error', term()}.
+open_group(Chip, Lines, Direction) when Lines =/= [], length(Lines) =< 64 ->
+  gen_server:start_link(?MODULE, {group, chip_path(Chip), Lines, Direction}, []).
+
+%% @doc read_all/1 returns the values of all lines in a group as a bitmask.
+%% @end
+-spec read_all(server_ref()) -> non_neg_integer() | {'error', term()}.
+read_all(ServerRef) ->
+  gen_server:call(ServerRef, read_all).
+
+%% @doc write_mask/3 sets the lines in a group whose bits are set in
+%% Mask to the corresponding bits of Values. Other lines keep their values.
+%% @end
+-spec write_mask(server_ref(), non_neg_integer(), non_neg_integer()) -> 'ok' | {'error', term()}.
+write_mask(ServerRef, Mask, Values) ->
+  gen_server:call(ServerRef, {write_mask, Mask, Values}).
+
 %%%===================================================================
 %%% gen_server callbacks
 %%%===================================================================
@@ -146,24 +358,94 @@ init({Pin, Direction}) ->
     Port = ale_util:open_port(["gpio",
                                integer_to_list(Pin),
                                atom_to_list(Direction)]),
-    {ok, #state{pin=Pin, port=Port}}.
+    {ok, #state{pin=Pin, port=Port}};
+init({Pin, Direction, Options}) ->
+    Mmio = case ale_util:keyword_get(Options, mmio, undefined) of
+               undefined -> [];
+               Path -> [Path, atom_to_list(ale_util:keyword_get(Options, mmio_layout, bcm2835))]
+           end,
+    Port = ale_util:open_port(["gpio",
+                               integer_to_list(Pin),
+                               atom_to_list(Direction)
+                               | Mmio]),
+    case ale_util:keyword_get(Options, cache, false) of
+        false -> {ok, #state{pin=Pin, port=Port}};
+        true ->
+            case call_port(Port, cache, true) of
+                ok -> {ok, #state{pin=Pin, port=Port}};
+                {error, Reason} -> {stop, Reason}
+            end
+    end;
+init({group, ChipPath, Lines, Direction}) ->
+    Port = ale_util:open_port(["gpio_group",
+                               ChipPath,
+                               atom_to_list(Direction)
+                               | [integer_to_list(Line) || Line <- Lines]]),
+    {ok, #state{port=Port}}.
 
-handle_call({write, Value}, _From, #state{port=Port}=State) ->
+handle_call(Request, From, #state{pin=Pin}=State) ->
+    case request_supported(request_name(Request), Pin =:= undefined) of
+        true -> handle_request(Request, From, State);
+        false -> {reply, {error, not_supported}, State}
+    end.
+
+handle_request({write, Value}, _From, #state{port=Port}=State) ->
+    %% Writing stops any waveform
     Reply = call_port(Port, write, Value),
-    {reply, Reply, State};
-handle_call(read, _From, #state{port=Port}=State) ->
+    {reply, Reply, State#state{play_pids=[]}};
+handle_request(read, _From, #state{port=Port}=State) ->
     Reply = call_port(Port, read, []),
     {reply, Reply, State};
-handle_call({set_int, Condition}, _From, #state{port=Port}=State) ->
+handle_request({pwm, PeriodNs, HighNs, Priority}, _From, #state{port=Port}=State) ->
+    Reply = call_port(Port, pwm, {PeriodNs, HighNs, Priority}),
+    case Reply of
+        ok when PeriodNs > 0 -> {reply, Reply, State#state{play_pids=[]}};
+        _ -> {reply, Reply, State}
+    end;
+handle_request(pwm_stats, _From, #state{port=Port}=State) ->
+    Reply = call_port(Port, pwm_stats, []),
+    {reply, Reply, State};
+handle_request(write_stats, _From, #state{port=Port}=State) ->
+    Reply = call_port(Port, write_stats, []),
+    {reply, Reply, State};
+handle_request({capture, MaxEdges, TimeoutUs}, _From, #state{port=Port}=State) ->
+    Reply = call_port(Port, capture, {MaxEdges, TimeoutUs}),
+    {reply, Reply, State};
+handle_request({play, Pid, Waveform, Loop}, _From, #state{port=Port, pin=Pin}=State) ->
+    case waveform_binary(Waveform, Pin =:= undefined) of
+        {error, _} = BadArg ->
+            {reply, BadArg, State};
+        Bin ->
+            case call_port(Port, play, {Bin, Loop}) of
+                ok -> {reply, ok, State#state{play_pids=State#state.play_pids ++ [Pid]}};
+                Error -> {reply, Error, State}
+            end
+    end;
+handle_request(stop_play, _From, #state{port=Port}=State) ->
+    Reply = call_port(Port, stop_play, []),
+    {reply, Reply, State#state{play_pids=[]}};
+handle_request({reflex, Rules}, _From, #state{port=Port}=State) ->
+    Reply = call_port(Port, reflex, Rules),
+    {reply, Reply, State};
+handle_request(reset_reflex, _From, #state{port=Port}=State) ->
+    Reply = call_port(Port, reset_reflex, []),
+    {reply, Reply, State};
+handle_request(read_all, _From, #state{port=Port}=State) ->
+    Reply = call_port(Port, read_all, []),
+    {reply, Reply, State};
+handle_request({write_mask, Mask, Values}, _From, #state{port=Port}=State) ->
+    Reply = call_port(Port, write_mask, {Mask, Values}),
+    {reply, Reply, State#state{play_pids=[]}};
+handle_request({set_int, Condition}, _From, #state{port=Port}=State) ->
     call_port(Port, set_int, Condition),
     {reply, ok, State};
-handle_call({register_int, Pid}, _From,
-            #state{pids=Pids}=State) ->
+handle_request({register_int, Pid}, _From,
+               #state{pids=Pids}=State) ->
     link(Pid),
     NewPids = [Pid|Pids],
     {reply, ok, State#state{pids=NewPids}};
-handle_call({unregister_int, Pid}, _From,
-            #state{pids=Pids}=State) ->
+handle_request({unregister_int, Pid}, _From,
+               #state{pids=Pids}=State) ->
     NewPids = lists:delete(Pid, Pids),
     {reply, ok, State#state{pids=NewPids}}.
 
@@ -182,10 +464,26 @@ handle_cast(stop, State) ->
     {stop, normal, State}.
 
 handle_info({Port, {data, <<?NOTIFICATION, Msg/binary>>}},
-            #state{port=Port, pids=Pids}=State) ->
-    Notif = binary_to_term(Msg),
-    [ Pid ! Notif || Pid <- Pids ],
-    {noreply, State};
+            #state{port=Port, pids=Pids, play_pids=PlayPids}=State) ->
+    case binary_to_term(Msg) of
+        {gpio_play_done, Underruns} when PlayPids =/= [] ->
+            [PlayPid | Queued] = PlayPids,
+            PlayPid ! {gpio_play_done, self(), Underruns},
+            {noreply, State#state{play_pids=Queued}};
+        {gpio_play_underrun, Underruns} when PlayPids =/= [] ->
+            hd(PlayPids) ! {gpio_play_underrun, self(), Underruns},
+            {noreply, State};
+        {gpio_play_done, _} ->
+            % The waveform was stopped after this was sent
+            {noreply, State};
+        {gpio_play_underrun, _} ->
+            {noreply, State};
+        Notif ->
+            [ Pid ! Notif || Pid <- Pids ],
+            {noreply, State}
+    end;
+handle_info({Port, {exit_status, _}}, #state{port=Port}=State) ->
+    {stop, port_exited, State};
 handle_info({'EXIT', DeadPid, _Reason},     % a listener died
 	    #state{pids=Pids}=State) ->
     NewPids = [ Pid || Pid <- Pids, Pid /= DeadPid ],
@@ -201,9 +499,62 @@ code_change(_OldVsn, State, _Extra) ->
 %%% Internal functions
 %%%===================================================================
 
+waveform_binary(Waveform, _IsGroup) when is_binary(Waveform) ->
+    Waveform;
+waveform_binary(Steps, IsGroup) when is_list(Steps) ->
+    case lists:all(fun(Step) -> waveform_step_fits(Step, IsGroup) end, Steps) of
+        true when IsGroup ->
+            << <<Values:64, DurationNs:32>> || {Values, DurationNs} <- Steps >>;
+        true ->
+            << <<Level:1, DurationNs:31>> || {Level, DurationNs} <- Steps >>;
+        false ->
+            {error, badarg}
+    end;
+waveform_binary(_Steps, _IsGroup) ->
+    {error, badarg}.
+
+%% The binary fields would silently truncate anything bigger
+waveform_step_fits({Level, DurationNs}, false)
+  when (Level =:= 0 orelse Level =:= 1),
+       is_integer(DurationNs), DurationNs >= 0, DurationNs < 1 bsl 31 ->
+    true;
+waveform_step_fits({Values, DurationNs}, true)
+  when is_integer(Values), Values >= 0, Values < 1 bsl 64,
+       is_integer(DurationNs), DurationNs >= 0, DurationNs < 1 bsl 32 ->
+    true;
+waveform_step_fits(_Step, _IsGroup) ->
+    false.
+
+reflex_rule({When, OutputPin, Drive}) ->
+    reflex_rule({When, OutputPin, Drive, []});
+reflex_rule({When, OutputPin, Drive, Options}) ->
+    {When, OutputPin, Drive,
+     ale_util:keyword_get(Options, latch, false),
+     ale_util:keyword_get(Options, notify, false)}.
+
+request_name(Request) when is_tuple(Request) ->
+    element(1, Request);
+request_name(Request) ->
+    Request.
+
+%% Pin ports and group ports only share the waveform commands
+request_supported(read_all, IsGroup) -> IsGroup;
+request_supported(write_mask, IsGroup) -> IsGroup;
+request_supported(play, _IsGroup) -> true;
+request_supported(stop_play, _IsGroup) -> true;
+request_supported(_Request, IsGroup) -> not IsGroup.
+
+chip_path(Chip) when is_integer(Chip) ->
+    "/dev/gpiochip" ++ integer_to_list(Chip);
+chip_path("/" ++ _ = Path) ->
+    Path;
+chip_path(Name) ->
+    "/dev/" ++ Name.
+
 call_port(Port, Command, Args) ->
     Message = {Command, Args},
     erlang:send(Port, {self(), {command, term_to_binary(Message)}}),
     receive
-        {Port, {data, <<?REPLY, Response/binary>>}} -> binary_to_term(Response)
+        {Port, {data, <<?REPLY, Response/binary>>}} -> binary_to_term(Response);
+        {Port, {exit_status, _}} -> exit(port_exited)
     end.
@@ -12,20 +12,36 @@
 
 %% API
 -export([start_link/2, start_link/3, stop/1]).
--export([write/2, read/2, write_read/3]).
+-export([write/2, read/2, write_read/3, write_read_async/3]).
+-export([scan/1]).
+-export([eeprom_write/4, eeprom_read/4]).
+-export([start_trigger/5, stop_trigger/1]).
+-export([init_gpios/2, load_program/3, run_program/3, delete_program/2]).
+-export([regmap_init/2, regmap_cache_only/2, regmap_stats/1,
+         reg_read/3, reg_write/3, update_bits/4, reg_flush/1]).
 
 %% gen_server callbacks
 -export([init/1, handle_call/3, handle_cast/2, handle_info/2,
 	 terminate/2, code_change/3]).
 
 -define(SERVER, ?MODULE).
+-define(REPLY, 0).
+-define(NOTIFICATION, 1).
 
 -type addr() :: integer(). %% fix to be 2-127
 -type data() :: binary().
 -type len() :: integer().
 -type devname() :: string().
+-type reg() :: 0..255.
 -type server_ref() :: atom() | {atom(), atom()} | pid().
 
+-record(state,
+        { port              :: port(),
+          pending           :: queue:queue(),
+          trigger_pid       :: pid() | undefined,
+          gpio_names = []   :: [atom()]
+        }).
+
 %%%===================================================================
 %%% API
 %%%===================================================================
@@ -67,6 +83,208 @@ read(ServerRef, Len) ->
 write_read(ServerRef, Data, Len) ->
     gen_server:call(ServerRef, {wrrd, Data, Len}).
 
+%% @doc
+%% Start a combined write/read without waiting for it to complete. The
+%% result is sent to the caller as <code>{i2c_result, Ref, Result}</code>
+%% where Result is the same as write_read/3 would return. Requests are
+%% run in the order that they are made, so several reads can be
+%% outstanding on one or more buses at the same time.
+%% @end
+-spec(write_read_async(server_ref(), data(), len()) -> reference()).
+write_read_async(ServerRef, Data, Len) ->
+    Ref = make_ref(),
+    gen_server:cast(ServerRef, {wrrd_async, self(), Ref, Data, Len}),
+    Ref.
+
+%% @doc
+%% Enable the register map cache for devices with 8-bit register
+%% addresses and 8-bit registers. Registers listed in VolatileRegs
+%% (e.g. status or data registers) are never cached. Calling this
+%% again discards everything that was cached.
+%% @end
+-spec(regmap_init(server_ref(), [reg()]) -> ok).
+regmap_init(ServerRef, VolatileRegs) ->
+    gen_server:call(ServerRef, {regmap_init, list_to_binary(VolatileRegs)}).
+
+%% @doc
+%% In cache-only mode, register writes only update the cache. Use
+%% reg_flush/1 to write all changed registers to the device.
+%% @end
+-spec(regmap_cache_only(server_ref(), boolean()) -> ok | {error, reason}).
+regmap_cache_only(ServerRef, Enable) when is_boolean(Enable) ->
+    gen_server:call(ServerRef, {regmap_cache_only, Enable}).
+
+%% @doc
+%% Return the number of register reads that were served from the
+%% cache and the number that needed to go to the device.
+%% @end
+-spec(regmap_stats(server_ref()) -> {Hits :: non_neg_integer(), Misses :: non_neg_integer()} | {error, reason}).
+regmap_stats(ServerRef) ->
+    gen_server:call(ServerRef, regmap_stats).
+
+%% @doc
+%% Read Count consecutive registers starting at Reg.
+%% @end
+-spec(reg_read(server_ref(), reg(), len()) -> data() | {error, reason}).
+reg_read(ServerRef, Reg, Count) ->
+    gen_server:call(ServerRef, {reg_read, Reg, Count}).
+
+%% @doc
+%% Write consecutive registers starting at Reg.
+%% @end
+-spec(reg_write(server_ref(), reg(), data()) -> ok | {error, reason}).
+reg_write(ServerRef, Reg, Data) ->
+    gen_server:call(ServerRef, {reg_write, Reg, Data}).
+
+%% @doc
+%% Set the bits in Mask to the corresponding bits in Value. This is one
+%% call to the port and the device is only written if the register
+%% changes.
+%% @end
+-spec(update_bits(server_ref(), reg(), byte(), byte()) -> ok | {error, reason}).
+update_bits(ServerRef, Reg, Mask, Value) ->
+    gen_server:call(ServerRef, {reg_update_bits, Reg, Mask, Value}).
+
+%% @doc
+%% Write all registers that were changed in cache-only mode.
+%% @end
+-spec(reg_flush(server_ref()) -> ok | {error, reason}).
+reg_flush(ServerRef) ->
+    gen_server:call(ServerRef, reg_flush).
+
+%% @doc
+%% Probe every address on an I2C bus (e.g. "i2c-1") and return the
+%% ones that respond. This works like i2cdetect and uses one short
+%% lived port process for the whole scan. Addresses that are in use by
+%% a Linux driver can't be probed, but have a device, so they're
+%% returned as {busy, Addr} like the "UU" that i2cdetect shows.
+%% @end
+-spec(scan(devname()) -> [addr() | {busy, addr()}] | {error, reason}).
+scan(Devname) ->
+    Port = ale_util:open_port(["i2c", "/dev/" ++ Devname, "scan"]),
+    receive
+        {Port, {data, <<?REPLY, Response/binary>>}} ->
+            receive
+                {Port, {exit_status, _}} -> ok
+            end,
+            binary_to_term(Response);
+        {Port, {exit_status, _}} ->
+            {error, i2c_scan_failed}
+    end.
+
+%% @doc
+%% Write Data to an I2C EEPROM or FRAM starting at memory address
+%% MemAddr. The port splits the data into page writes and polls the
+%% device for the end of each write cycle instead of sleeping.
+%%
+%% Options:
+%%    {page_size, Bytes}     Write page size (default 32)
+%%    {addr_width, Bytes}    1 or 2 memory address bytes (default 2)
+%%    {size, Bytes}          Size of the part (default what addr_width
+%%                           bytes can address, 256 or 65536)
+%%    {write_timeout, Ms}    Max time for one page write (default 20)
+%%    {progress, Bytes}      Send the caller
+%%                           <code>{eeprom_progress, Server, Done, Total}</code>
+%%                           messages about every Bytes bytes (default 0, off)
+%%
+%% Parts bigger than addr_width bytes can address, like the 24C16 (2 KiB
+%% with 1 address byte) and 24C1024 (128 KiB with 2), take the upper
+%% memory address bits from the low bits of their I2C address. Set
+%% {size, Bytes} for these so that the port sends addresses past the
+%% first 256 or 65536 bytes to the right block. Open the port with the
+%% part's base address, e.g. 16#50, and leave the block select bits 0.
+%% Writes and reads that don't fit in size return
+%% {error, i2c_eeprom_out_of_range} rather than going to another device
+%% on the bus. A size needing more than 3 block select bits or block
+%% select bits that are set in the address returns
+%% {error, i2c_eeprom_bad_size}.
+%% @end
+-spec(eeprom_write(server_ref(), non_neg_integer(), data(), list()) -> ok | {error, reason}).
+eeprom_write(ServerRef, MemAddr, Data, Options) ->
+    PageSize = ale_util:keyword_get(Options, page_size, 32),
+    AddrWidth = ale_util:keyword_get(Options, addr_width, 2),
+    Size = ale_util:keyword_get(Options, size, 1 bsl (8 * AddrWidth)),
+    WriteTimeout = ale_util:keyword_get(Options, write_timeout, 20),
+    Progress = ale_util:keyword_get(Options, progress, 0),
+    gen_server:call(ServerRef,
+                    {eeprom_write, MemAddr, Data, PageSize, AddrWidth, Size, WriteTimeout, Progress},
+                    infinity).
+
+%% @doc
+%% Read Len bytes from an I2C EEPROM or FRAM starting at memory address
+%% MemAddr. The addr_width, size and progress options are the same as
+%% for eeprom_write/4.
+%% @end
+-spec(eeprom_read(server_ref(), non_neg_integer(), len(), list()) -> data() | {error, reason}).
+eeprom_read(ServerRef, MemAddr, Len, Options) ->
+    AddrWidth = ale_util:keyword_get(Options, addr_width, 2),
+    Size = ale_util:keyword_get(Options, size, 1 bsl (8 * AddrWidth)),
+    Progress = ale_util:keyword_get(Options, progress, 0),
+    gen_server:call(ServerRef, {eeprom_read, MemAddr, Len, AddrWidth, Size, Progress}, infinity).
+
+%% @doc
+%% Run a write/read each time a GPIO like a sensor's data ready line
+%% has an edge. The port watches the GPIO and runs the write/read as
+%% soon as it sees the edge, so there's no round trip through Erlang.
+%% The caller is sent
+%% <code>{i2c_trigger, Server, Timestamp, Result}</code> for each edge
+%% where Timestamp is the CLOCK_MONOTONIC time of the edge in
+%% nanoseconds and Result is what write_read/3 would return. WriteData
+%% may be empty to only read.
+%%
+%% Options:
+%%    {edge, rising | falling | both}   Edge to trigger on (default rising)
+%%
+%% Starting a new trigger replaces the old one.
+%% @end
+-spec(start_trigger(server_ref(), non_neg_integer(), data(), len(), list()) -> ok | {error, reason}).
+start_trigger(ServerRef, Pin, WriteData, ReadLen, Options) ->
+    Edge = ale_util:keyword_get(Options, edge, rising),
+    gen_server:call(ServerRef, {start_trigger, self(), {Pin, Edge, WriteData, ReadLen}}).
+
+%% @doc
+%% Stop the trigger started by start_trigger/5.
+%% @end
+-spec(stop_trigger(server_ref()) -> ok).
+stop_trigger(ServerRef) ->
+    gen_server:call(ServerRef, stop_trigger).
+
+%% @doc
+%% Claim GPIOs for programs to use like a device's reset or ready line.
+%% Gpios is a list of {Name, Pin} or {Name, Pin, Initial} where Initial
+%% is 0 or 1 for an output (default 1) or input. This replaces the
+%% GPIOs from before.
+%% @end
+-spec(init_gpios(server_ref(), list()) -> ok | {error, reason}).
+init_gpios(ServerRef, Gpios) ->
+    gen_server:call(ServerRef, {init_gpios, [ale_util:gpio_spec(Gpio) || Gpio <- Gpios]}).
+
+%% @doc
+%% Load a program of I2C transfers, delays and GPIO operations for the
+%% port to run with run_program/3. See ale_script for the operations.
+%% A write_read is one combined transaction. Id is 0 to 31 and loading
+%% over an Id replaces its program.
+%% @end
+-spec(load_program(server_ref(), non_neg_integer(), list()) -> ok | {error, reason}).
+load_program(ServerRef, Id, Ops) ->
+    gen_server:call(ServerRef, {load_program, Id, Ops}).
+
+%% @doc
+%% Run a program loaded with load_program/3. Params are the bytes that
+%% the program's {param, N} entries refer to. Returns everything that
+%% the program read.
+%% @end
+-spec(run_program(server_ref(), non_neg_integer(), data() | [byte()]) -> data() | {error, reason}).
+run_program(ServerRef, Id, Params) ->
+    gen_server:call(ServerRef, {run_program, Id, iolist_to_binary(Params)}, infinity).
+
+%% @doc
+%% Unload a program.
+%% @end
+-spec(delete_program(server_ref(), non_neg_integer()) -> ok).
+delete_program(ServerRef, Id) ->
+    gen_server:call(ServerRef, {delete_program, Id}).
+
 %%%===================================================================
 %%% gen_server callbacks
 %%%===================================================================
@@ -86,7 +304,7 @@ init({Devname, Address}) ->
     Port = ale_util:open_port(["i2c",
                                "/dev/" ++ Devname,
                                integer_to_list(Address)]),
-    {ok, Port}.
+    {ok, #state{port=Port, pending=queue:new()}}.
 
 %%--------------------------------------------------------------------
 %% @private
@@ -102,17 +320,68 @@ init({Devname, Address}) ->
 %%                                   {stop, Reason, State}
 %% @end
 %%--------------------------------------------------------------------
-handle_call({write, Data}, _From, State) ->
-    Reply = call_port(State, write, Data),
-    {reply, Reply, State};
+handle_call({write, Data}, From, State) ->
+    {noreply, send_port(State, {call, From}, write, Data)};
+
+handle_call({read, Len}, From, State) ->
+    {noreply, send_port(State, {call, From}, read, Len)};
+
+handle_call({wrrd, Data, Len}, From, State) ->
+    {noreply, send_port(State, {call, From}, wrrd, {Data, Len})};
+
+handle_call({eeprom_write, MemAddr, Data, PageSize, AddrWidth, Size, WriteTimeout, Progress}, From, State) ->
+    {noreply, send_port(State, {call, From}, eeprom_write,
+                        {MemAddr, Data, PageSize, AddrWidth, Size, WriteTimeout, Progress})};
+
+handle_call({eeprom_read, MemAddr, Len, AddrWidth, Size, Progress}, From, State) ->
+    {noreply, send_port(State, {call, From}, eeprom_read, {MemAddr, Len, AddrWidth, Size, Progress})};
+
+handle_call({regmap_init, VolatileRegs}, From, State) ->
+    {noreply, send_port(State, {call, From}, regmap_init, VolatileRegs)};
 
-handle_call({read, Len}, _From, State) ->
-    Reply = call_port(State, read, Len),
-    {reply, Reply, State};
+handle_call({regmap_cache_only, Enable}, From, State) ->
+    {noreply, send_port(State, {call, From}, regmap_cache_only, Enable)};
 
-handle_call({wrrd, Data, Len}, _From, State) ->
-    Reply = call_port(State, wrrd, {Data, Len}),
-    {reply, Reply, State}.
+handle_call(regmap_stats, From, State) ->
+    {noreply, send_port(State, {call, From}, regmap_stats, [])};
+
+handle_call({reg_read, Reg, Count}, From, State) ->
+    {noreply, send_port(State, {call, From}, reg_read, {Reg, Count})};
+
+handle_call({reg_write, Reg, Data}, From, State) ->
+    {noreply, send_port(State, {call, From}, reg_write, {Reg, Data})};
+
+handle_call({reg_update_bits, Reg, Mask, Value}, From, State) ->
+    {noreply, send_port(State, {call, From}, reg_update_bits, {Reg, Mask, Value})};
+
+handle_call(reg_flush, From, State) ->
+    {noreply, send_port(State, {call, From}, reg_flush, [])};
+
+handle_call({start_trigger, Pid, Args}, From, State) ->
+    {noreply, send_port(State#state{trigger_pid=Pid}, {call, From}, start_trigger, Args)};
+
+handle_call(stop_trigger, From, State) ->
+    {noreply, send_port(State, {call, From}, stop_trigger, [])};
+
+handle_call({init_gpios, Gpios}, From, State) ->
+    %% The names are only used to compile programs, which go through the
+    %% port after this, so they can be updated before the reply.
+    {noreply, send_port(State#state{gpio_names=[Name || {Name, _Pin, _Initial} <- Gpios]},
+                        {call, From}, init_gpios, [{Pin, Initial} || {_Name, Pin, Initial} <- Gpios])};
+
+handle_call({load_program, Id, Ops}, From, #state{gpio_names=Names}=State) ->
+    case ale_script:compile(Ops, Names) of
+        {ok, PortOps} ->
+            {noreply, send_port(State, {call, From}, script_load, {Id, PortOps})};
+        Error ->
+            {reply, Error, State}
+    end;
+
+handle_call({run_program, Id, Params}, From, State) ->
+    {noreply, send_port(State, {call, From}, script_run, {Id, Params})};
+
+handle_call({delete_program, Id}, From, State) ->
+    {noreply, send_port(State, {call, From}, script_delete, Id)}.
 
 %%--------------------------------------------------------------------
 %% @private
@@ -125,6 +394,9 @@ handle_call({wrrd, Data, Len}, _From, State) ->
 %% @end
 %%--------------------------------------------------------------------
 
+handle_cast({wrrd_async, Pid, Ref, Data, Len}, State) ->
+    {noreply, send_port(State, {async, Pid, Ref}, wrrd, {Data, Len})};
+
 handle_cast(stop, State) ->
     {stop, normal, State}.
 
@@ -138,6 +410,31 @@ handle_cast(stop, State) ->
 %%                                   {stop, Reason, State}
 %% @end
 %%--------------------------------------------------------------------
+handle_info({Port, {data, <<?REPLY, Response/binary>>}}, #state{port=Port, pending=Pending}=State) ->
+    {{value, Requester}, NewPending} = queue:out(Pending),
+    reply(Requester, binary_to_term(Response)),
+    {noreply, State#state{pending=NewPending}};
+
+handle_info({Port, {data, <<?NOTIFICATION, Msg/binary>>}}, #state{port=Port, pending=Pending}=State) ->
+    case binary_to_term(Msg) of
+        {i2c_trigger, Timestamp, Result} ->
+            notify_trigger(State, {i2c_trigger, self(), Timestamp, Result});
+        {eeprom_progress, Done, Total} ->
+            %% Progress is for the request that's currently running. It
+            %% may have been given up on already.
+            case queue:peek(Pending) of
+                {value, Requester} ->
+                    requester_pid(Requester) ! {eeprom_progress, self(), Done, Total};
+                empty ->
+                    ok
+            end
+    end,
+    {noreply, State};
+
+handle_info({Port, {exit_status, _}}, #state{port=Port, pending=Pending}=State) ->
+    [reply(Requester, {error, port_exited}) || Requester <- queue:to_list(Pending)],
+    {stop, port_exited, State#state{pending=queue:new()}};
+
 handle_info(_Info, State) ->
     {noreply, State}.
 
@@ -170,9 +467,25 @@ code_change(_OldVsn, State, _Extra) ->
 %%% Internal functions
 %%%===================================================================
 
-call_port(Port, Command, Args) ->
+%% The port handles requests one at a time and in order, so replies are
+%% matched to requesters with a FIFO queue rather than blocking the
+%% server until each one comes back.
+send_port(#state{port=Port, pending=Pending}=State, Requester, Command, Args) ->
     Message = {Command, Args},
     erlang:send(Port, {self(), {command, term_to_binary(Message)}}),
-    receive
-        {_, {data, Response}} -> binary_to_term(Response)
-    end.
+    State#state{pending=queue:in(Requester, Pending)}.
+
+reply({call, From}, Reply) ->
+    gen_server:reply(From, Reply);
+reply({async, Pid, Ref}, Reply) ->
+    Pid ! {i2c_result, Ref, Reply}.
+
+notify_trigger(#state{trigger_pid=Pid}, Msg) when is_pid(Pid) ->
+    Pid ! Msg;
+notify_trigger(_State, _Msg) ->
+    ok.
+
+requester_pid({call, {Pid, _Tag}}) ->
+    Pid;
+requester_pid({async, Pid, _Ref}) ->
+    Pid.
@@ -0,0 +1,209 @@
+%%% @author Frank Hunleth <fhunleth@troodon-software.com>
+%%% @copyright (C) 2015, Frank Hunleth
+%%% @doc
+%%% This is the implementation of the matrix keypad interface module.
+%%% The port drives the rows, reads the columns and debounces the keys
+%%% itself, so only key down and up events go through Erlang.
+%%%
+%%% Rows are driven low one at a time and left high impedance the rest
+%%% of the time. Columns need pull-ups so that a pressed key reads low.
+%%% @end
+
+-module(keypad).
+
+-behaviour(gen_server).
+
+%% API
+-export([start_link/3, start_link/4, stop/1]).
+-export([pressed/1, subscribe/1]).
+
+%% gen_server callbacks
+-export([init/1, handle_call/3, handle_cast/2, handle_info/2,
+         terminate/2, code_change/3]).
+
+-define(SERVER, ?MODULE).
+-define(REPLY, 0).
+-define(NOTIFICATION, 1).
+
+-type pin() :: non_neg_integer().
+-type key() :: {non_neg_integer(), non_neg_integer()}.
+-type server_ref() :: atom() | {atom(), atom()} | pid().
+
+-record(state,
+        { port              :: port(),
+          notify_pid        :: pid() | undefined
+        }).
+
+%%%===================================================================
+%%% API
+%%%===================================================================
+
+%% @doc
+%% Starts the process to scan a keypad with the GPIOs in RowPins and
+%% ColumnPins. Up to 8 of each are supported. Keys are identified by
+%% {Row, Column} where each is the index into its list.
+%%
+%% Options:
+%%    {scan_interval_ms, N}    How often to scan all keys, at least 1
+%%                             (default 5)
+%%    {debounce_ms, N}         How long a key needs to read the same
+%%                             before it changes state (default 20)
+%% @end
+-spec(start_link(term(), [pin()], [pin()], list()) -> {ok, pid()} | {error, reason}).
+start_link(ServerName, RowPins, ColumnPins, Options) ->
+    gen_server:start_link(ServerName, ?MODULE, {RowPins, ColumnPins, Options}, []).
+
+-spec(start_link([pin()], [pin()], list()) -> {ok, pid()} | {error, reason}).
+start_link(RowPins, ColumnPins, Options) ->
+    gen_server:start_link(?MODULE, {RowPins, ColumnPins, Options}, []).
+
+%% @doc
+%% Stop the process and release it.
+%% @end
+-spec(stop(server_ref()) -> ok).
+stop(ServerRef) ->
+    gen_server:cast(ServerRef, stop).
+
+%% @doc
+%% Return the keys that are currently down.
+%% @end
+-spec(pressed(server_ref()) -> [key()]).
+pressed(ServerRef) ->
+    gen_server:call(ServerRef, pressed).
+
+%% @doc
+%% Have the caller sent <code>{keypad, Server, Key, down | up}</code>
+%% when a key is pressed or released.
+%% @end
+-spec(subscribe(server_ref()) -> ok).
+subscribe(ServerRef) ->
+    gen_server:call(ServerRef, {subscribe, self()}).
+
+%%%===================================================================
+%%% gen_server callbacks
+%%%===================================================================
+
+%%--------------------------------------------------------------------
+%% @private
+%% @doc
+%% Initializes the server
+%%
+%% @spec init(Args) -> {ok, State} |
+%%                     {ok, State, Timeout} |
+%%                     ignore |
+%%                     {stop, Reason}
+%% @end
+%%--------------------------------------------------------------------
+init({RowPins, ColumnPins, Options}) ->
+    ScanMs = ale_util:keyword_get(Options, scan_interval_ms, 5),
+    DebounceMs = ale_util:keyword_get(Options, debounce_ms, 20),
+    start_port(RowPins, ColumnPins, ScanMs, DebounceMs).
+
+%%--------------------------------------------------------------------
+%% @private
+%% @doc
+%% Handling call messages
+%%
+%% @spec handle_call(Request, From, State) ->
+%%                                   {reply, Reply, State} |
+%%                                   {reply, Reply, State, Timeout} |
+%%                                   {noreply, State} |
+%%                                   {noreply, State, Timeout} |
+%%                                   {stop, Reason, Reply, State} |
+%%                                   {stop, Reason, State}
+%% @end
+%%--------------------------------------------------------------------
+handle_call(pressed, _From, #state{port=Port}=State) ->
+    Reply = call_port(Port, pressed, []),
+    {reply, Reply, State};
+handle_call({subscribe, Pid}, _From, State) ->
+    {reply, ok, State#state{notify_pid=Pid}}.
+
+%%--------------------------------------------------------------------
+%% @private
+%% @doc
+%% Handling cast messages
+%%
+%% @spec handle_cast(Msg, State) -> {noreply, State} |
+%%                                  {noreply, State, Timeout} |
+%%                                  {stop, Reason, State}
+%% @end
+%%--------------------------------------------------------------------
+handle_cast(stop, State) ->
+    {stop, normal, State}.
+
+%%--------------------------------------------------------------------
+%% @private
+%% @doc
+%% Handling all non call/cast messages
+%%
+%% @spec handle_info(Info, State) -> {noreply, State} |
+%%                                   {noreply, State, Timeout} |
+%%                                   {stop, Reason, State}
+%% @end
+%%--------------------------------------------------------------------
+handle_info({Port, {data, <<?NOTIFICATION, Msg/binary>>}}, #state{port=Port}=State) ->
+    {keypad, Row, Column, Event} = binary_to_term(Msg),
+    notify(State#state.notify_pid, {keypad, self(), {Row, Column}, Event}),
+    {noreply, State};
+handle_info({Port, {exit_status, _}}, #state{port=Port}=State) ->
+    {stop, port_exited, State};
+handle_info(_Info, State) ->
+    {noreply, State}.
+
+%%--------------------------------------------------------------------
+%% @private
+%% @doc
+%% This function is called by a gen_server when it is about to
+%% terminate. It should be the opposite of Module:init/1 and do any
+%% necessary cleaning up. When it returns, the gen_server terminates
+%% with Reason. The return value is ignored.
+%%
+%% @spec terminate(Reason, State) -> void()
+%% @end
+%%--------------------------------------------------------------------
+terminate(_Reason, _State) ->
+    ok.
+
+%%--------------------------------------------------------------------
+%% @private
+%% @doc
+%% Convert process state when code is changed
+%%
+%% @spec code_change(OldVsn, State, Extra) -> {ok, NewState}
+%% @end
+%%--------------------------------------------------------------------
+code_change(_OldVsn, State, _Extra) ->
+    {ok, State}.
+
+%%%===================================================================
+%%% Internal functions
+%%%===================================================================
+
+start_port(RowPins, ColumnPins, ScanMs, DebounceMs)
+  when is_integer(ScanMs), ScanMs > 0, is_integer(DebounceMs), DebounceMs >= 0 ->
+    DebounceScans = (DebounceMs + ScanMs - 1) div ScanMs,
+    Port = ale_util:open_port(["keypad",
+                               pin_list(RowPins),
+                               pin_list(ColumnPins),
+                               integer_to_list(ScanMs * 1000),
+                               integer_to_list(DebounceScans)]),
+    {ok, #state{port=Port}};
+start_port(_RowPins, _ColumnPins, _ScanMs, _DebounceMs) ->
+    {stop, invalid_timing}.
+
+pin_list(Pins) ->
+    string:join([integer_to_list(Pin) || Pin <- Pins], ",").
+
+notify(Pid, Msg) when is_pid(Pid) ->
+    Pid ! Msg;
+notify(undefined, _Msg) ->
+    ok.
+
+call_port(Port, Command, Args) ->
+    Message = {Command, Args},
+    erlang:send(Port, {self(), {command, term_to_binary(Message)}}),
+    receive
+        {Port, {data, <<?REPLY, Response/binary>>}} -> binary_to_term(Response);
+        {Port, {exit_status, _}} -> exit(port_exited)
+    end.
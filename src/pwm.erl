@@ -0,0 +1,208 @@
+%%% @author Frank Hunleth <fhunleth@troodon-software.com>
+%%% @copyright (C) 2015, Frank Hunleth
+%%% @doc
+%%% This is the implementation of the hardware PWM interface module.
+%%% One server handles any number of channels on a /sys/class/pwm chip.
+%%% @end
+
+-module(pwm).
+
+-behaviour(gen_server).
+
+%% API
+-export([start_link/2, start_link/3, stop/1]).
+-export([configure/4, set_duty_cycle/3, set_duty_cycles/2,
+         enable/2, disable/2]).
+
+%% gen_server callbacks
+-export([init/1, handle_call/3, handle_cast/2, handle_info/2,
+         terminate/2, code_change/3]).
+
+-define(SERVER, ?MODULE).
+-define(REPLY, 0).
+
+-type chip() :: non_neg_integer().
+-type channel() :: non_neg_integer().
+-type server_ref() :: atom() | {atom(), atom()} | pid().
+
+-record(state,
+        { port              :: port()
+        }).
+
+%%%===================================================================
+%%% API
+%%%===================================================================
+
+%% @doc
+%% Starts the process and exports the channels on pwmchip Chip.
+%%
+%% Options:
+%%    {channels, [N]}          Channels to use (default [0])
+%%    {sysfs_root, Path}       Where sysfs is (default "/sys"). This can
+%%                             be a directory with files laid out like
+%%                             class/pwm/pwmchipN/pwmM/period for testing.
+%% @end
+-spec(start_link(term(), chip(), list()) -> {ok, pid()} | {error, reason}).
+start_link(ServerName, Chip, Options) ->
+    gen_server:start_link(ServerName, ?MODULE, {Chip, Options}, []).
+
+-spec(start_link(chip(), list()) -> {ok, pid()} | {error, reason}).
+start_link(Chip, Options) ->
+    gen_server:start_link(?MODULE, {Chip, Options}, []).
+
+%% @doc
+%% Stop the process and release it.
+%% @end
+-spec(stop(server_ref()) -> ok).
+stop(ServerRef) ->
+    gen_server:cast(ServerRef, stop).
+
+%% @doc
+%% Set the period and duty cycle of a channel in nanoseconds. They're
+%% written in whichever order keeps the duty cycle within the period.
+%% @end
+-spec(configure(server_ref(), channel(), non_neg_integer(), non_neg_integer()) -> ok | {error, reason}).
+configure(ServerRef, Channel, PeriodNs, DutyNs) ->
+    gen_server:call(ServerRef, {configure, {Channel, PeriodNs, DutyNs}}).
+
+%% @doc
+%% Set the duty cycle of a channel in nanoseconds.
+%% @end
+-spec(set_duty_cycle(server_ref(), channel(), non_neg_integer()) -> ok | {error, reason}).
+set_duty_cycle(ServerRef, Channel, DutyNs) ->
+    set_duty_cycles(ServerRef, [{Channel, DutyNs}]).
+
+%% @doc
+%% Set the duty cycles of several channels with one request to the
+%% port, e.g. for all of a motor controller's phases. The channels are
+%% updated in list order and the first one that fails stops the rest.
+%% @end
+-spec(set_duty_cycles(server_ref(), [{channel(), non_neg_integer()}]) -> ok | {error, reason}).
+set_duty_cycles(ServerRef, Duties) ->
+    gen_server:call(ServerRef, {set_duty, Duties}).
+
+%% @doc
+%% Start a channel's output.
+%% @end
+-spec(enable(server_ref(), channel()) -> ok | {error, reason}).
+enable(ServerRef, Channel) ->
+    gen_server:call(ServerRef, {enable, {Channel, true}}).
+
+%% @doc
+%% Stop a channel's output.
+%% @end
+-spec(disable(server_ref(), channel()) -> ok | {error, reason}).
+disable(ServerRef, Channel) ->
+    gen_server:call(ServerRef, {enable, {Channel, false}}).
+
+%%%===================================================================
+%%% gen_server callbacks
+%%%===================================================================
+
+%%--------------------------------------------------------------------
+%% @private
+%% @doc
+%% Initializes the server
+%%
+%% @spec init(Args) -> {ok, State} |
+%%                     {ok, State, Timeout} |
+%%                     ignore |
+%%                     {stop, Reason}
+%% @end
+%%--------------------------------------------------------------------
+init({Chip, Options}) ->
+    Channels = ale_util:keyword_get(Options, channels, [0]),
+    SysfsRoot = ale_util:keyword_get(Options, sysfs_root, "/sys"),
+    ChipPath = SysfsRoot ++ "/class/pwm/pwmchip" ++ integer_to_list(Chip),
+    Port = ale_util:open_port(["pwm", ChipPath
+                               | [integer_to_list(Channel) || Channel <- Channels]]),
+    {ok, #state{port=Port}}.
+
+%%--------------------------------------------------------------------
+%% @private
+%% @doc
+%% Handling call messages
+%%
+%% @spec handle_call(Request, From, State) ->
+%%                                   {reply, Reply, State} |
+%%                                   {reply, Reply, State, Timeout} |
+%%                                   {noreply, State} |
+%%                                   {noreply, State, Timeout} |
+%%                                   {stop, Reason, Reply, State} |
+%%                                   {stop, Reason, State}
+%% @end
+%%--------------------------------------------------------------------
+handle_call({configure, Args}, _From, #state{port=Port}=State) ->
+    Reply = call_port(Port, configure, Args),
+    {reply, Reply, State};
+handle_call({set_duty, Duties}, _From, #state{port=Port}=State) ->
+    Reply = call_port(Port, set_duty, Duties),
+    {reply, Reply, State};
+handle_call({enable, Args}, _From, #state{port=Port}=State) ->
+    Reply = call_port(Port, enable, Args),
+    {reply, Reply, State}.
+
+%%--------------------------------------------------------------------
+%% @private
+%% @doc
+%% Handling cast messages
+%%
+%% @spec handle_cast(Msg, State) -> {noreply, State} |
+%%                                  {noreply, State, Timeout} |
+%%                                  {stop, Reason, State}
+%% @end
+%%--------------------------------------------------------------------
+handle_cast(stop, State) ->
+    {stop, normal, State}.
+
+%%--------------------------------------------------------------------
+%% @private
+%% @doc
+%% Handling all non call/cast messages
+%%
+%% @spec handle_info(Info, State) -> {noreply, State} |
+%%                                   {noreply, State, Timeout} |
+%%                                   {stop, Reason, State}
+%% @end
+%%--------------------------------------------------------------------
+handle_info({Port, {exit_status, _}}, #state{port=Port}=State) ->
+    {stop, port_exited, State};
+handle_info(_Info, State) ->
+    {noreply, State}.
+
+%%--------------------------------------------------------------------
+%% @private
+%% @doc
+%% This function is called by a gen_server when it is about to
+%% terminate. It should be the opposite of Module:init/1 and do any
+%% necessary cleaning up. When it returns, the gen_server terminates
+%% with Reason. The return value is ignored.
+%%
+%% @spec terminate(Reason, State) -> void()
+%% @end
+%%--------------------------------------------------------------------
+terminate(_Reason, _State) ->
+    ok.
+
+%%--------------------------------------------------------------------
+%% @private
+%% @doc
+%% Convert process state when code is changed
+%%
+%% @spec code_change(OldVsn, State, Extra) -> {ok, NewState}
+%% @end
+%%--------------------------------------------------------------------
+code_change(_OldVsn, State, _Extra) ->
+    {ok, State}.
+
+%%%===================================================================
+%%% Internal functions
+%%%===================================================================
+
+call_port(Port, Command, Args) ->
+    Message = {Command, Args},
+    erlang:send(Port, {self(), {command, term_to_binary(Message)}}),
+    receive
+        {Port, {data, <<?REPLY, Response/binary>>}} -> binary_to_term(Response);
+        {Port, {exit_status, _}} -> exit(port_exited)
+    end.
@@ -12,24 +12,91 @@
 
 %% API
 -export([start_link/2, start_link/3, stop/1]).
--export([transfer/2]).
+-export([transfer/2, transfer/3, write/2, write/3, read/2, read/3,
+         transfer_segments/2]).
+-export([start_stream/3, stop_stream/1]).
+-export([gpio_write/3]).
+-export([load_program/3, run_program/3, delete_program/2]).
+-export([start_trigger/4, stop_trigger/1]).
+-export([flash_id/1, flash_read/4, flash_program/4, flash_erase/4,
+         flash_erase_chip/1]).
 
 %% gen_server callbacks
 -export([init/1, handle_call/3, handle_cast/2, handle_info/2,
 	 terminate/2, code_change/3]).
 
 -define(SERVER, ?MODULE).
+-define(REPLY, 0).
+-define(NOTIFICATION, 1).
+
+%% Mode flags from linux/spi/spi.h
+-define(SPI_CS_HIGH, 16#04).
+-define(SPI_LSB_FIRST, 16#08).
+-define(SPI_3WIRE, 16#10).
+-define(SPI_NO_CS, 16#40).
+-define(SPI_TX_DUAL, 16#100).
+-define(SPI_TX_QUAD, 16#200).
+-define(SPI_RX_DUAL, 16#400).
+-define(SPI_RX_QUAD, 16#800).
+
+%% Flash reads and programs are sent to the port in frames of this size
+-define(FLASH_FRAME_SIZE, 524288).
+-define(FLASH_SECTOR_SIZE, 4096).
 
 -type data() :: binary().
+-type len() :: pos_integer().
+-type bus_width() :: 1 | 2 | 4.
+-type transfer_options() :: #{speed_hz => pos_integer(),
+                               bits_per_word => pos_integer(),
+                               delay_us => non_neg_integer(),
+                               mode => 0..3,
+                               tx_nbits => bus_width(),
+                               rx_nbits => bus_width()}.
+-type segment_option() :: {cs_change, boolean()} | {delay_us, non_neg_integer()} |
+                          {speed_hz, pos_integer()} | {bits_per_word, pos_integer()} |
+                          {tx_nbits, bus_width()} | {rx_nbits, bus_width()}.
+-type segment() :: data() | {write, data()} | {read, len()} |
+                   {data() | {write, data()} | {read, len()}, [segment_option()]} |
+                   {gpio, atom(), 0 | 1}.
 -type devname() :: string().
 -type server_ref() :: atom() | {atom(), atom()} | pid().
 
+-record(state,
+        { port              :: port(),
+          stream_pid        :: pid() | undefined,
+          trigger_pid       :: pid() | undefined,
+          gpio_names = []   :: [atom()]
+        }).
+
 %%%===================================================================
 %%% API
 %%%===================================================================
 
 %% @doc
 %% Starts the process and initialize the device.
+%%
+%% Options:
+%%    {mode, 0..3}             SPI clock polarity and phase (default 0)
+%%    {bits_per_word, N}       Word size (default 8)
+%%    {speed_hz, Hz}           Clock rate (default 1000000)
+%%    {delay_us, Us}           Delay after each transfer (default 10)
+%%    {lsb_first, true}        Send the least significant bit first
+%%    {cs_high, true}          Chip select is active high
+%%    {three_wire, true}       MOSI and MISO share one wire
+%%    {no_cs, true}            Don't drive chip select
+%%    {tx_bus_width, 1|2|4}    Allow dual or quad writes (default 1)
+%%    {rx_bus_width, 1|2|4}    Allow dual or quad reads (default 1)
+%%    {gpios, [{Name, Pin} | {Name, Pin, Initial}]}
+%%                             GPIOs that transfer_segments/2 and
+%%                             programs can drive like a chip select or
+%%                             data/command line. They're outputs and
+%%                             start high unless Initial is 0. Use an
+%%                             Initial of input for a GPIO that programs
+%%                             wait on like a busy line.
+%%
+%% The bus widths only say what the device and wiring support. Use the
+%% tx_nbits and rx_nbits transfer options to pick the width of a
+%% transfer. Not all SPI controllers support all of these options.
 %% @end
 -spec(start_link(term(), devname(), list()) -> {ok, pid()} | {error, reason}).
 start_link(ServerName, Devname, SpiOptions) ->
@@ -48,11 +115,246 @@ stop(ServerRef) ->
 
 %% @doc
 %% Transfer data trough the SPI bus.
+%%
+%% Transfers can be up to about 1 MB. Ones longer than the spidev
+%% bufsiz module parameter (4096 bytes by default) are split up and
+%% chip select is released between the pieces. Load spidev with a larger
+%% bufsiz if the device needs the whole transfer in one chip select.
 %% @end
 -spec(transfer(server_ref(), data()) -> data() | {error, reason}).
 transfer(ServerRef, Data) ->
     gen_server:call(ServerRef, {transfer, Data}).
 
+%% @doc
+%% Transfer data with settings that only apply to this transfer. This
+%% lets one handle talk to devices on the same chip select or reuse it
+%% for a slow and a fast phase of a protocol. Any of speed_hz,
+%% bits_per_word, delay_us, mode (only the clock polarity and phase),
+%% tx_nbits and rx_nbits may be given. Settings that aren't given are
+%% the ones passed to start_link.
+%% @end
+-spec(transfer(server_ref(), data(), transfer_options()) -> data() | {error, reason}).
+transfer(ServerRef, Data, Options) ->
+    gen_server:call(ServerRef, {transfer, {Data, port_overrides(Options)}}).
+
+%% @doc
+%% Send data without reading anything back. This avoids returning
+%% unused receive data for large one-way transfers like display
+%% updates.
+%% @end
+-spec(write(server_ref(), data()) -> ok | {error, reason}).
+write(ServerRef, Data) ->
+    gen_server:call(ServerRef, {write, Data}).
+
+%% @doc
+%% Send data using settings that only apply to this write. See transfer/3.
+%% @end
+-spec(write(server_ref(), data(), transfer_options()) -> ok | {error, reason}).
+write(ServerRef, Data, Options) ->
+    gen_server:call(ServerRef, {write, {Data, port_overrides(Options)}}).
+
+%% @doc
+%% Read Len bytes without sending any data. The device will see all
+%% zeros on MOSI.
+%% @end
+-spec(read(server_ref(), len()) -> data() | {error, reason}).
+read(ServerRef, Len) ->
+    gen_server:call(ServerRef, {read, Len}).
+
+%% @doc
+%% Read data using settings that only apply to this read. See transfer/3.
+%% @end
+-spec(read(server_ref(), len(), transfer_options()) -> data() | {error, reason}).
+read(ServerRef, Len, Options) ->
+    gen_server:call(ServerRef, {read, {Len, port_overrides(Options)}}).
+
+%% @doc
+%% Run a list of segments as one SPI message so that chip select stays
+%% asserted from the first to the last. This is useful for devices that
+%% expect a command, address and data phase in one transaction.
+%%
+%% A segment is either a binary for a full duplex transfer, {write, Data}
+%% to only send, or {read, Len} to only receive. Any of these may be
+%% paired with a list of options that apply to just that segment:
+%%    {cs_change, true}     Release chip select after the segment
+%%    {delay_us, Us}        Delay after the segment
+%%    {speed_hz, Hz}        Clock rate for the segment
+%%    {bits_per_word, N}    Word size for the segment
+%%    {tx_nbits, 1|2|4}     Number of data lines for sending
+%%    {rx_nbits, 1|2|4}     Number of data lines for receiving
+%%
+%% Returns the received data for each segment that reads in order. The
+%% whole message needs to fit in spidev's bufsiz (4096 bytes by default).
+%%
+%% The list may also have {gpio, Name, 0 | 1} entries to set one of the
+%% GPIOs from the gpios start option before the segments that follow it.
+%% The port runs the whole list, so the GPIO changes are microseconds
+%% apart from the transfers. For example, for a display with a
+%% data/command line on a GPIO chip select:
+%%
+%%    [{gpio, cs, 0}, {gpio, dc, 0}, {write, Command},
+%%     {gpio, dc, 1}, {write, Pixels}, {gpio, cs, 1}]
+%%
+%% The spidev chip select changes between the segments on either side of
+%% a GPIO write, so use the no_cs option when a GPIO is the chip select.
+%% @end
+-spec(transfer_segments(server_ref(), [segment()]) -> [data()] | {error, reason}).
+transfer_segments(ServerRef, Segments) ->
+    gen_server:call(ServerRef, {transfer_segments, [port_segment(Segment) || Segment <- Segments]}).
+
+%% @doc
+%% Set one of the GPIOs from the gpios start option.
+%% @end
+-spec(gpio_write(server_ref(), atom(), 0 | 1) -> ok | {error, reason}).
+gpio_write(ServerRef, Name, Value) ->
+    case transfer_segments(ServerRef, [{gpio, Name, Value}]) of
+        [] -> ok;
+        Error -> Error
+    end.
+
+%% @doc
+%% Load a program of SPI transfers, delays and GPIO operations for the
+%% port to run with run_program/3. See ale_script for the operations.
+%% Reads and writes are in one transfer with chip select held between
+%% them. Id is 0 to 31 and loading over an Id replaces its program.
+%% @end
+-spec(load_program(server_ref(), non_neg_integer(), list()) -> ok | {error, reason}).
+load_program(ServerRef, Id, Ops) ->
+    gen_server:call(ServerRef, {load_program, Id, Ops}).
+
+%% @doc
+%% Run a program loaded with load_program/3. Params are the bytes that
+%% the program's {param, N} entries refer to. Returns everything that
+%% the program read.
+%% @end
+-spec(run_program(server_ref(), non_neg_integer(), data() | [byte()]) -> data() | {error, reason}).
+run_program(ServerRef, Id, Params) ->
+    gen_server:call(ServerRef, {run_program, Id, iolist_to_binary(Params)}, infinity).
+
+%% @doc
+%% Unload a program.
+%% @end
+-spec(delete_program(server_ref(), non_neg_integer()) -> ok).
+delete_program(ServerRef, Id) ->
+    gen_server:call(ServerRef, {delete_program, Id}).
+
+%% @doc
+%% Start sampling a device like an ADC in the port. TxTemplate is sent
+%% for every sample and what's received is collected. The caller is sent
+%% <code>{spi_samples, Server, Timestamp, Overruns, Samples}</code> every
+%% chunk_size samples where Samples is the received data packed back to
+%% back, Timestamp is the CLOCK_MONOTONIC time in nanoseconds of the
+%% first sample and Overruns is the total number of samples missed since
+%% the stream started.
+%%
+%% Options:
+%%    {rate_hz, Hz}          Samples per second or 0 to sample as fast as
+%%                           possible (default 1000)
+%%    {chunk_size, N}        Samples per message (default 100)
+%%
+%% Starting a new stream replaces the old one.
+%% @end
+-spec(start_stream(server_ref(), data(), list()) -> ok | {error, reason}).
+start_stream(ServerRef, TxTemplate, Options) ->
+    RateHz = ale_util:keyword_get(Options, rate_hz, 1000),
+    ChunkSize = ale_util:keyword_get(Options, chunk_size, 100),
+    gen_server:call(ServerRef, {start_stream, self(), TxTemplate, RateHz, ChunkSize}).
+
+%% @doc
+%% Stop sampling. Samples that were taken, but not sent yet, are sent
+%% before this returns.
+%% @end
+-spec(stop_stream(server_ref()) -> ok).
+stop_stream(ServerRef) ->
+    gen_server:call(ServerRef, stop_stream).
+
+%% @doc
+%% Identify a SPI NOR flash chip. Returns the JEDEC manufacturer ID, the
+%% 16-bit device ID and the size in bytes. The size comes from the chip's
+%% SFDP table if it has one and is undefined if it can't be determined.
+%%
+%% All of the flash functions run the flash commands in the port, so
+%% they're much quicker than building them out of transfer/2 calls. If
+%% the device name is the absolute path of a regular file, the port
+%% simulates a flash chip that is the size of the file. This is useful
+%% for trying out flash code without hardware.
+%% @end
+-spec(flash_id(server_ref()) -> {non_neg_integer(), non_neg_integer(), pos_integer() | undefined} | {error, reason}).
+flash_id(ServerRef) ->
+    gen_server:call(ServerRef, flash_id).
+
+%% @doc
+%% Read Len bytes from a SPI NOR flash starting at Addr. This uses the
+%% fast read commands.
+%%
+%% Options:
+%%    {addr_width, 3|4}      Address bytes (default 3)
+%%    {width, 1|2|4}         Data lines to read with. 2 and 4 use the
+%%                           dual and quad output read commands and
+%%                           need the rx_bus_width start option (default 1)
+%% @end
+-spec(flash_read(server_ref(), non_neg_integer(), len(), list()) -> data() | {error, reason}).
+flash_read(ServerRef, Addr, Len, Options) ->
+    AddrWidth = ale_util:keyword_get(Options, addr_width, 3),
+    Width = ale_util:keyword_get(Options, width, 1),
+    flash_read(ServerRef, Addr, Len, AddrWidth, Width, []).
+
+%% @doc
+%% Program Data into a SPI NOR flash starting at Addr. The area must have
+%% been erased. Data may start anywhere in a page and be any length. The
+%% port splits it into page programs and polls the status register for
+%% each one to finish. The addr_width option is the same as for
+%% flash_read/4.
+%% @end
+-spec(flash_program(server_ref(), non_neg_integer(), data(), list()) -> ok | {error, reason}).
+flash_program(ServerRef, Addr, Data, Options) ->
+    AddrWidth = ale_util:keyword_get(Options, addr_width, 3),
+    flash_program(ServerRef, Addr, Data, AddrWidth, ok).
+
+%% @doc
+%% Erase Len bytes of a SPI NOR flash starting at Addr. Both must be
+%% multiples of the 4 KB sector size. 64 KB block erases are used where
+%% possible since they're much faster than erasing each sector. The
+%% addr_width option is the same as for flash_read/4.
+%% @end
+-spec(flash_erase(server_ref(), non_neg_integer(), pos_integer(), list()) -> ok | {error, reason}).
+flash_erase(ServerRef, Addr, Len, Options)
+  when Addr rem ?FLASH_SECTOR_SIZE =:= 0, Len > 0, Len rem ?FLASH_SECTOR_SIZE =:= 0 ->
+    AddrWidth = ale_util:keyword_get(Options, addr_width, 3),
+    gen_server:call(ServerRef, {flash_erase, {Addr, Len, AddrWidth}}, infinity).
+
+%% @doc
+%% Erase a whole SPI NOR flash. This can take minutes on large parts.
+%% @end
+-spec(flash_erase_chip(server_ref()) -> ok | {error, reason}).
+flash_erase_chip(ServerRef) ->
+    gen_server:call(ServerRef, flash_erase_chip, infinity).
+
+%% @doc
+%% Run a transfer each time a GPIO like a data ready line has an edge.
+%% The port watches the GPIO and sends Data as soon as it sees the edge,
+%% so there's no round trip through Erlang. The caller is sent
+%% <code>{spi_trigger, Server, Timestamp, Result}</code> for each edge
+%% where Timestamp is the CLOCK_MONOTONIC time of the edge in
+%% nanoseconds and Result is what transfer/2 would return.
+%%
+%% Options:
+%%    {edge, rising | falling | both}   Edge to trigger on (default rising)
+%%
+%% Starting a new trigger replaces the old one.
+%% @end
+-spec(start_trigger(server_ref(), non_neg_integer(), data(), list()) -> ok | {error, reason}).
+start_trigger(ServerRef, Pin, Data, Options) ->
+    Edge = ale_util:keyword_get(Options, edge, rising),
+    gen_server:call(ServerRef, {start_trigger, self(), {Pin, Edge, Data}}).
+
+%% @doc
+%% Stop the trigger started by start_trigger/4.
+%% @end
+-spec(stop_trigger(server_ref()) -> ok).
+stop_trigger(ServerRef) ->
+    gen_server:call(ServerRef, stop_trigger).
+
 %%%===================================================================
 %%% gen_server callbacks
 %%%===================================================================
@@ -69,18 +371,25 @@ transfer(ServerRef, Data) ->
 %% @end
 %%--------------------------------------------------------------------
 init({Devname, SpiOptions}) ->
-    Mode = keyword_get(SpiOptions, mode, 0),
-    BitsPerWord = keyword_get(SpiOptions, bits_per_word, 8),
-    SpeedHz = keyword_get(SpiOptions, speed_hz, 1000000),
-    DelayUs = keyword_get(SpiOptions, delay_us, 10),
+    Mode = ale_util:keyword_get(SpiOptions, mode, 0) bor mode_flags(SpiOptions),
+    BitsPerWord = ale_util:keyword_get(SpiOptions, bits_per_word, 8),
+    SpeedHz = ale_util:keyword_get(SpiOptions, speed_hz, 1000000),
+    DelayUs = ale_util:keyword_get(SpiOptions, delay_us, 10),
 
     Port = ale_util:open_port(["spi",
-                               "/dev/" ++ Devname,
+                               devpath(Devname),
                                integer_to_list(Mode),
                                integer_to_list(BitsPerWord),
                                integer_to_list(SpeedHz),
                                integer_to_list(DelayUs)]),
-    {ok, Port}.
+    Gpios = [ale_util:gpio_spec(Gpio) || Gpio <- ale_util:keyword_get(SpiOptions, gpios, [])],
+    case call_port(Port, init_gpios, [{Pin, Initial} || {_Name, Pin, Initial} <- Gpios]) of
+        ok ->
+            {ok, #state{port=Port, gpio_names=[Name || {Name, _Pin, _Initial} <- Gpios]}};
+        {error, Reason} ->
+            port_close(Port),
+            {stop, Reason}
+    end.
 
 %%--------------------------------------------------------------------
 %% @private
@@ -96,8 +405,65 @@ init({Devname, SpiOptions}) ->
 %%                                   {stop, Reason, State}
 %% @end
 %%--------------------------------------------------------------------
-handle_call({transfer, Data}, _From, State) ->
-    Reply = call_port(State, transfer, Data),
+handle_call({transfer, Data}, _From, #state{port=Port}=State) ->
+    Reply = call_port(Port, transfer, Data),
+    {reply, Reply, State};
+handle_call({write, Data}, _From, #state{port=Port}=State) ->
+    Reply = call_port(Port, write, Data),
+    {reply, Reply, State};
+handle_call({read, Len}, _From, #state{port=Port}=State) ->
+    Reply = call_port(Port, read, Len),
+    {reply, Reply, State};
+handle_call({transfer_segments, Segments}, _From, #state{port=Port, gpio_names=Names}=State) ->
+    Reply = try [port_gpio_write(Segment, Names) || Segment <- Segments] of
+                PortSegments -> call_port(Port, transfer_segments, PortSegments)
+            catch
+                throw:Error -> Error
+            end,
+    {reply, Reply, State};
+handle_call({start_stream, Pid, TxTemplate, RateHz, ChunkSize}, _From, #state{port=Port}=State) ->
+    case call_port(Port, start_stream, {TxTemplate, RateHz, ChunkSize}) of
+        ok -> {reply, ok, State#state{stream_pid=Pid}};
+        Error -> {reply, Error, State}
+    end;
+handle_call(stop_stream, _From, #state{port=Port}=State) ->
+    %% The port sends the last samples before its reply, so pass them
+    %% on now to have them arrive before the caller gets ok.
+    Reply = call_port(Port, stop_stream, []),
+    flush_notifications(State),
+    {reply, Reply, State};
+handle_call({start_trigger, Pid, Args}, _From, #state{port=Port}=State) ->
+    Reply = call_port(Port, start_trigger, Args),
+    {reply, Reply, State#state{trigger_pid=Pid}};
+handle_call(stop_trigger, _From, #state{port=Port}=State) ->
+    Reply = call_port(Port, stop_trigger, []),
+    {reply, Reply, State};
+handle_call(flash_id, _From, #state{port=Port}=State) ->
+    Reply = call_port(Port, flash_id, []),
+    {reply, Reply, State};
+handle_call({flash_read, Args}, _From, #state{port=Port}=State) ->
+    Reply = call_port(Port, flash_read, Args),
+    {reply, Reply, State};
+handle_call({flash_program, Args}, _From, #state{port=Port}=State) ->
+    Reply = call_port(Port, flash_program, Args),
+    {reply, Reply, State};
+handle_call({flash_erase, Args}, _From, #state{port=Port}=State) ->
+    Reply = call_port(Port, flash_erase, Args),
+    {reply, Reply, State};
+handle_call(flash_erase_chip, _From, #state{port=Port}=State) ->
+    Reply = call_port(Port, flash_erase_chip, []),
+    {reply, Reply, State};
+handle_call({load_program, Id, Ops}, _From, #state{port=Port, gpio_names=Names}=State) ->
+    Reply = case ale_script:compile(Ops, Names) of
+                {ok, PortOps} -> call_port(Port, script_load, {Id, PortOps});
+                Error -> Error
+            end,
+    {reply, Reply, State};
+handle_call({run_program, Id, Params}, _From, #state{port=Port}=State) ->
+    Reply = call_port(Port, script_run, {Id, Params}),
+    {reply, Reply, State};
+handle_call({delete_program, Id}, _From, #state{port=Port}=State) ->
+    Reply = call_port(Port, script_delete, Id),
     {reply, Reply, State}.
 
 %%--------------------------------------------------------------------
@@ -124,6 +490,9 @@ handle_cast(stop, State) ->
 %%                                   {stop, Reason, State}
 %% @end
 %%--------------------------------------------------------------------
+handle_info({Port, {data, <<?NOTIFICATION, Msg/binary>>}}, #state{port=Port}=State) ->
+    handle_notification(binary_to_term(Msg), State),
+    {noreply, State};
 handle_info(_Info, State) ->
     {noreply, State}.
 
@@ -155,16 +524,116 @@ code_change(_OldVsn, State, _Extra) ->
 %%%===================================================================
 %%% Internal functions
 %%%===================================================================
-keyword_get(Keywords, Key, Default) ->
-    case lists:keyfind(Key, 1, Keywords) of
-        {Key, Value} -> Value;
-        false -> Default
+
+notify(Pid, Msg) when is_pid(Pid) ->
+    Pid ! Msg;
+notify(undefined, _Msg) ->
+    ok.
+
+%% Absolute paths are passed through so that a file can stand in for
+%% a flash chip.
+devpath([$/ | _] = Path) -> Path;
+devpath(Devname) -> "/dev/" ++ Devname.
+
+flash_read(_ServerRef, _Addr, 0, _AddrWidth, _Width, Acc) ->
+    list_to_binary(lists:reverse(Acc));
+flash_read(ServerRef, Addr, Len, AddrWidth, Width, Acc) ->
+    Chunk = min(Len, ?FLASH_FRAME_SIZE),
+    case gen_server:call(ServerRef, {flash_read, {Addr, Chunk, AddrWidth, Width}}, infinity) of
+        Data when is_binary(Data) ->
+            flash_read(ServerRef, Addr + Chunk, Len - Chunk, AddrWidth, Width, [Data | Acc]);
+        Error ->
+            Error
     end.
 
+flash_program(_ServerRef, _Addr, <<>>, _AddrWidth, ok) ->
+    ok;
+flash_program(ServerRef, Addr, Data, AddrWidth, ok) when byte_size(Data) > ?FLASH_FRAME_SIZE ->
+    <<Frame:?FLASH_FRAME_SIZE/binary, Rest/binary>> = Data,
+    Reply = gen_server:call(ServerRef, {flash_program, {Addr, Frame, AddrWidth}}, infinity),
+    flash_program(ServerRef, Addr + ?FLASH_FRAME_SIZE, Rest, AddrWidth, Reply);
+flash_program(ServerRef, Addr, Data, AddrWidth, ok) ->
+    gen_server:call(ServerRef, {flash_program, {Addr, Data, AddrWidth}}, infinity);
+flash_program(_ServerRef, _Addr, _Data, _AddrWidth, Error) ->
+    Error.
+
+mode_flags(SpiOptions) ->
+    Flags = [Flag || {Option, Flag} <- [{lsb_first, ?SPI_LSB_FIRST},
+                                        {cs_high, ?SPI_CS_HIGH},
+                                        {three_wire, ?SPI_3WIRE},
+                                        {no_cs, ?SPI_NO_CS}],
+                     ale_util:keyword_get(SpiOptions, Option, false) =:= true],
+    TxWidth = ale_util:keyword_get(SpiOptions, tx_bus_width, 1),
+    RxWidth = ale_util:keyword_get(SpiOptions, rx_bus_width, 1),
+    lists:foldl(fun(Flag, Acc) -> Flag bor Acc end, 0, Flags)
+        bor bus_width_flags(TxWidth, ?SPI_TX_DUAL, ?SPI_TX_QUAD)
+        bor bus_width_flags(RxWidth, ?SPI_RX_DUAL, ?SPI_RX_QUAD).
+
+bus_width_flags(1, _Dual, _Quad) -> 0;
+bus_width_flags(2, Dual, _Quad) -> Dual;
+bus_width_flags(4, _Dual, Quad) -> Quad.
+
+%% The port takes overrides as {SpeedHz, BitsPerWord, DelayUs, Mode, TxNbits, RxNbits}.
+%% -1 means to use the setting from start_link.
+port_overrides(Options) ->
+    {maps:get(speed_hz, Options, -1),
+     maps:get(bits_per_word, Options, -1),
+     maps:get(delay_us, Options, -1),
+     maps:get(mode, Options, -1),
+     maps:get(tx_nbits, Options, -1),
+     maps:get(rx_nbits, Options, -1)}.
+
+%% The port takes GPIO writes as {Index, Value} where Index is the
+%% GPIO's position in the gpios start option.
+port_gpio_write({gpio, Name, Value}, Names) ->
+    {gpio_index(Name, Names, 0), Value};
+port_gpio_write(Segment, _Names) ->
+    Segment.
+
+gpio_index(Name, [Name | _], N) -> N;
+gpio_index(Name, [_ | Rest], N) -> gpio_index(Name, Rest, N + 1);
+gpio_index(Name, [], _N) -> throw({error, {unknown_gpio, Name}}).
+
+%% The port takes segments as {TxData, RxLen, CsChange, DelayUs, SpeedHz,
+%% BitsPerWord, TxNbits, RxNbits}. -1 means to use the setting from start_link.
+port_segment({gpio, _Name, _Value} = GpioWrite) ->
+    GpioWrite;
+port_segment({Segment, Options}) when is_list(Options) ->
+    {TxData, RxLen} = segment_data(Segment),
+    {TxData, RxLen,
+     case ale_util:keyword_get(Options, cs_change, false) of true -> 1; false -> 0 end,
+     ale_util:keyword_get(Options, delay_us, -1),
+     ale_util:keyword_get(Options, speed_hz, -1),
+     ale_util:keyword_get(Options, bits_per_word, -1),
+     ale_util:keyword_get(Options, tx_nbits, -1),
+     ale_util:keyword_get(Options, rx_nbits, -1)};
+port_segment(Segment) ->
+    port_segment({Segment, []}).
+
+segment_data(Data) when is_binary(Data) ->
+    {Data, byte_size(Data)};
+segment_data({write, Data}) when is_binary(Data) ->
+    {Data, 0};
+segment_data({read, Len}) when is_integer(Len) ->
+    {<<>>, Len}.
+
+handle_notification({spi_samples, Timestamp, Overruns, Samples}, State) ->
+    notify(State#state.stream_pid, {spi_samples, self(), Timestamp, Overruns, Samples});
+handle_notification({spi_trigger, Timestamp, Result}, State) ->
+    notify(State#state.trigger_pid, {spi_trigger, self(), Timestamp, Result}).
+
+flush_notifications(#state{port=Port}=State) ->
+    receive
+        {Port, {data, <<?NOTIFICATION, Msg/binary>>}} ->
+            handle_notification(binary_to_term(Msg), State),
+            flush_notifications(State)
+    after 0 ->
+            ok
+    end.
 
 call_port(Port, Command, Args) ->
     Message = {Command, Args},
     erlang:send(Port, {self(), {command, term_to_binary(Message)}}),
     receive
-        {_, {data, Response}} -> binary_to_term(Response)
+        {Port, {data, <<?REPLY, Response/binary>>}} -> binary_to_term(Response)
     end.